@@ -0,0 +1,179 @@
+#include "clock.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* what a connection took, in seconds; connect is -1 on failure */
+struct bench_sample {
+	double connect;
+	double response;
+	/* response status code, 0 if there was none */
+	int status;
+};
+
+double bench_now(void) {
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (double) tp.tv_sec + (double) tp.tv_nsec / 1000000000.0;
+}
+
+/* Opens a fresh connection, sends the request and reads the response
+ * headers.
+ */
+struct bench_sample bench_one(
+	const struct sockaddr_in *addr,
+	const char *req
+) {
+	struct bench_sample s;
+	char buf[4096];
+	double b = bench_now();
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	s.connect = -1.0;
+	s.response = -1.0;
+	s.status = 0;
+	if (fd == -1) {
+		return s;
+	}
+	if (connect(
+		fd,
+		(const struct sockaddr *) addr,
+		sizeof(*addr)
+	) == -1) {
+		close(fd);
+		return s;
+	}
+	s.connect = bench_now() - b;
+	if (write(fd, req, strlen(req)) == (ssize_t) strlen(req)) {
+		size_t off = 0;
+		ssize_t r;
+		/* the server keeps the connection alive regardless, so
+		 * stop at the end of the headers
+		 */
+		while (
+			off < sizeof(buf) - 1 &&
+			(r = read(fd, &(buf[off]), sizeof(buf) - 1 - off)) > 0
+		) {
+			off += r;
+			buf[off] = '\0';
+			if (strstr(buf, "\r\n\r\n") != NULL) {
+				s.response = bench_now() - b;
+				sscanf(buf, "HTTP/%*d.%*d %d", &(s.status));
+				break;
+			}
+		}
+	}
+	close(fd);
+	return s;
+}
+
+int bench_cmp(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+/* prints percentiles of the n samples in ms, sorting them */
+void bench_print(const char *name, double *v, size_t n) {
+	if (n == 0) {
+		printf("%-10s no samples\n", name);
+		return;
+	}
+	qsort(v, n, sizeof(*v), bench_cmp);
+	printf(
+		"%-10s p50 %8.3fms  p90 %8.3fms  p99 %8.3fms  max %8.3fms\n",
+		name,
+		v[n / 2] * 1000.0,
+		v[n * 9 / 10] * 1000.0,
+		v[n * 99 / 100] * 1000.0,
+		v[n - 1] * 1000.0
+	);
+}
+
+int main(int argc, char **argv) {
+	struct sockaddr_in addr;
+	struct bench_sample s;
+	char req[512];
+	double *conn, *resp, b, dt;
+	size_t i, total, nconn = 0, nresp = 0, nerr = 0;
+	int pfd[2], p, parallel;
+	if (argc < 2) {
+		fprintf(
+			stderr,
+			"Usage: %s <port> [connections] [parallel] [path]\n",
+			argv[0]
+		);
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(atoi(argv[1]));
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	total = (argc > 2) ? strtoul(argv[2], NULL, 10) : 1000;
+	parallel = (argc > 3) ? atoi(argv[3]) : 1;
+	if (total == 0 || parallel <= 0) {
+		fprintf(stderr, "Need at least one connection and client\n");
+		return 1;
+	}
+	snprintf(
+		req,
+		sizeof(req),
+		"GET %s HTTP/1.1\r\nHost: bench\r\nConnection: close\r\n\r\n",
+		(argc > 4) ? argv[4] : "/"
+	);
+	conn = calloc(total, sizeof(*conn));
+	resp = calloc(total, sizeof(*resp));
+	if (conn == NULL || resp == NULL || pipe(pfd) == -1) {
+		perror("bench");
+		return 1;
+	}
+	b = bench_now();
+	/* every client reports its samples down the pipe */
+	for (p = 0; p < parallel; p += 1) {
+		if (fork() == 0) {
+			close(pfd[0]);
+			for (i = p; i < total; i += parallel) {
+				s = bench_one(&addr, req);
+				if (write(pfd[1], &s, sizeof(s)) != sizeof(s)) {
+					_exit(1);
+				}
+			}
+			_exit(0);
+		}
+	}
+	close(pfd[1]);
+	while (read(pfd[0], &s, sizeof(s)) == sizeof(s)) {
+		if (s.connect >= 0.0) {
+			conn[nconn++] = s.connect;
+		}
+		if (s.response >= 0.0) {
+			resp[nresp++] = s.response;
+		}
+		if (s.status >= 500) {
+			nerr += 1;
+		}
+	}
+	for (; wait(NULL) > 0;);
+	dt = bench_now() - b;
+	printf(
+		"%lu connections, %d clients, %lu failed, %lu 5xx, "
+		"%.3fs, %.0f conn/s\n",
+		(unsigned long) total,
+		parallel,
+		(unsigned long) (total - nresp),
+		(unsigned long) nerr,
+		dt,
+		(double) total / dt
+	);
+	bench_print("connect", conn, nconn);
+	bench_print("response", resp, nresp);
+	free(conn);
+	free(resp);
+	return 0;
+}
+
+/* vi: set sts=8 ts=8 sw=8 noexpandtab: */
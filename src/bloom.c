@@ -0,0 +1,255 @@
+#include "bloom.h"
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/* Required for OSX. */
+#ifndef MAP_ANONYMOUS
+#	define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* bits per expected entry and hash functions, about 1% false positives */
+#define BLOOM_BITS_PER_ENTRY 10
+#define BLOOM_HASHES 7
+/* how deep the trees are walked */
+#define BLOOM_MAX_DEPTH 8
+
+/* Maps a filter sized for the expected number of entries in shared
+ * memory, so that it is visible to all workers and their children.
+ * Returns NULL on error.
+ */
+struct bloom *bloom_create(size_t entries) {
+	struct bloom *b;
+	size_t nbits = 1024, len;
+	unsigned char *bits;
+	while (nbits < entries * BLOOM_BITS_PER_ENTRY) {
+		nbits <<= 1;
+	}
+	len = sizeof(*b) + 2 * (nbits / 8);
+	b = mmap(
+		NULL,
+		len,
+		PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS,
+		-1,
+		0
+	);
+	if (b == MAP_FAILED) {
+		return NULL;
+	}
+	memset(b, 0, sizeof(*b));
+	bits = (unsigned char *) &(b[1]);
+	b->nbits = nbits;
+	b->k = BLOOM_HASHES;
+	b->_bits[0] = bits;
+	b->_bits[1] = &(bits[nbits / 8]);
+	return b;
+}
+
+int bloom_destroy(struct bloom *b) {
+	if (b == NULL) {
+		return 1;
+	}
+	return munmap(b, sizeof(*b) + 2 * (b->nbits / 8)) == 0;
+}
+
+/* Stores the filter key of a rewritten [ei]/<shard>/<code> path in buf,
+ * which is <tree>/<code>. Returns 1 on success, 0 if the path is not
+ * in a URL tree or the key does not fit.
+ */
+int bloom_key(char *buf, size_t len, const char *path) {
+	const char *code;
+	size_t clen;
+	if (
+		path == NULL ||
+		(path[0] != 'e' && path[0] != 'i') ||
+		path[1] != '/'
+	) {
+		return 0;
+	}
+	code = strrchr(path, '/');
+	clen = strlen(&(code[1]));
+	if (clen == 0 || clen + 3 > len) {
+		return 0;
+	}
+	buf[0] = path[0];
+	buf[1] = '/';
+	memcpy(&(buf[2]), &(code[1]), clen + 1);
+	return 1;
+}
+
+/* FNV-1a for the first hash, a finalizer mix of it for the second;
+ * the k hashes are then derived by double hashing
+ */
+void bloom_hash(const char *key, uint64_t *h1, uint64_t *h2) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (; *key != '\0'; key += 1) {
+		h ^= (unsigned char) *key;
+		h *= 0x100000001b3ULL;
+	}
+	*h1 = h;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	*h2 = h | 1;
+}
+
+void bloom_set(struct bloom *b, unsigned char *bits, const char *key) {
+	uint64_t h1, h2;
+	unsigned int i;
+	bloom_hash(key, &h1, &h2);
+	for (i = 0; i < b->k; i += 1) {
+		uint64_t bit = (h1 + i * h2) & (b->nbits - 1);
+		__atomic_fetch_or(
+			&(bits[bit >> 3]),
+			(unsigned char) (1 << (bit & 7)),
+			__ATOMIC_RELAXED
+		);
+	}
+}
+
+/* Adds a key to both buffers, so that a rebuild running at the same
+ * time won't lose it.
+ */
+void bloom_add(struct bloom *b, const char *key) {
+	bloom_set(b, b->_bits[0], key);
+	bloom_set(b, b->_bits[1], key);
+}
+
+/* Returns 0 if the key is definitely not in the filter, 1 if it may
+ * be.
+ */
+int bloom_check(struct bloom *b, const char *key) {
+	const unsigned char *bits;
+	uint64_t h1, h2;
+	unsigned int i;
+	__atomic_fetch_add(&(b->checks), 1, __ATOMIC_RELAXED);
+	bits = b->_bits[__atomic_load_n(&(b->active), __ATOMIC_ACQUIRE)];
+	bloom_hash(key, &h1, &h2);
+	for (i = 0; i < b->k; i += 1) {
+		uint64_t bit = (h1 + i * h2) & (b->nbits - 1);
+		unsigned char byte = __atomic_load_n(
+			&(bits[bit >> 3]),
+			__ATOMIC_RELAXED
+		);
+		if ((byte & (1 << (bit & 7))) == 0) {
+			__atomic_fetch_add(
+				&(b->misses),
+				1,
+				__ATOMIC_RELAXED
+			);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* records that a key the filter let through did not exist */
+void bloom_falsepos(struct bloom *b) {
+	__atomic_fetch_add(&(b->falsepos), 1, __ATOMIC_RELAXED);
+}
+
+/* Adds every regular file under the directory fd to bits, with the
+ * tree character as the key prefix. Returns the number of keys added.
+ */
+long bloom_walk(
+	struct bloom *b,
+	unsigned char *bits,
+	int fd,
+	char tree,
+	int depth,
+	int flat
+) {
+	char key[NAME_MAX + 3];
+	struct dirent *de;
+	long ret = 0;
+	DIR *d;
+	int dfd = openat(fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dfd == -1) {
+		return 0;
+	}
+	d = fdopendir(dfd);
+	if (d == NULL) {
+		close(dfd);
+		return 0;
+	}
+	key[0] = tree;
+	key[1] = '/';
+	while ((de = readdir(d)) != NULL) {
+		int isdir = 0;
+		if (de->d_name[0] == '.') {
+			continue;
+		}
+#ifdef DT_DIR
+		if (de->d_type == DT_DIR) {
+			isdir = 1;
+		} else if (de->d_type == DT_UNKNOWN)
+#endif
+		{
+			struct stat s;
+			if (fstatat(dfd, de->d_name, &s, 0) == 0) {
+				isdir = S_ISDIR(s.st_mode);
+			}
+		}
+		if (isdir && depth < BLOOM_MAX_DEPTH) {
+			int sfd = openat(
+				dfd,
+				de->d_name,
+				O_RDONLY | O_DIRECTORY | O_CLOEXEC
+			);
+			if (sfd != -1) {
+				ret += bloom_walk(
+					b,
+					bits,
+					sfd,
+					tree,
+					depth + 1,
+					flat
+				);
+				close(sfd);
+			}
+		} else if (!isdir && (depth > 0 || flat)) {
+			/* files right under the tree are only reachable
+			 * in flat trees
+			 */
+			strncpy(&(key[2]), de->d_name, sizeof(key) - 2);
+			key[sizeof(key) - 1] = '\0';
+			bloom_set(b, bits, key);
+			ret += 1;
+		}
+	}
+	closedir(d);
+	return ret;
+}
+
+/* Rebuilds the inactive buffer from the /e/ and /i/ tree directories,
+ * flat ones if the shard scheme has no levels, and makes it the active
+ * one. Only one process may rebuild at a time. Returns the number of
+ * keys found.
+ */
+long bloom_rebuild(struct bloom *b, int efd, int ifd, int flat) {
+	int next = !b->active;
+	unsigned char *bits = b->_bits[next];
+	long ret = 0;
+	memset(bits, 0, b->nbits / 8);
+	if (efd != -1) {
+		ret += bloom_walk(b, bits, efd, 'e', 0, flat);
+	}
+	if (ifd != -1) {
+		ret += bloom_walk(b, bits, ifd, 'i', 0, flat);
+	}
+	b->entries = ret;
+	__atomic_store_n(&(b->active), next, __ATOMIC_RELEASE);
+	return ret;
+}
+
+/* vi: set sts=8 ts=8 sw=8 noexpandtab: */
@@ -0,0 +1,41 @@
+#ifndef __mekdotlu_bloom_h
+#define __mekdotlu_bloom_h
+
+#include <stddef.h>
+
+/* a Bloom filter of short codes in shared memory
+ *
+ * keys are `<tree>/<code>', e.g. `e/aeiou'
+ */
+struct bloom {
+	/* number of bits per buffer, a power of two */
+	size_t nbits;
+	/* number of hash functions */
+	unsigned int k;
+	/* index of the buffer lookups go to; rebuilds fill the other one
+	 * and then swap them
+	 */
+	int active;
+	/* number of keys added during the last rebuild */
+	unsigned long entries;
+	/* lookups, definite misses and false positives */
+	unsigned long checks;
+	unsigned long misses;
+	unsigned long falsepos;
+	/* two buffers of nbits bits each */
+	unsigned char *_bits[2];
+};
+
+struct bloom *bloom_create(size_t entries);
+int bloom_destroy(struct bloom *b);
+
+int bloom_key(char *buf, size_t len, const char *path);
+void bloom_add(struct bloom *b, const char *key);
+int bloom_check(struct bloom *b, const char *key);
+void bloom_falsepos(struct bloom *b);
+
+long bloom_rebuild(struct bloom *b, int efd, int ifd, int flat);
+
+#endif /* __mekdotlu_bloom_h */
+
+/* vi: set sts=8 ts=8 sw=8 noexpandtab: */
@@ -0,0 +1,145 @@
+#include "cache.h"
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* Required for OSX. */
+#ifndef MAP_ANONYMOUS
+#	define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* nanoseconds of the modification time */
+#if defined(__APPLE__)
+#	define CACHE_MTIME_NS(_s) ((_s)->st_mtimespec.tv_nsec)
+#else
+#	define CACHE_MTIME_NS(_s) ((_s)->st_mtim.tv_nsec)
+#endif
+
+/* Maps a cache of the given number of entries in shared memory.
+ * Returns NULL on error.
+ */
+struct cache *cache_create(size_t entries) {
+	struct cache *c;
+	size_t len = sizeof(*c) + entries * sizeof(struct cache_slot);
+	c = mmap(
+		NULL,
+		len,
+		PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS,
+		-1,
+		0
+	);
+	if (c == MAP_FAILED) {
+		return NULL;
+	}
+	memset(c, 0, sizeof(*c));
+	c->nslots = entries;
+	c->_slots = (struct cache_slot *) &(c[1]);
+	return c;
+}
+
+int cache_destroy(struct cache *c) {
+	if (c == NULL) {
+		return 1;
+	}
+	return munmap(
+		c,
+		sizeof(*c) + c->nslots * sizeof(struct cache_slot)
+	) == 0;
+}
+
+struct cache_slot *cache_slot(struct cache *c, const char *key) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (; *key != '\0'; key += 1) {
+		h ^= (unsigned char) *key;
+		h *= 0x100000001b3ULL;
+	}
+	return &(c->_slots[h % c->nslots]);
+}
+
+/* Copies the response for key into resp if it was rendered from the
+ * file s describes. Returns 1 on a hit, 0 otherwise.
+ */
+int cache_get(
+	struct cache *c,
+	const char *key,
+	const struct stat *s,
+	struct cache_resp *resp
+) {
+	struct cache_slot *slot = cache_slot(c, key);
+	unsigned int seq;
+	int hit;
+	seq = __atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE);
+	hit = (
+		(seq & 1) == 0 &&
+		slot->ino == s->st_ino &&
+		slot->size == s->st_size &&
+		slot->mtime == s->st_mtime &&
+		slot->mtime_ns == CACHE_MTIME_NS(s) &&
+		strncmp(slot->key, key, CACHE_KEY_MAX) == 0
+	);
+	if (hit) {
+		resp->code = slot->resp.code;
+		resp->date_off = slot->resp.date_off;
+		resp->len = slot->resp.len;
+		if (resp->len > CACHE_IMAGE_MAX) {
+			hit = 0;
+		} else {
+			memcpy(resp->image, slot->resp.image, resp->len);
+		}
+	}
+	/* a writer got in the way */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (hit && __atomic_load_n(&(slot->seq), __ATOMIC_RELAXED) != seq) {
+		hit = 0;
+	}
+	__atomic_fetch_add(
+		hit ? &(c->hits) : &(c->misses),
+		1,
+		__ATOMIC_RELAXED
+	);
+	return hit;
+}
+
+/* Stores the response for key rendered from the file s describes,
+ * unless another process is writing the same slot.
+ */
+void cache_put(
+	struct cache *c,
+	const char *key,
+	const struct stat *s,
+	const struct cache_resp *resp
+) {
+	struct cache_slot *slot = cache_slot(c, key);
+	unsigned int seq;
+	if (strlen(key) >= CACHE_KEY_MAX || resp->len > CACHE_IMAGE_MAX) {
+		return;
+	}
+	seq = __atomic_load_n(&(slot->seq), __ATOMIC_RELAXED);
+	if (
+		(seq & 1) != 0 ||
+		!__atomic_compare_exchange_n(
+			&(slot->seq),
+			&seq,
+			seq + 1,
+			0,
+			__ATOMIC_ACQUIRE,
+			__ATOMIC_RELAXED
+		)
+	) {
+		return;
+	}
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->ino = s->st_ino;
+	slot->size = s->st_size;
+	slot->mtime = s->st_mtime;
+	slot->mtime_ns = CACHE_MTIME_NS(s);
+	strcpy(slot->key, key);
+	slot->resp.code = resp->code;
+	slot->resp.date_off = resp->date_off;
+	slot->resp.len = resp->len;
+	memcpy(slot->resp.image, resp->image, resp->len);
+	__atomic_store_n(&(slot->seq), seq + 2, __ATOMIC_RELEASE);
+}
+
+/* vi: set sts=8 ts=8 sw=8 noexpandtab: */
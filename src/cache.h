@@ -0,0 +1,70 @@
+#ifndef __mekdotlu_cache_h
+#define __mekdotlu_cache_h
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* longest rewritten path and response image kept */
+#define CACHE_KEY_MAX 128
+#define CACHE_IMAGE_MAX 1024
+/* length of an HTTP date, e.g. `Sun, 06 Nov 1994 08:49:37 GMT' */
+#define CACHE_DATE_LEN 29
+
+/* a pre-rendered redirect response
+ *
+ * the image holds everything up to the Connection header; the minor
+ * HTTP version digit at offset 7 and the Date at date_off are filled
+ * in per request
+ */
+struct cache_resp {
+	int code;
+	size_t date_off;
+	size_t len;
+	char image[CACHE_IMAGE_MAX];
+};
+
+/* one entry per slot, guarded by a sequence counter that is odd while
+ * the entry is being written
+ */
+struct cache_slot {
+	unsigned int seq;
+	/* identity of the redirect file the image was rendered from */
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	long mtime_ns;
+	char key[CACHE_KEY_MAX];
+	struct cache_resp resp;
+};
+
+/* a direct-mapped cache of pre-rendered redirect responses in shared
+ * memory, keyed by rewritten path
+ */
+struct cache {
+	size_t nslots;
+	/* lookups served from the cache, and ones that were not */
+	unsigned long hits;
+	unsigned long misses;
+	struct cache_slot *_slots;
+};
+
+struct cache *cache_create(size_t entries);
+int cache_destroy(struct cache *c);
+
+int cache_get(
+	struct cache *c,
+	const char *key,
+	const struct stat *s,
+	struct cache_resp *resp
+);
+void cache_put(
+	struct cache *c,
+	const char *key,
+	const struct stat *s,
+	const struct cache_resp *resp
+);
+
+#endif /* __mekdotlu_cache_h */
+
+/* vi: set sts=8 ts=8 sw=8 noexpandtab: */
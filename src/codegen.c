@@ -0,0 +1,189 @@
+#include "codegen.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+/* Required for OSX. */
+#ifndef MAP_ANONYMOUS
+#	define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* the counters this thread has reserved, [next, end) */
+static __thread uint64_t codegen_batch_next = 0;
+static __thread uint64_t codegen_batch_end = 0;
+
+/* Returns 1 if c may appear in a short code. Anything the rewrite or
+ * the URL parser treats specially is out.
+ */
+int codegen_allowed(char c) {
+	return (c >= '0' && c <= '9') ||
+		(c >= 'A' && c <= 'Z') ||
+		(c >= 'a' && c <= 'z') ||
+		c == '-' || c == '_' || c == '~';
+}
+
+/* Parses a `<len>[:<alphabet>]' generator spec. The alphabet points
+ * into str, or to the default one. Returns 1 on success, 0 otherwise.
+ */
+int codegen_parse(const char *str, unsigned int *len, const char **alphabet) {
+	int n = 0;
+	if (sscanf(str, "%u%n", len, &n) != 1) {
+		return 0;
+	}
+	if (str[n] == ':') {
+		*alphabet = &(str[n + 1]);
+	} else if (str[n] == '\0') {
+		*alphabet = CODEGEN_ALPHABET;
+	} else {
+		return 0;
+	}
+	return 1;
+}
+
+/* Maps a generator in shared memory. The secret keys the permutation
+ * and needs to stay the same across restarts. Returns NULL on error
+ * with errno set, e.g. EINVAL for a bad alphabet or a code space that
+ * does not fit in 62 bits.
+ */
+struct codegen *codegen_create(
+	unsigned int len,
+	const char *alphabet,
+	const char *secret
+) {
+	struct codegen *g;
+	size_t i, j, radix = strlen(alphabet);
+	uint64_t space = 1, h = 0xcbf29ce484222325ULL;
+	unsigned int bits = 0;
+	/* the rewrite takes the first three code points as the shard */
+	if (len < 3 || radix < 2 || radix >= sizeof(g->alphabet)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	for (i = 0; i < radix; i += 1) {
+		if (codegen_allowed(alphabet[i]) == 0) {
+			errno = EINVAL;
+			return NULL;
+		}
+		for (j = 0; j < i; j += 1) {
+			if (alphabet[i] == alphabet[j]) {
+				errno = EINVAL;
+				return NULL;
+			}
+		}
+	}
+	for (i = 0; i < len; i += 1) {
+		if (space > (UINT64_C(1) << 62) / radix) {
+			errno = EINVAL;
+			return NULL;
+		}
+		space *= radix;
+	}
+	while ((UINT64_C(1) << bits) < space) {
+		bits += 1;
+	}
+	g = mmap(
+		NULL,
+		sizeof(*g),
+		PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS,
+		-1,
+		0
+	);
+	if (g == MAP_FAILED) {
+		return NULL;
+	}
+	memset(g, 0, sizeof(*g));
+	g->len = len;
+	g->radix = radix;
+	memcpy(g->alphabet, alphabet, radix);
+	g->space = space;
+	g->half = (bits + 1) / 2;
+	/* round keys from the secret */
+	for (; secret != NULL && *secret != '\0'; secret += 1) {
+		h ^= (unsigned char) *secret;
+		h *= 0x100000001b3ULL;
+	}
+	for (i = 0; i < 4; i += 1) {
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		g->keys[i] = h;
+	}
+	return g;
+}
+
+int codegen_destroy(struct codegen *g) {
+	if (g == NULL) {
+		return 1;
+	}
+	return munmap(g, sizeof(*g)) == 0;
+}
+
+/* Sets the counter, e.g. past every code handed out so far. Only call
+ * this before the workers start.
+ */
+void codegen_seed(struct codegen *g, uint64_t next) {
+	g->next = next;
+}
+
+/* A four round Feistel network on 2 * half bits, cycle walked until
+ * the result lands within the code space again. A bijection on the
+ * code space, so distinct counters give distinct codes.
+ */
+uint64_t codegen_permute(const struct codegen *g, uint64_t n) {
+	uint64_t mask = (UINT64_C(1) << g->half) - 1;
+	do {
+		uint64_t l = n >> g->half, r = n & mask;
+		int i;
+		for (i = 0; i < 4; i += 1) {
+			uint64_t f = (r ^ g->keys[i]) * 0x9e3779b97f4a7c15ULL;
+			uint64_t t = l ^ ((f ^ (f >> 29)) & mask);
+			l = r;
+			r = t;
+		}
+		n = (l << g->half) | r;
+	} while (n >= g->space);
+	return n;
+}
+
+/* Stores the next code in buf, which needs to hold len + 1 bytes.
+ * Counters are reserved from the shared one CODEGEN_BATCH at a time,
+ * so processes rarely contend on it. A process may well exit with most
+ * of its batch unused, so end is set to where the batch ends, for the
+ * caller to persist and seed the counter past after a restart. Returns
+ * the code length, or -1 if buf is too small or the code space is
+ * exhausted.
+ */
+int codegen_next(struct codegen *g, char *buf, size_t len, uint64_t *end) {
+	uint64_t n;
+	int i;
+	if (len < g->len + 1) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	if (codegen_batch_next == codegen_batch_end) {
+		codegen_batch_next = __atomic_fetch_add(
+			&(g->next),
+			CODEGEN_BATCH,
+			__ATOMIC_RELAXED
+		);
+		codegen_batch_end = codegen_batch_next + CODEGEN_BATCH;
+	}
+	n = codegen_batch_next;
+	codegen_batch_next += 1;
+	*end = codegen_batch_end;
+	if (n >= g->space) {
+		errno = ENOSPC;
+		return -1;
+	}
+	n = codegen_permute(g, n);
+	for (i = g->len - 1; i >= 0; i -= 1) {
+		buf[i] = g->alphabet[n % g->radix];
+		n /= g->radix;
+	}
+	buf[g->len] = '\0';
+	return g->len;
+}
+
+/* vi: set sts=8 ts=8 sw=8 noexpandtab: */
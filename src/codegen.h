@@ -0,0 +1,46 @@
+#ifndef __mekdotlu_codegen_h
+#define __mekdotlu_codegen_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* default code length and alphabet */
+#define CODEGEN_LEN 6
+#define CODEGEN_ALPHABET \
+	"0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+/* codes handed to a process at a time */
+#define CODEGEN_BATCH 16
+
+/* a short code generator in shared memory
+ *
+ * codes are a counter run through a keyed permutation of the code
+ * space, so consecutive codes look nothing alike
+ */
+struct codegen {
+	/* next counter value not reserved by any process */
+	uint64_t next;
+	/* code length and alphabet */
+	unsigned int len;
+	unsigned int radix;
+	char alphabet[96];
+	/* radix^len */
+	uint64_t space;
+	/* the permutation works on 2 * half bits */
+	unsigned int half;
+	uint64_t keys[4];
+};
+
+struct codegen *codegen_create(
+	unsigned int len,
+	const char *alphabet,
+	const char *secret
+);
+int codegen_destroy(struct codegen *g);
+
+int codegen_parse(const char *str, unsigned int *len, const char **alphabet);
+void codegen_seed(struct codegen *g, uint64_t next);
+int codegen_next(struct codegen *g, char *buf, size_t len, uint64_t *end);
+
+#endif /* __mekdotlu_codegen_h */
+
+/* vi: set sts=8 ts=8 sw=8 noexpandtab: */
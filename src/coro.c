@@ -0,0 +1,372 @@
+#include "coro.h"
+#include "clock.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#if defined(__linux)
+#	include <ucontext.h>
+#	include <sys/epoll.h>
+#endif
+
+/* Required for OSX. */
+#ifndef MAP_ANONYMOUS
+#	define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* the scheduler running on this thread, set while it runs a coroutine */
+static __thread struct coro_sched *coro_sched_cur = NULL;
+
+double coro_now(void) {
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (double) tp.tv_sec + (double) tp.tv_nsec / 1000000000.0;
+}
+
+int coro_active(void) {
+	return coro_sched_cur != NULL && coro_sched_cur->current != NULL;
+}
+
+#if defined(__linux)
+
+#define CORO_WAITING 1
+#define CORO_RUNNING 2
+#define CORO_DONE 3
+/* most events taken per coro_run */
+#define CORO_EVENTS 64
+
+struct coro {
+	ucontext_t ctx;
+	uint32_t id;
+	/* the stack, its guard page included */
+	char *map;
+	size_t maplen;
+	coro_fn fn;
+	void *arg;
+	int state;
+	/* the descriptor it waits on, and the last one it registered
+	 * with epoll, which forgets descriptors once they are closed
+	 */
+	int fd;
+	int registered;
+	/* when to give up waiting, 0 for never */
+	double timeout;
+	/* poll events it was woken up with, 0 on timeout */
+	int revents;
+	/* whatever the code it runs wants to keep per coroutine */
+	void *local;
+	struct coro *next;
+};
+
+/* where the scheduler continues when a coroutine yields or returns */
+static __thread ucontext_t coro_main;
+
+/* Sets up a scheduler of coroutines with stacks of stack bytes each.
+ * Returns NULL on error.
+ */
+struct coro_sched *coro_sched_create(size_t stack) {
+	struct coro_sched *s;
+	size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	s = calloc(1, sizeof(*s));
+	if (s == NULL) {
+		return NULL;
+	}
+	s->stack = (stack + page - 1) / page * page;
+	s->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (s->epfd == -1) {
+		free(s);
+		return NULL;
+	}
+	return s;
+}
+
+void coro_sched_destroy(struct coro_sched *s) {
+	size_t i;
+	if (s == NULL) {
+		return;
+	}
+	for (i = 0; i < s->nall; i += 1) {
+		munmap(s->all[i]->map, s->all[i]->maplen);
+		free(s->all[i]);
+	}
+	free(s->all);
+	close(s->epfd);
+	free(s);
+}
+
+/* takes a coroutine off the free list, or makes a new one */
+struct coro *coro_alloc(struct coro_sched *s) {
+	size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	struct coro *c;
+	if (s->free != NULL) {
+		c = s->free;
+		s->free = c->next;
+		return c;
+	}
+	if (s->nall == s->capall) {
+		size_t cap = (s->capall > 0) ? s->capall * 2 : 64;
+		struct coro **all = realloc(s->all, cap * sizeof(*all));
+		if (all == NULL) {
+			return NULL;
+		}
+		s->all = all;
+		s->capall = cap;
+	}
+	c = calloc(1, sizeof(*c));
+	if (c == NULL) {
+		return NULL;
+	}
+	c->maplen = s->stack + page;
+	c->map = mmap(
+		NULL,
+		c->maplen,
+		PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS,
+		-1,
+		0
+	);
+	if (c->map == MAP_FAILED) {
+		free(c);
+		return NULL;
+	}
+	/* overflowing the stack faults rather than corrupting memory */
+	mprotect(c->map, page, PROT_NONE);
+	c->id = s->nall;
+	c->registered = -1;
+	s->all[s->nall] = c;
+	s->nall += 1;
+	return c;
+}
+
+void coro_entry(void) {
+	struct coro *c = coro_sched_cur->current;
+	c->fn(c->arg);
+	c->state = CORO_DONE;
+	/* uc_link takes it back to the scheduler */
+}
+
+/* runs c until it yields or returns, recycling it in the latter case */
+void coro_resume(struct coro_sched *s, struct coro *c) {
+	s->current = c;
+	s->switches += 1;
+	c->state = CORO_RUNNING;
+	coro_sched_cur = s;
+	swapcontext(&coro_main, &(c->ctx));
+	s->current = NULL;
+	if (c->state == CORO_DONE) {
+		c->local = NULL;
+		c->fd = -1;
+		c->timeout = 0.0;
+		c->next = s->free;
+		s->free = c;
+		s->count -= 1;
+	}
+}
+
+/* Starts fn(arg) in a new coroutine, running it until it first yields.
+ * Returns 1 on success, 0 otherwise.
+ */
+int coro_spawn(struct coro_sched *s, coro_fn fn, void *arg) {
+	struct coro *c = coro_alloc(s);
+	if (c == NULL) {
+		return 0;
+	}
+	if (getcontext(&(c->ctx)) == -1) {
+		c->next = s->free;
+		s->free = c;
+		return 0;
+	}
+	c->ctx.uc_stack.ss_sp = c->map + (c->maplen - s->stack);
+	c->ctx.uc_stack.ss_size = s->stack;
+	c->ctx.uc_link = &coro_main;
+	makecontext(&(c->ctx), coro_entry, 0);
+	c->fn = fn;
+	c->arg = arg;
+	c->fd = -1;
+	c->timeout = 0.0;
+	c->local = NULL;
+	s->count += 1;
+	s->spawned += 1;
+	coro_resume(s, c);
+	return 1;
+}
+
+/* Yields until fd has any of the poll events asked for, or timeout
+ * milliseconds have passed if it isn't negative. Returns the events,
+ * 0 on timeout, or -1 on error or outside of a coroutine.
+ */
+int coro_wait(int fd, int events, int timeout) {
+	struct coro_sched *s = coro_sched_cur;
+	struct coro *c = (s != NULL) ? s->current : NULL;
+	struct epoll_event ev;
+	int op;
+	if (c == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(&ev, 0, sizeof(ev));
+	/* one-shot, so a coroutine only hears about what it waits for */
+	ev.events = EPOLLONESHOT;
+	if (events & POLLIN) {
+		ev.events |= EPOLLIN;
+	}
+	if (events & POLLOUT) {
+		ev.events |= EPOLLOUT;
+	}
+	ev.data.u64 = ((uint64_t) c->id << 32) | (uint32_t) fd;
+	op = (c->registered == fd) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	if (epoll_ctl(s->epfd, op, fd, &ev) == -1) {
+		op = (errno == ENOENT) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+		if (
+			(errno != ENOENT && errno != EEXIST) ||
+			epoll_ctl(s->epfd, op, fd, &ev) == -1
+		) {
+			return -1;
+		}
+	}
+	c->registered = fd;
+	c->fd = fd;
+	c->revents = 0;
+	c->timeout = 0.0;
+	if (timeout >= 0) {
+		c->timeout = coro_now() + (double) timeout / 1000.0;
+		if (s->next_timeout == 0.0 || c->timeout < s->next_timeout) {
+			s->next_timeout = c->timeout;
+		}
+	}
+	c->state = CORO_WAITING;
+	swapcontext(&(c->ctx), &coro_main);
+	return c->revents;
+}
+
+/* Resumes the coroutines whose descriptors are ready or whose timeouts
+ * have passed, without blocking. Returns the number of coroutines
+ * resumed.
+ */
+int coro_run(struct coro_sched *s) {
+	struct epoll_event evs[CORO_EVENTS];
+	int n, i, ret = 0;
+	double now;
+	n = epoll_wait(s->epfd, evs, CORO_EVENTS, 0);
+	for (i = 0; i < n; i += 1) {
+		uint32_t id = (uint32_t) (evs[i].data.u64 >> 32);
+		int fd = (int) (uint32_t) evs[i].data.u64;
+		struct coro *c;
+		if (id >= s->nall) {
+			continue;
+		}
+		c = s->all[id];
+		/* left over from a wait that timed out */
+		if (c->state != CORO_WAITING || c->fd != fd) {
+			continue;
+		}
+		c->revents = 0;
+		if (evs[i].events & EPOLLIN) {
+			c->revents |= POLLIN;
+		}
+		if (evs[i].events & EPOLLOUT) {
+			c->revents |= POLLOUT;
+		}
+		if (evs[i].events & EPOLLHUP) {
+			c->revents |= POLLHUP;
+		}
+		if (evs[i].events & EPOLLERR) {
+			c->revents |= POLLERR;
+		}
+		c->timeout = 0.0;
+		coro_resume(s, c);
+		ret += 1;
+	}
+	if (s->next_timeout == 0.0 || (now = coro_now()) < s->next_timeout) {
+		return ret;
+	}
+	/* the earliest timeout passed, look for any others that did too;
+	 * coroutines waiting again set it anew
+	 */
+	s->next_timeout = 0.0;
+	for (i = 0; (size_t) i < s->nall; i += 1) {
+		struct coro *c = s->all[i];
+		if (c->state != CORO_WAITING || c->timeout == 0.0) {
+			continue;
+		}
+		if (now >= c->timeout) {
+			c->revents = 0;
+			c->timeout = 0.0;
+			s->timeouts += 1;
+			coro_resume(s, c);
+			ret += 1;
+		} else if (
+			s->next_timeout == 0.0 ||
+			c->timeout < s->next_timeout
+		) {
+			s->next_timeout = c->timeout;
+		}
+	}
+	return ret;
+}
+
+#else /* defined(__linux) */
+
+struct coro_sched *coro_sched_create(size_t stack) {
+	(void) stack;
+	errno = ENOSYS;
+	return NULL;
+}
+
+void coro_sched_destroy(struct coro_sched *s) {
+	(void) s;
+}
+
+int coro_spawn(struct coro_sched *s, coro_fn fn, void *arg) {
+	(void) s;
+	(void) fn;
+	(void) arg;
+	return 0;
+}
+
+int coro_wait(int fd, int events, int timeout) {
+	(void) fd;
+	(void) events;
+	(void) timeout;
+	errno = ENOSYS;
+	return -1;
+}
+
+int coro_run(struct coro_sched *s) {
+	(void) s;
+	return 0;
+}
+
+#endif /* defined(__linux) */
+
+/* Returns how many milliseconds the scheduler may wait for events
+ * before a timeout is due, at most max.
+ */
+int coro_timeout(const struct coro_sched *s, int max) {
+	double ms;
+	if (s == NULL || s->next_timeout == 0.0) {
+		return max;
+	}
+	ms = (s->next_timeout - coro_now()) * 1000.0 + 1.0;
+	if (ms <= 0.0) {
+		return 0;
+	}
+	return (ms < (double) max) ? (int) ms : max;
+}
+
+/* the slot of the running coroutine for code to keep things in, NULL
+ * outside of coroutines
+ */
+void **coro_local(void) {
+#if defined(__linux)
+	if (coro_active()) {
+		return &(coro_sched_cur->current->local);
+	}
+#endif
+	return NULL;
+}
+
+/* vi: set sts=8 ts=8 sw=8 noexpandtab: */
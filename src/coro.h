@@ -0,0 +1,56 @@
+#ifndef __mekdotlu_coro_h
+#define __mekdotlu_coro_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* default stack of a coroutine, in KiB */
+#define CORO_STACK 64
+
+struct coro;
+
+/* coroutines of a worker and the epoll instance they wait on, all run
+ * by the thread that created it
+ *
+ * a coroutine yields whenever it would block on its connection, and
+ * the worker resumes it once epoll says the connection is ready or
+ * its timeout has passed
+ */
+struct coro_sched {
+	int epfd;
+	/* bytes of every stack, guard page excluded */
+	size_t stack;
+	/* every coroutine ever made, indexed by id, and the ones not in
+	 * use
+	 */
+	struct coro **all;
+	size_t nall;
+	size_t capall;
+	struct coro *free;
+	/* coroutines running, and the one that has the CPU */
+	unsigned int count;
+	struct coro *current;
+	/* earliest timeout of a waiting coroutine, 0 if none */
+	double next_timeout;
+	/* counters */
+	unsigned long spawned;
+	unsigned long switches;
+	unsigned long timeouts;
+};
+
+typedef void (*coro_fn)(void *arg);
+
+struct coro_sched *coro_sched_create(size_t stack);
+void coro_sched_destroy(struct coro_sched *s);
+
+int coro_spawn(struct coro_sched *s, coro_fn fn, void *arg);
+int coro_run(struct coro_sched *s);
+int coro_timeout(const struct coro_sched *s, int max);
+
+int coro_active(void);
+int coro_wait(int fd, int events, int timeout);
+void **coro_local(void);
+
+#endif /* __mekdotlu_coro_h */
+
+/* vi: set sts=8 ts=8 sw=8 noexpandtab: */
@@ -0,0 +1,238 @@
+/* for sched_setaffinity() and the CPU_* macros */
+#if defined(__linux) && !defined(_GNU_SOURCE)
+#	define _GNU_SOURCE
+#endif
+
+#include "cpuset.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#if defined(__linux)
+#	include <sched.h>
+#endif
+
+void cpuset_clear(struct cpuset *set) {
+	memset(set, 0, sizeof(*set));
+}
+
+int cpuset_isset(const struct cpuset *set, unsigned int cpu) {
+	if (cpu >= CPUSET_MAX) {
+		return 0;
+	}
+	return (set->bits[cpu / 8] >> (cpu % 8)) & 1;
+}
+
+void cpuset_add(struct cpuset *set, unsigned int cpu) {
+	if (!cpuset_isset(set, cpu)) {
+		set->bits[cpu / 8] |= 1 << (cpu % 8);
+		set->count += 1;
+	}
+}
+
+/* Parses a list like `0-3,8' up to a colon or the end of str into set.
+ * Returns the number of characters parsed, or -1 if the list is
+ * malformed.
+ */
+int cpuset_parse_list(const char *str, struct cpuset *set) {
+	int off = 0;
+	cpuset_clear(set);
+	for (;;) {
+		unsigned int a = 0, b = 0, cpu;
+		int n = 0, m = 0;
+		if (
+			sscanf(&(str[off]), "%u%n", &a, &n) != 1 ||
+			str[off] == '-' ||
+			str[off] == '+'
+		) {
+			return -1;
+		}
+		off += n;
+		b = a;
+		if (str[off] == '-') {
+			if (
+				sscanf(&(str[off + 1]), "%u%n", &b, &m) != 1 ||
+				str[off + 1] == '-' ||
+				str[off + 1] == '+'
+			) {
+				return -1;
+			}
+			off += 1 + m;
+		}
+		if (a > b || b >= CPUSET_MAX) {
+			return -1;
+		}
+		for (cpu = a; cpu <= b; cpu += 1) {
+			cpuset_add(set, cpu);
+		}
+		if (str[off] != ',') {
+			return off;
+		}
+		off += 1;
+	}
+}
+
+/* Parses the CPUs of the IPv4 and IPv6 workers in the
+ * `<list>[:<list>]' format, the first list going for both if there is
+ * only one. Returns 1 on success, 0 otherwise.
+ */
+int cpuset_parse(
+	const char *str,
+	struct cpuset *set4,
+	struct cpuset *set6
+) {
+	struct cpuset s4, s6;
+	int n;
+	if (str == NULL || (n = cpuset_parse_list(str, &s4)) == -1) {
+		return 0;
+	}
+	s6 = s4;
+	if (str[n] == ':') {
+		int m = cpuset_parse_list(&(str[n + 1]), &s6);
+		if (m == -1) {
+			return 0;
+		}
+		n += 1 + m;
+	}
+	if (str[n] != '\0') {
+		return 0;
+	}
+	*set4 = s4;
+	*set6 = s6;
+	return 1;
+}
+
+/* Writes set into buf as a list of ranges, truncating it if need be.
+ * Returns what snprintf would, all told.
+ */
+size_t cpuset_format(const struct cpuset *set, char *buf, size_t len) {
+	size_t off = 0;
+	unsigned int cpu = 0;
+	if (len > 0) {
+		buf[0] = '\0';
+	}
+	while (cpu < CPUSET_MAX) {
+		unsigned int end;
+		int r;
+		if (!cpuset_isset(set, cpu)) {
+			cpu += 1;
+			continue;
+		}
+		for (end = cpu; cpuset_isset(set, end + 1); end += 1);
+		r = snprintf(
+			(off < len) ? &(buf[off]) : NULL,
+			(off < len) ? len - off : 0,
+			(end == cpu) ? "%s%u" : "%s%u-%u",
+			(off > 0) ? "," : "",
+			cpu,
+			end
+		);
+		if (r < 0) {
+			break;
+		}
+		off += r;
+		cpu = end + 1;
+	}
+	return off;
+}
+
+#if defined(__linux)
+
+/* Pins the calling process to set, which its children inherit. An empty
+ * set leaves it be. Returns 1 on success, 0 otherwise.
+ */
+int cpuset_apply(const struct cpuset *set) {
+	cpu_set_t cs;
+	unsigned int cpu;
+	if (set->count == 0) {
+		return 1;
+	}
+	CPU_ZERO(&cs);
+	for (cpu = 0; cpu < CPUSET_MAX && cpu < CPU_SETSIZE; cpu += 1) {
+		if (cpuset_isset(set, cpu)) {
+			CPU_SET(cpu, &cs);
+		}
+	}
+	return sched_setaffinity(0, sizeof(cs), &cs) == 0;
+}
+
+/* Stores the CPUs the calling process may run on in set. Returns 1 on
+ * success, 0 otherwise.
+ */
+int cpuset_current(struct cpuset *set) {
+	cpu_set_t cs;
+	unsigned int cpu;
+	cpuset_clear(set);
+	if (sched_getaffinity(0, sizeof(cs), &cs) == -1) {
+		return 0;
+	}
+	for (cpu = 0; cpu < CPUSET_MAX && cpu < CPU_SETSIZE; cpu += 1) {
+		if (CPU_ISSET(cpu, &cs)) {
+			cpuset_add(set, cpu);
+		}
+	}
+	return 1;
+}
+
+#else /* defined(__linux) */
+
+int cpuset_apply(const struct cpuset *set) {
+	if (set->count == 0) {
+		return 1;
+	}
+	errno = ENOSYS;
+	return 0;
+}
+
+int cpuset_current(struct cpuset *set) {
+	cpuset_clear(set);
+	errno = ENOSYS;
+	return 0;
+}
+
+#endif /* defined(__linux) */
+
+/* Returns the CPU that processed the packets of the connection on sock,
+ * or -1 if the system won't tell.
+ */
+int cpuset_incoming(int sock) {
+#if defined(SO_INCOMING_CPU)
+	int cpu = -1;
+	socklen_t len = sizeof(cpu);
+	if (
+		getsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == -1
+	) {
+		return -1;
+	}
+	return cpu;
+#else
+	(void) sock;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/* Pins the calling process to the CPU that processed the packets of the
+ * connection on sock, if it may run there at all. Returns 1 if it was
+ * pinned, 0 otherwise.
+ */
+int cpuset_follow(int sock) {
+	struct cpuset cur, one;
+	int cpu = cpuset_incoming(sock);
+	if (
+		cpu < 0 ||
+		!cpuset_current(&cur) ||
+		!cpuset_isset(&cur, cpu)
+	) {
+		return 0;
+	}
+	if (cur.count == 1) {
+		return 1;
+	}
+	cpuset_clear(&one);
+	cpuset_add(&one, cpu);
+	return cpuset_apply(&one);
+}
+
+/* vi: set sts=8 ts=8 sw=8 noexpandtab: */
@@ -0,0 +1,31 @@
+#ifndef __mekdotlu_cpuset_h
+#define __mekdotlu_cpuset_h
+
+#include <stddef.h>
+
+/* highest CPU number that can be named, plus one */
+#define CPUSET_MAX 1024
+
+/* a set of CPUs to run on, empty if unpinned */
+struct cpuset {
+	unsigned int count;
+	unsigned char bits[CPUSET_MAX / 8];
+};
+
+void cpuset_clear(struct cpuset *set);
+int cpuset_isset(const struct cpuset *set, unsigned int cpu);
+int cpuset_parse(
+	const char *str,
+	struct cpuset *set4,
+	struct cpuset *set6
+);
+size_t cpuset_format(const struct cpuset *set, char *buf, size_t len);
+
+int cpuset_apply(const struct cpuset *set);
+int cpuset_current(struct cpuset *set);
+int cpuset_incoming(int sock);
+int cpuset_follow(int sock);
+
+#endif /* __mekdotlu_cpuset_h */
+
+/* vi: set sts=8 ts=8 sw=8 noexpandtab: */
@@ -0,0 +1,233 @@
+#include "hits.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define HITS_MAGIC "mekhits1"
+/* times to try for the top list lock before giving up on it */
+#define HITS_TOP_TRIES 1000
+
+size_t hits_size(void) {
+	return sizeof(struct hits) +
+		(size_t) HITS_DEPTH * HITS_WIDTH * sizeof(uint32_t);
+}
+
+uint32_t *hits_counts(struct hits *h) {
+	return (uint32_t *) &(h[1]);
+}
+
+/* Maps the counters file at path, creating it if need be. Counts in an
+ * existing file of the same layout carry on from where they were.
+ * Returns NULL on error with errno set.
+ */
+struct hits *hits_open(const char *path) {
+	struct hits *h;
+	struct stat s;
+	int fd, storerr, fresh;
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0640);
+	if (fd == -1) {
+		return NULL;
+	}
+	if (fstat(fd, &s) == -1) {
+		goto fail;
+	}
+	fresh = (size_t) s.st_size != hits_size();
+	if (fresh && ftruncate(fd, 0) == -1) {
+		goto fail;
+	}
+	if (fresh && ftruncate(fd, hits_size()) == -1) {
+		goto fail;
+	}
+	h = mmap(
+		NULL,
+		hits_size(),
+		PROT_READ | PROT_WRITE,
+		MAP_SHARED,
+		fd,
+		0
+	);
+	if (h == MAP_FAILED) {
+		goto fail;
+	}
+	/* the mapping holds on to the file */
+	close(fd);
+	if (
+		fresh ||
+		memcmp(h->magic, HITS_MAGIC, sizeof(h->magic)) != 0 ||
+		h->width != HITS_WIDTH ||
+		h->depth != HITS_DEPTH
+	) {
+		memset(h, 0, hits_size());
+		memcpy(h->magic, HITS_MAGIC, sizeof(h->magic));
+		h->width = HITS_WIDTH;
+		h->depth = HITS_DEPTH;
+	}
+	/* nobody holds it anymore */
+	h->lock = 0;
+	return h;
+fail:
+	storerr = errno;
+	close(fd);
+	errno = storerr;
+	return NULL;
+}
+
+int hits_close(struct hits *h) {
+	int ret;
+	if (h == NULL) {
+		return 1;
+	}
+	ret = hits_flush(h);
+	return munmap(h, hits_size()) == 0 && ret;
+}
+
+/* FNV-1a for the first hash, a finalizer mix of it for the second;
+ * the row hashes are then derived by double hashing
+ */
+void hits_hash(const char *key, uint64_t *h1, uint64_t *h2) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (; *key != '\0'; key += 1) {
+		h ^= (unsigned char) *key;
+		h *= 0x100000001b3ULL;
+	}
+	*h1 = h;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	*h2 = h | 1;
+}
+
+/* Puts key in the top list with the estimate est, pushing out the least
+ * entry if it is not there yet. Gives up if someone else is at it,
+ * since the next hit will try again.
+ */
+void hits_promote(
+	struct hits *h,
+	const char *key,
+	unsigned long est
+) {
+	unsigned long floor = 0;
+	size_t i, least = 0;
+	int found = 0;
+	if (__atomic_exchange_n(&(h->lock), 1, __ATOMIC_ACQUIRE) != 0) {
+		return;
+	}
+	for (i = 0; i < HITS_TOPK; i += 1) {
+		struct hits_top *t = &(h->top[i]);
+		if (t->count > 0 && strcmp(t->key, key) == 0) {
+			if (est > t->count) {
+				t->count = est;
+			}
+			found = 1;
+		}
+		if (t->count < h->top[least].count) {
+			least = i;
+		}
+	}
+	if (!found && est > h->top[least].count) {
+		h->top[least].count = est;
+		strcpy(h->top[least].key, key);
+	}
+	floor = h->top[0].count;
+	for (i = 1; i < HITS_TOPK; i += 1) {
+		if (h->top[i].count < floor) {
+			floor = h->top[i].count;
+		}
+	}
+	__atomic_store_n(&(h->floor), floor, __ATOMIC_RELAXED);
+	__atomic_store_n(&(h->lock), 0, __ATOMIC_RELEASE);
+}
+
+/* counts a hit on key */
+void hits_add(struct hits *h, const char *key) {
+	uint32_t *counts = hits_counts(h);
+	unsigned long est = ~0UL;
+	uint64_t h1, h2;
+	unsigned int i;
+	hits_hash(key, &h1, &h2);
+	for (i = 0; i < HITS_DEPTH; i += 1) {
+		uint64_t col = (h1 + i * h2) & (HITS_WIDTH - 1);
+		uint32_t c = __atomic_add_fetch(
+			&(counts[i * HITS_WIDTH + col]),
+			1,
+			__ATOMIC_RELAXED
+		);
+		if (c < est) {
+			est = c;
+		}
+	}
+	__atomic_fetch_add(&(h->total), 1, __ATOMIC_RELAXED);
+	if (
+		est > __atomic_load_n(&(h->floor), __ATOMIC_RELAXED) &&
+		strlen(key) < HITS_KEY_MAX
+	) {
+		hits_promote(h, key, est);
+	}
+}
+
+/* returns the estimated hits on key, never less than the actual count */
+unsigned long hits_estimate(struct hits *h, const char *key) {
+	uint32_t *counts = hits_counts(h);
+	unsigned long est = ~0UL;
+	uint64_t h1, h2;
+	unsigned int i;
+	hits_hash(key, &h1, &h2);
+	for (i = 0; i < HITS_DEPTH; i += 1) {
+		uint64_t col = (h1 + i * h2) & (HITS_WIDTH - 1);
+		uint32_t c = __atomic_load_n(
+			&(counts[i * HITS_WIDTH + col]),
+			__ATOMIC_RELAXED
+		);
+		if (c < est) {
+			est = c;
+		}
+	}
+	return est;
+}
+
+int hits_cmp(const void *a, const void *b) {
+	const struct hits_top *ta = a, *tb = b;
+	return (ta->count < tb->count) - (ta->count > tb->count);
+}
+
+/* Copies up to len of the hottest codes into buf, hottest first.
+ * The lock is held for a few microseconds at most, unless a request
+ * child got killed holding it, so this gives up after a while rather
+ * than hang. Returns the number copied, 0 if it gave up.
+ */
+size_t hits_top(struct hits *h, struct hits_top *buf, size_t len) {
+	struct hits_top top[HITS_TOPK];
+	size_t i, n = 0;
+	for (
+		i = 0;
+		__atomic_exchange_n(&(h->lock), 1, __ATOMIC_ACQUIRE) != 0;
+		i += 1
+	) {
+		if (i == HITS_TOP_TRIES) {
+			return 0;
+		}
+		sched_yield();
+	}
+	memcpy(top, h->top, sizeof(top));
+	__atomic_store_n(&(h->lock), 0, __ATOMIC_RELEASE);
+	qsort(top, HITS_TOPK, sizeof(top[0]), hits_cmp);
+	for (i = 0; i < HITS_TOPK && n < len && top[i].count > 0; i += 1) {
+		buf[n] = top[i];
+		n += 1;
+	}
+	return n;
+}
+
+/* writes the counters back to the file; returns 1 on success */
+int hits_flush(struct hits *h) {
+	__atomic_fetch_add(&(h->flushes), 1, __ATOMIC_RELAXED);
+	return msync(h, hits_size(), MS_ASYNC) == 0;
+}
+
+/* vi: set sts=8 ts=8 sw=8 noexpandtab: */
@@ -0,0 +1,57 @@
+#ifndef __mekdotlu_hits_h
+#define __mekdotlu_hits_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* sketch dimensions, about 1 MiB of counters */
+#define HITS_WIDTH 65536
+#define HITS_DEPTH 4
+/* hottest codes tracked, and the longest key among them */
+#define HITS_TOPK 32
+#define HITS_KEY_MAX 64
+/* hottest codes logged with the stats */
+#define HITS_SHOW 10
+/* seconds between flushes to disk */
+#define HITS_FLUSH_INTERVAL 30
+
+/* one of the hottest codes */
+struct hits_top {
+	unsigned long count;
+	char key[HITS_KEY_MAX];
+};
+
+/* per short code hit counters in a shared file mapping
+ *
+ * a count-min sketch of HITS_DEPTH rows of HITS_WIDTH 32-bit counters
+ * follows the header in the file; keys are `<tree>/<code>' as in the
+ * Bloom filter
+ */
+struct hits {
+	char magic[8];
+	unsigned int width;
+	unsigned int depth;
+	/* hits counted in total */
+	unsigned long total;
+	/* flushes done */
+	unsigned long flushes;
+	/* the least count in top once it is full; keys estimated at or
+	 * below it can skip the lock
+	 */
+	unsigned long floor;
+	/* guards top */
+	int lock;
+	struct hits_top top[HITS_TOPK];
+};
+
+struct hits *hits_open(const char *path);
+int hits_close(struct hits *h);
+
+void hits_add(struct hits *h, const char *key);
+unsigned long hits_estimate(struct hits *h, const char *key);
+size_t hits_top(struct hits *h, struct hits_top *buf, size_t len);
+int hits_flush(struct hits *h);
+
+#endif /* __mekdotlu_hits_h */
+
+/* vi: set sts=8 ts=8 sw=8 noexpandtab: */
@@ -0,0 +1,609 @@
+/* bulk URL insertion utility
+ *
+ * reads `<path> <url>' lines from standard input, where <path> is what
+ * would be requested from the server, e.g. `/e/aeiou' or `/marvelous',
+ * and publishes them into the URL trees
+ *
+ * also moves existing trees over to another shard scheme
+ */
+#include "request.h"
+#include "store.h"
+#include "clock.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/* default number of writer threads */
+#define INSERT_THREADS 4
+/* most writer threads allowed */
+#define INSERT_MAX_THREADS 64
+/* how deep the trees are walked on relayout */
+#define INSERT_MAX_DEPTH 8
+
+struct insert_ent {
+	/* rewritten path, e.g. e/aei/aeiou */
+	char *path;
+	/* file contents: the URL and a newline */
+	char *data;
+	size_t len;
+	/* length of the shard directory part of path */
+	size_t dirlen;
+	/* input line number */
+	unsigned long line;
+};
+
+struct insert_state {
+	int rootfd;
+	int flags;
+	/* shard scheme */
+	struct request_cfg rcfg;
+	struct insert_ent *ents;
+	/* shard groups as offsets into ents, ngroups + 1 of them */
+	size_t *groups;
+	size_t ngroups;
+	/* next group to be taken by a thread */
+	size_t next;
+	unsigned long ok;
+	unsigned long failed;
+};
+
+/* a redirect file to be moved on relayout */
+struct insert_move {
+	char *from;
+	char *to;
+};
+
+struct insert_relayout {
+	int rootfd;
+	const struct request_cfg *rcfg;
+	struct insert_move *moves;
+	size_t n;
+	size_t cap;
+	unsigned long skipped;
+};
+
+#define p(x) fputs(x "\n", f)
+void print_usage(FILE *f) {
+	p("USAGE:  mekdotlu-insert <args> < <file>");
+	p("        Reads `<path> <url>' lines from standard input, where");
+	p("        <path> is the short URL as requested from the server,");
+	p("        e.g. `/e/aeiou' or `/marvelous', and publishes them");
+	p("        into the URL trees. Arguments must be tightly");
+	p("        specified. Use `-tvalue' instead of `-t value'.");
+	p("");
+	p("OPTIONS:");
+	p("        -r<str> Set document root. Default is current directory.");
+	p("        -j<num> Set the number of writer threads. Defaults to 4.");
+	p("        -R      Replace existing redirect files.");
+	p("        -s      fsync() every file before publishing it.");
+	p("        -S<str> Set the shard scheme, as with mekdotlu -S.");
+	p("        -M      Don't read standard input, but move every");
+	p("                redirect file in the trees to where the shard");
+	p("                scheme wants it, and remove emptied directories.");
+	p("");
+	p("  (-h)  --help  Show this help and exit.");
+	p("");
+	p("EXAMPLE:");
+	p("        $ printf '/e/aeiou http://www.nasa.gov/\\n' | \\");
+	p("          mekdotlu-insert -r./urls");
+	p("");
+	p("        Move a tree over to two levels of two code points.");
+	p("        $ mekdotlu-insert -r./urls -S2x2 -M");
+}
+#undef p
+
+int insert_cmp(const void *a, const void *b) {
+	const struct insert_ent *ea = a, *eb = b;
+	int ret = strncmp(
+		ea->path,
+		eb->path,
+		(ea->dirlen < eb->dirlen) ? ea->dirlen : eb->dirlen
+	);
+	if (ret != 0) {
+		return ret;
+	}
+	if (ea->dirlen != eb->dirlen) {
+		return (ea->dirlen < eb->dirlen) ? -1 : 1;
+	}
+	/* keep input order within a shard, later lines win with -R */
+	return (ea->line < eb->line) ? -1 : (ea->line > eb->line);
+}
+
+/* Parses a `<path> <url>' line into ent. Returns 1 on success, 0 if
+ * the line is to be skipped and -1 if it is malformed.
+ */
+int insert_parse(
+	char *line,
+	unsigned long lineno,
+	const struct request_cfg *rcfg,
+	struct insert_ent *ent
+) {
+	struct request_ent rent;
+	char *url;
+	size_t ulen;
+	line[strcspn(line, "\r\n")] = '\0';
+	if (line[0] == '\0' || line[0] == '#') {
+		return 0;
+	}
+	url = strpbrk(line, " \t");
+	if (url == NULL) {
+		return -1;
+	}
+	*url = '\0';
+	do {
+		url = &(url[1]);
+	} while (*url == ' ' || *url == '\t');
+	ulen = strlen(url);
+	if (ulen == 0) {
+		return -1;
+	}
+	memset(&rent, 0, sizeof(rent));
+	rent.cfg = rcfg;
+	if (line[0] == '/') {
+		rent.path = strdup(line);
+	} else {
+		rent.path = malloc(strlen(line) + 2);
+		if (rent.path != NULL) {
+			rent.path[0] = '/';
+			strcpy(&(rent.path[1]), line);
+		}
+	}
+	if (rent.path == NULL) {
+		return -1;
+	}
+	/* only redirects are accepted */
+	if (request_rewrite(&rent) != 0) {
+		free(rent.path);
+		return -1;
+	}
+	ent->path = rent.path;
+	ent->dirlen = strrchr(rent.path, '/') - rent.path;
+	ent->line = lineno;
+	ent->len = ulen + 1;
+	ent->data = malloc(ent->len);
+	if (ent->data == NULL) {
+		free(ent->path);
+		return -1;
+	}
+	memcpy(ent->data, url, ulen);
+	ent->data[ulen] = '\n';
+	return 1;
+}
+
+/* writer thread: takes whole shard groups until none are left */
+void *insert_thread(void *arg) {
+	struct insert_state *st = arg;
+	for (;;) {
+		size_t i, g;
+		g = __atomic_fetch_add(&(st->next), 1, __ATOMIC_RELAXED);
+		if (g >= st->ngroups) {
+			break;
+		}
+		for (i = st->groups[g]; i < st->groups[g + 1]; i += 1) {
+			struct insert_ent *ent = &(st->ents[i]);
+			if (
+				store_publish(
+					st->rootfd,
+					ent->path,
+					ent->data,
+					ent->len,
+					st->flags
+				) == -1
+			) {
+				fprintf(
+					stderr,
+					"line %lu: %s: %s\n",
+					ent->line,
+					ent->path,
+					strerror(errno)
+				);
+				__atomic_fetch_add(
+					&(st->failed),
+					1,
+					__ATOMIC_RELAXED
+				);
+			} else {
+				__atomic_fetch_add(
+					&(st->ok),
+					1,
+					__ATOMIC_RELAXED
+				);
+			}
+		}
+	}
+	return NULL;
+}
+
+/* Collects the redirect files under path, relative to the root, whose
+ * place differs under the new shard scheme. Files right under the tree
+ * are taken too, as they come from a flat one.
+ */
+void insert_walk(struct insert_relayout *rl, char *path, int depth) {
+	struct request_ent rent;
+	struct dirent *de;
+	size_t plen = strlen(path);
+	DIR *d;
+	int fd = openat(rl->rootfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		return;
+	}
+	d = fdopendir(fd);
+	if (d == NULL) {
+		close(fd);
+		return;
+	}
+	while ((de = readdir(d)) != NULL) {
+		size_t nlen = strlen(de->d_name);
+		struct stat s;
+		/* dot files include temporary ones */
+		if (de->d_name[0] == '.' || plen + nlen + 2 > PATH_MAX) {
+			continue;
+		}
+		path[plen] = '/';
+		memcpy(&(path[plen + 1]), de->d_name, nlen + 1);
+		if (fstatat(rl->rootfd, path, &s, AT_SYMLINK_NOFOLLOW) == -1) {
+			path[plen] = '\0';
+			continue;
+		}
+		if (S_ISDIR(s.st_mode)) {
+			if (depth < INSERT_MAX_DEPTH) {
+				insert_walk(rl, path, depth + 1);
+			}
+			path[plen] = '\0';
+			continue;
+		}
+		path[plen] = '\0';
+		memset(&rent, 0, sizeof(rent));
+		rent.cfg = rl->rcfg;
+		rent.path = malloc(nlen + 4);
+		if (rent.path == NULL) {
+			continue;
+		}
+		sprintf(
+			rent.path,
+			"%s%s",
+			(path[0] == 'e') ? "/e/" : "/",
+			de->d_name
+		);
+		if (request_rewrite(&rent) != 0) {
+			fprintf(
+				stderr,
+				"%s/%s: not a valid code under the scheme\n",
+				path,
+				de->d_name
+			);
+			free(rent.path);
+			rl->skipped += 1;
+			continue;
+		}
+		/* already in place */
+		if (
+			strncmp(rent.path, path, plen) == 0 &&
+			rent.path[plen] == '/' &&
+			strcmp(&(rent.path[plen + 1]), de->d_name) == 0
+		) {
+			free(rent.path);
+			continue;
+		}
+		if (rl->n == rl->cap) {
+			struct insert_move *moves;
+			rl->cap = (rl->cap == 0) ? 1024 : rl->cap * 2;
+			moves = realloc(rl->moves, rl->cap * sizeof(*moves));
+			if (moves == NULL) {
+				free(rent.path);
+				break;
+			}
+			rl->moves = moves;
+		}
+		rl->moves[rl->n].to = rent.path;
+		rl->moves[rl->n].from = malloc(plen + nlen + 2);
+		if (rl->moves[rl->n].from == NULL) {
+			free(rent.path);
+			continue;
+		}
+		sprintf(rl->moves[rl->n].from, "%s/%s", path, de->d_name);
+		rl->n += 1;
+	}
+	closedir(d);
+}
+
+/* removes the empty directories under path, depth first */
+void insert_prune(int rootfd, char *path, int depth) {
+	struct dirent *de;
+	size_t plen = strlen(path);
+	DIR *d;
+	int fd = openat(rootfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		return;
+	}
+	d = fdopendir(fd);
+	if (d == NULL) {
+		close(fd);
+		return;
+	}
+	while ((de = readdir(d)) != NULL) {
+		size_t nlen = strlen(de->d_name);
+		struct stat s;
+		if (
+			strcmp(de->d_name, ".") == 0 ||
+			strcmp(de->d_name, "..") == 0 ||
+			plen + nlen + 2 > PATH_MAX
+		) {
+			continue;
+		}
+		path[plen] = '/';
+		memcpy(&(path[plen + 1]), de->d_name, nlen + 1);
+		if (
+			depth < INSERT_MAX_DEPTH &&
+			fstatat(rootfd, path, &s, AT_SYMLINK_NOFOLLOW) == 0 &&
+			S_ISDIR(s.st_mode)
+		) {
+			insert_prune(rootfd, path, depth + 1);
+			/* fails unless it is empty */
+			unlinkat(rootfd, path, AT_REMOVEDIR);
+		}
+		path[plen] = '\0';
+	}
+	closedir(d);
+}
+
+/* Moves every redirect file in the trees to its place under the shard
+ * scheme in st. Existing files at the destination are only replaced
+ * with STORE_REPLACE. Returns the process exit status.
+ */
+int insert_relayout(struct insert_state *st) {
+	struct insert_relayout rl;
+	struct timespec tp_b, tp_e;
+	char path[PATH_MAX];
+	size_t i;
+	double dt;
+	memset(&rl, 0, sizeof(rl));
+	rl.rootfd = st->rootfd;
+	rl.rcfg = &(st->rcfg);
+	clock_gettime(CLOCK_MONOTONIC, &tp_b);
+	strcpy(path, "e");
+	insert_walk(&rl, path, 0);
+	strcpy(path, "i");
+	insert_walk(&rl, path, 0);
+	for (i = 0; i < rl.n; i += 1) {
+		struct insert_move *m = &(rl.moves[i]);
+		int r = store_mkdirs(st->rootfd, m->to);
+		if (r == 0 && (st->flags & STORE_REPLACE)) {
+			r = renameat(st->rootfd, m->from, st->rootfd, m->to);
+		} else if (r == 0) {
+			/* link(2) refuses to replace existing files */
+			r = linkat(st->rootfd, m->from, st->rootfd, m->to, 0);
+			if (r == 0) {
+				r = unlinkat(st->rootfd, m->from, 0);
+			}
+		}
+		if (r == -1) {
+			fprintf(
+				stderr,
+				"%s -> %s: %s\n",
+				m->from,
+				m->to,
+				strerror(errno)
+			);
+			st->failed += 1;
+		} else {
+			st->ok += 1;
+		}
+		free(m->from);
+		free(m->to);
+	}
+	free(rl.moves);
+	strcpy(path, "e");
+	insert_prune(st->rootfd, path, 0);
+	strcpy(path, "i");
+	insert_prune(st->rootfd, path, 0);
+	clock_gettime(CLOCK_MONOTONIC, &tp_e);
+	dt = (double) (
+		(double) tp_e.tv_sec - (double) tp_b.tv_sec +
+		(
+			(double) tp_e.tv_nsec -
+			(double) tp_b.tv_nsec
+		) / (double) 1000000000.0
+	);
+	printf(
+		"%lu moved, %lu failed, %lu skipped, %.3fs, %.0f moves/s\n",
+		st->ok,
+		st->failed,
+		rl.skipped,
+		dt,
+		(dt > 0.0) ? (double) st->ok / dt : 0.0
+	);
+	close(st->rootfd);
+	return (st->failed > 0 || rl.skipped > 0) ?
+		EXIT_FAILURE :
+		EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+	struct insert_state st;
+	pthread_t threads[INSERT_MAX_THREADS];
+	struct timespec tp_b, tp_e;
+	const char *root = ".";
+	char *line = NULL;
+	size_t linecap = 0, cap = 0, n = 0, i;
+	unsigned long lineno = 0, bad = 0;
+	int nthreads = INSERT_THREADS, err = 0, relayout = 0;
+	double dt;
+
+	memset(&st, 0, sizeof(st));
+	st.rcfg.shard_len = 3;
+	st.rcfg.shard_levels = 1;
+	for (i = 1; i < (size_t) argc; i += 1) {
+		if (argv[i][0] != '-') {
+			fprintf(stderr, "Invalid argument: %s\n", argv[i]);
+			err = 1;
+		} else if (argv[i][1] == 'r') {
+			root = &(argv[i][2]);
+		} else if (argv[i][1] == 'j') {
+			if (
+				sscanf(&(argv[i][2]), "%d", &nthreads) != 1 ||
+				nthreads < 1 ||
+				nthreads > INSERT_MAX_THREADS
+			) {
+				fprintf(
+					stderr,
+					"Could not parse thread count: %s\n",
+					&(argv[i][2])
+				);
+				err = 1;
+			}
+		} else if (argv[i][1] == 'R' && argv[i][2] == '\0') {
+			st.flags |= STORE_REPLACE;
+		} else if (argv[i][1] == 's' && argv[i][2] == '\0') {
+			st.flags |= STORE_SYNC;
+		} else if (argv[i][1] == 'M' && argv[i][2] == '\0') {
+			relayout = 1;
+		} else if (argv[i][1] == 'S') {
+			if (request_shard_parse(&(argv[i][2]), &(st.rcfg)) == 0) {
+				fprintf(
+					stderr,
+					"Could not parse shard scheme: %s\n",
+					&(argv[i][2])
+				);
+				err = 1;
+			}
+		} else if (
+			argv[i][1] == 'h' ||
+			strcmp(argv[i], "--help") == 0
+		) {
+			print_usage(stdout);
+			return EXIT_SUCCESS;
+		} else {
+			fprintf(stderr, "Unknown argument: %s\n", argv[i]);
+			err = 1;
+		}
+	}
+	if (err) {
+		fputs("\n", stderr);
+		print_usage(stderr);
+		return EXIT_FAILURE;
+	}
+	st.rootfd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (st.rootfd == -1) {
+		perror(root);
+		return EXIT_FAILURE;
+	}
+	if (relayout) {
+		return insert_relayout(&st);
+	}
+
+	/* read and rewrite everything up front */
+	while (getline(&line, &linecap, stdin) != -1) {
+		int r;
+		lineno += 1;
+		if (n == cap) {
+			struct insert_ent *ents;
+			cap = (cap == 0) ? 1024 : cap * 2;
+			ents = realloc(st.ents, cap * sizeof(*ents));
+			if (ents == NULL) {
+				perror("realloc");
+				return EXIT_FAILURE;
+			}
+			st.ents = ents;
+		}
+		r = insert_parse(line, lineno, &(st.rcfg), &(st.ents[n]));
+		if (r == 1) {
+			n += 1;
+		} else if (r == -1) {
+			fprintf(stderr, "line %lu: malformed\n", lineno);
+			bad += 1;
+		}
+	}
+	free(line);
+
+	/* batch the writes per shard directory */
+	qsort(st.ents, n, sizeof(*(st.ents)), insert_cmp);
+	st.groups = malloc((n + 1) * sizeof(*(st.groups)));
+	if (st.groups == NULL) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < n; i += 1) {
+		if (
+			i > 0 &&
+			st.ents[i].dirlen == st.ents[i - 1].dirlen &&
+			strncmp(
+				st.ents[i].path,
+				st.ents[i - 1].path,
+				st.ents[i].dirlen
+			) == 0
+		) {
+			continue;
+		}
+		st.groups[st.ngroups] = i;
+		st.ngroups += 1;
+		/* pre-create the shard directory */
+		if (store_mkdirs(st.rootfd, st.ents[i].path) == -1) {
+			fprintf(
+				stderr,
+				"%.*s: %s\n",
+				(int) st.ents[i].dirlen,
+				st.ents[i].path,
+				strerror(errno)
+			);
+			return EXIT_FAILURE;
+		}
+	}
+	st.groups[st.ngroups] = n;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp_b);
+	if (nthreads > (int) st.ngroups) {
+		nthreads = (st.ngroups > 0) ? (int) st.ngroups : 1;
+	}
+	for (i = 0; i < (size_t) nthreads; i += 1) {
+		if (pthread_create(&(threads[i]), NULL, insert_thread, &st)) {
+			perror("pthread_create");
+			nthreads = i;
+			break;
+		}
+	}
+	/* the main thread writes too if no threads could be started */
+	if (nthreads == 0) {
+		insert_thread(&st);
+	}
+	for (i = 0; i < (size_t) nthreads; i += 1) {
+		pthread_join(threads[i], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &tp_e);
+	dt = (double) (
+		(double) tp_e.tv_sec - (double) tp_b.tv_sec +
+		(
+			(double) tp_e.tv_nsec -
+			(double) tp_b.tv_nsec
+		) / (double) 1000000000.0
+	);
+
+	printf(
+		"%lu inserted, %lu failed, %lu malformed, "
+		"%lu shard directories, %.3fs, %.0f inserts/s\n",
+		st.ok,
+		st.failed,
+		bad,
+		(unsigned long) st.ngroups,
+		dt,
+		(dt > 0.0) ? (double) st.ok / dt : 0.0
+	);
+
+	for (i = 0; i < n; i += 1) {
+		free(st.ents[i].path);
+		free(st.ents[i].data);
+	}
+	free(st.ents);
+	free(st.groups);
+	close(st.rootfd);
+	return (st.failed > 0 || bad > 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vi: set sts=8 ts=8 sw=8 noexpandtab: */
@@ -0,0 +1,269 @@
+#include "journal.h"
+#include "clock.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+/* Required for OSX. */
+#ifndef MAP_ANONYMOUS
+#	define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* how long to wait for a sync before checking on its leader, in
+ * nanoseconds
+ */
+#define JOURNAL_WAIT 100000000L
+
+/* fdatasync() is missing on OSX */
+#if defined(__APPLE__)
+#	define fdatasync fsync
+#endif
+
+/* Opens the log at path for appending and maps its state in shared
+ * memory. Returns NULL on error with errno set.
+ */
+struct journal *journal_open(const char *path) {
+	pthread_mutexattr_t ma;
+	pthread_condattr_t ca;
+	struct journal *j;
+	int fd, storerr;
+	fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0640);
+	if (fd == -1) {
+		return NULL;
+	}
+	j = mmap(
+		NULL,
+		sizeof(*j),
+		PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS,
+		-1,
+		0
+	);
+	if (j == MAP_FAILED) {
+		storerr = errno;
+		close(fd);
+		errno = storerr;
+		return NULL;
+	}
+	memset(j, 0, sizeof(*j));
+	j->fd = fd;
+	pthread_mutexattr_init(&ma);
+	pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+#ifdef PTHREAD_MUTEX_ROBUST
+	/* request children may die with the lock held */
+	pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+#endif
+	pthread_mutex_init(&(j->lock), &ma);
+	pthread_mutexattr_destroy(&ma);
+	pthread_condattr_init(&ca);
+	pthread_condattr_setpshared(&ca, PTHREAD_PROCESS_SHARED);
+	pthread_cond_init(&(j->cond), &ca);
+	pthread_condattr_destroy(&ca);
+	return j;
+}
+
+int journal_close(struct journal *j) {
+	int ret = 1;
+	if (j == NULL) {
+		return 1;
+	}
+	if (fdatasync(j->fd) == -1 || close(j->fd) == -1) {
+		ret = 0;
+	}
+	pthread_cond_destroy(&(j->cond));
+	pthread_mutex_destroy(&(j->lock));
+	munmap(j, sizeof(*j));
+	return ret;
+}
+
+void journal_lock(struct journal *j) {
+#ifdef PTHREAD_MUTEX_ROBUST
+	if (pthread_mutex_lock(&(j->lock)) == EOWNERDEAD) {
+		/* whoever died left the counters consistent */
+		j->syncing = 0;
+		pthread_mutex_consistent(&(j->lock));
+	}
+#else
+	pthread_mutex_lock(&(j->lock));
+#endif
+}
+
+/* Waits for the sync in progress a while. Its leader doesn't hold the
+ * lock while syncing, so dying there goes unnoticed by the mutex; if it
+ * is gone, the sync is up for grabs again.
+ */
+void journal_wait(struct journal *j) {
+	struct timespec tp;
+	int r;
+	clock_gettime(CLOCK_REALTIME, &tp);
+	tp.tv_nsec += JOURNAL_WAIT;
+	if (tp.tv_nsec >= 1000000000L) {
+		tp.tv_sec += 1;
+		tp.tv_nsec -= 1000000000L;
+	}
+	r = pthread_cond_timedwait(&(j->cond), &(j->lock), &tp);
+#ifdef PTHREAD_MUTEX_ROBUST
+	if (r == EOWNERDEAD) {
+		j->syncing = 0;
+		pthread_mutex_consistent(&(j->lock));
+		return;
+	}
+#endif
+	if (
+		r == ETIMEDOUT &&
+		j->syncing &&
+		kill(j->leader, 0) == -1 &&
+		errno == ESRCH
+	) {
+		j->syncing = 0;
+	}
+}
+
+/* Appends a record of len bytes and returns once it is on disk.
+ * Returns 0 on success, -1 on error with errno set.
+ */
+int journal_append(struct journal *j, const char *rec, size_t len) {
+	unsigned long seq;
+	int ret = 0, storerr = 0;
+	journal_lock(j);
+	errno = 0;
+	/* records are small, O_APPEND writes them out whole */
+	if (write(j->fd, rec, len) != (ssize_t) len) {
+		storerr = (errno != 0) ? errno : EIO;
+		pthread_mutex_unlock(&(j->lock));
+		errno = storerr;
+		return -1;
+	}
+	j->written += 1;
+	seq = j->written;
+	while (j->synced < seq) {
+		unsigned long target;
+		if (j->syncing) {
+			/* someone else's sync may cover us */
+			journal_wait(j);
+			continue;
+		}
+		/* lead the next group */
+		j->syncing = 1;
+		j->leader = getpid();
+		target = j->written;
+		pthread_mutex_unlock(&(j->lock));
+		if (fdatasync(j->fd) == -1) {
+			storerr = errno;
+			ret = -1;
+		}
+		journal_lock(j);
+		j->syncing = 0;
+		j->syncs += 1;
+		if (ret == 0 && target > j->synced) {
+			j->synced = target;
+		}
+		pthread_cond_broadcast(&(j->cond));
+		if (ret == -1) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&(j->lock));
+	errno = storerr;
+	return ret;
+}
+
+/* Calls apply for every `<op> <path> <url>' record in order, and keeps
+ * the highest counter of the `N <counter>' ones in reserved. Only call
+ * this before the workers start. Returns the number of records
+ * applied, or -1 on error.
+ */
+long journal_replay(struct journal *j, journal_apply_fn apply, void *arg) {
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len = 0;
+	long ret = 0;
+	int fd;
+	FILE *f;
+	fd = dup(j->fd);
+	if (fd == -1) {
+		return -1;
+	}
+	f = fdopen(fd, "r");
+	if (f == NULL) {
+		close(fd);
+		return -1;
+	}
+	rewind(f);
+	while ((len = getline(&line, &cap, f)) != -1) {
+		char *path, *url;
+		/* a torn record at the tail end */
+		if (line[len - 1] != '\n') {
+			/* keep the next record on a line of its own */
+			if (write(j->fd, "\n", 1) == -1) {
+				ret = -1;
+			}
+			break;
+		}
+		line[len - 1] = '\0';
+		if (line[0] == 'N' && line[1] == ' ') {
+			uint64_t n = strtoull(&(line[2]), NULL, 10);
+			if (n > j->reserved) {
+				j->reserved = n;
+			}
+			continue;
+		}
+		path = strchr(line, ' ');
+		url = (path != NULL) ? strchr(&(path[1]), ' ') : NULL;
+		if (url == NULL || path != &(line[1])) {
+			continue;
+		}
+		path[0] = '\0';
+		url[0] = '\0';
+		if (
+			apply(line[0], &(path[1]), &(url[1]), arg) == -1 &&
+			errno != EEXIST &&
+			errno != EINVAL
+		) {
+			j->failed += 1;
+		}
+		ret += 1;
+	}
+	free(line);
+	fclose(f);
+	return ret;
+}
+
+/* Drops every record once a replay has applied them all and the trees
+ * are synced, leaving just an `N <reserved>' record for the code
+ * counter. Without this the journal would grow forever, and replay
+ * would bring back codes removed by hand since. A crash before the
+ * sync at the end may lose the counter, in which case generated codes
+ * collide and get retried for a while. Only call this before the
+ * workers start. Returns 1 on success, 0 otherwise with errno set.
+ */
+int journal_compact(struct journal *j, uint64_t reserved) {
+	char rec[32];
+	int len;
+	if (ftruncate(j->fd, 0) == -1) {
+		return 0;
+	}
+	if (reserved > 0) {
+		len = snprintf(
+			rec,
+			sizeof(rec),
+			"N %llu\n",
+			(unsigned long long) reserved
+		);
+		if (write(j->fd, rec, len) != len) {
+			if (errno == 0) {
+				errno = EIO;
+			}
+			return 0;
+		}
+	}
+	return fdatasync(j->fd) == 0;
+}
+
+/* vi: set sts=8 ts=8 sw=8 noexpandtab: */
@@ -0,0 +1,55 @@
+#ifndef __mekdotlu_journal_h
+#define __mekdotlu_journal_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/* an append-only insert log in shared memory, group committed: while
+ * one process waits on fdatasync(), the records written by the others
+ * pile up and get synced by the next one in a single call
+ */
+struct journal {
+	int fd;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* records written, and records known to be on disk */
+	unsigned long written;
+	unsigned long synced;
+	/* whether someone is in fdatasync(), and the process that is,
+	 * which may get killed there
+	 */
+	int syncing;
+	pid_t leader;
+	/* fdatasync() calls made */
+	unsigned long syncs;
+	/* highest code counter reserved, from the `N <counter>' records
+	 * replayed
+	 */
+	uint64_t reserved;
+	/* records replay failed to apply for now */
+	unsigned long failed;
+};
+
+/* called for every record on replay, op is 'C' for create, 'R' for
+ * replace; returns 0 on success or -1 with errno set, EEXIST or EINVAL
+ * for records that are done with or never will be
+ */
+typedef int (*journal_apply_fn)(
+	char op,
+	const char *path,
+	const char *url,
+	void *arg
+);
+
+struct journal *journal_open(const char *path);
+int journal_close(struct journal *j);
+
+int journal_append(struct journal *j, const char *rec, size_t len);
+long journal_replay(struct journal *j, journal_apply_fn apply, void *arg);
+int journal_compact(struct journal *j, uint64_t reserved);
+
+#endif /* __mekdotlu_journal_h */
+
+/* vi: set sts=8 ts=8 sw=8 noexpandtab: */
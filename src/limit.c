@@ -0,0 +1,272 @@
+#include "limit.h"
+#include "clock.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <sys/mman.h>
+
+/* Required for OSX. */
+#ifndef MAP_ANONYMOUS
+#	define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* length of a window in seconds */
+#define LIMIT_WINDOW 0.1
+/* latency this many times the baseline shrinks the limit, as long as it
+ * is above the floor; sub-millisecond latencies are mostly noise
+ */
+#define LIMIT_TOLERANCE 2.0
+#define LIMIT_FLOOR 0.001
+/* how fast the baseline forgets old lows, per window */
+#define LIMIT_DRIFT 0.01
+/* queue delay tolerated in the backlog, a few fork-per-request service
+ * times, and for how long it may be exceeded before connections get
+ * shed, in seconds
+ */
+#define LIMIT_QUEUE_TARGET 0.025
+#define LIMIT_QUEUE_INTERVAL 0.1
+
+double limit_now(void) {
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (double) tp.tv_sec + (double) tp.tv_nsec / 1000000000.0;
+}
+
+/* Maps n limits in shared memory, starting out at LIMIT_START as far as
+ * their bounds allow. Returns NULL on error.
+ */
+struct limit *limit_create(unsigned int min, unsigned int max, size_t n) {
+	struct limit *l;
+	size_t i;
+	l = mmap(
+		NULL,
+		n * sizeof(*l),
+		PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS,
+		-1,
+		0
+	);
+	if (l == MAP_FAILED) {
+		return NULL;
+	}
+	memset(l, 0, n * sizeof(*l));
+	for (i = 0; i < n; i += 1) {
+		l[i].min = min;
+		l[i].max = max;
+		l[i].cur = (LIMIT_START < min) ? min : LIMIT_START;
+		if (l[i].cur > max) {
+			l[i].cur = max;
+		}
+		l[i].slow_start = 1;
+		clock_gettime(CLOCK_MONOTONIC, &(l[i].window));
+	}
+	return l;
+}
+
+int limit_destroy(struct limit *l, size_t n) {
+	if (l == NULL) {
+		return 1;
+	}
+	return munmap(l, n * sizeof(*l)) == 0;
+}
+
+/* Parses bounds in the `[<min>:]<max>' format. Returns 1 on success,
+ * 0 otherwise.
+ */
+int limit_parse(const char *str, unsigned int *min, unsigned int *max) {
+	unsigned int a = 0, b = 0;
+	int n = 0, m = 0;
+	if (str == NULL || sscanf(str, "%u%n", &a, &n) != 1) {
+		return 0;
+	}
+	if (str[n] == ':') {
+		if (sscanf(&(str[n + 1]), "%u%n", &b, &m) != 1) {
+			return 0;
+		}
+		n += 1 + m;
+	} else {
+		b = a;
+		a = (b < LIMIT_MIN) ? b : LIMIT_MIN;
+	}
+	if (str[n] != '\0' || a == 0 || a > b) {
+		return 0;
+	}
+	*min = a;
+	*max = b;
+	return 1;
+}
+
+/* Takes a slot for a new request. Returns 1 on success, or 0 if the
+ * limit was reached, which is counted as a rejection.
+ */
+int limit_acquire(struct limit *l) {
+	if (l->inflight >= l->cur) {
+		l->saturated = 1;
+		__atomic_fetch_add(&(l->rejected), 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	l->inflight += 1;
+	return 1;
+}
+
+void limit_release(struct limit *l) {
+	if (l->inflight > 0) {
+		l->inflight -= 1;
+	}
+}
+
+/* marks a request as being served, from request children */
+void limit_begin(struct limit *l) {
+	__atomic_fetch_add(&(l->busy), 1, __ATOMIC_RELAXED);
+}
+
+/* records how long a request took to serve, from request children */
+void limit_end(struct limit *l, double dt) {
+	__atomic_fetch_sub(&(l->busy), 1, __ATOMIC_RELAXED);
+	if (dt < 0.0) {
+		return;
+	}
+	__atomic_fetch_add(
+		&(l->nsec),
+		(unsigned long) (dt * 1000000000.0),
+		__ATOMIC_RELAXED
+	);
+	__atomic_fetch_add(&(l->samples), 1, __ATOMIC_RELAXED);
+}
+
+/* grows the limit, doubling it during slow start */
+void limit_grow(struct limit *l) {
+	if (l->cur >= l->max) {
+		return;
+	}
+	if (l->slow_start) {
+		l->cur = (l->cur <= l->max / 2) ? l->cur * 2 : l->max;
+	} else {
+		l->cur += 1;
+	}
+	__atomic_fetch_add(&(l->increases), 1, __ATOMIC_RELAXED);
+}
+
+/* Adjusts the limit once a window has passed. Only the worker owning
+ * the limit may call this.
+ */
+void limit_update(struct limit *l) {
+	struct timespec tp;
+	unsigned long samples, nsec;
+	double elapsed, latency;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	elapsed = (double) tp.tv_sec - (double) l->window.tv_sec + (
+		(double) tp.tv_nsec -
+		(double) l->window.tv_nsec
+	) / (double) 1000000000.0;
+	if (elapsed < LIMIT_WINDOW) {
+		return;
+	}
+	l->window = tp;
+	samples = __atomic_exchange_n(&(l->samples), 0, __ATOMIC_RELAXED);
+	nsec = __atomic_exchange_n(&(l->nsec), 0, __ATOMIC_RELAXED);
+	if (samples == 0) {
+		/* nothing finished; if nothing is being served either, the
+		 * slots are taken by idle keep-alive connections and the
+		 * limit may as well grow
+		 */
+		if (
+			l->saturated &&
+			__atomic_load_n(&(l->busy), __ATOMIC_RELAXED) == 0
+		) {
+			limit_grow(l);
+		}
+		l->saturated = 0;
+		return;
+	}
+	latency = (double) nsec / (double) samples / 1000000000.0;
+	l->latency = latency;
+	if (l->baseline == 0.0 || latency < l->baseline) {
+		l->baseline = latency;
+	} else {
+		l->baseline += (latency - l->baseline) * LIMIT_DRIFT;
+	}
+	if (
+		latency > LIMIT_FLOOR &&
+		latency > l->baseline * LIMIT_TOLERANCE
+	) {
+		unsigned int cut = l->cur / 10;
+		l->cur -= (cut > 0) ? cut : 1;
+		if (l->cur < l->min) {
+			l->cur = l->min;
+		}
+		l->slow_start = 0;
+		__atomic_fetch_add(&(l->decreases), 1, __ATOMIC_RELAXED);
+	} else if (l->saturated) {
+		limit_grow(l);
+	}
+	l->saturated = 0;
+}
+
+/* leaves the shedding state once the queue delay is back on target */
+void limit_on_target(struct limit *l) {
+	l->first_above = 0.0;
+	l->shedding = 0;
+	l->shed_count = 0;
+}
+
+/* Tracks how long the limit has been holding back the connections
+ * waiting in the backlog, and decides whether to shed one. Once that
+ * delay has stayed above the target for a whole interval, there is a
+ * standing queue that slots freeing up won't work off, and connections
+ * get shed at a rate that grows with the square root of how many were
+ * shed already, until one gets accepted within the target again.
+ * Returns 1 if the worker should turn the next waiting connection away.
+ */
+int limit_shed(struct limit *l, int pending) {
+	double now;
+	if (!pending) {
+		l->queued_since = 0.0;
+		limit_on_target(l);
+		return 0;
+	}
+	now = limit_now();
+	if (l->queued_since == 0.0) {
+		l->queued_since = now;
+	}
+	if (now - l->queued_since < LIMIT_QUEUE_TARGET) {
+		l->first_above = 0.0;
+		return 0;
+	}
+	if (!l->shedding) {
+		if (l->first_above == 0.0) {
+			l->first_above = now + LIMIT_QUEUE_INTERVAL;
+			return 0;
+		}
+		if (now < l->first_above) {
+			return 0;
+		}
+		l->shedding = 1;
+		l->shed_next = now;
+	}
+	if (now < l->shed_next) {
+		return 0;
+	}
+	l->shed_count += 1;
+	l->shed_next = now + LIMIT_QUEUE_INTERVAL / sqrt(
+		(double) l->shed_count
+	);
+	__atomic_fetch_add(&(l->shed), 1, __ATOMIC_RELAXED);
+	return 1;
+}
+
+/* Records that connections were taken off the backlog, each of them
+ * held back by the limit for as long as it has been held since the last
+ * time. Only the worker owning the limit may call this.
+ */
+void limit_accepted(struct limit *l) {
+	if (
+		l->queued_since == 0.0 ||
+		limit_now() - l->queued_since < LIMIT_QUEUE_TARGET
+	) {
+		limit_on_target(l);
+	}
+	l->queued_since = 0.0;
+}
+
+/* vi: set sts=8 ts=8 sw=8 noexpandtab: */
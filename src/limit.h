@@ -0,0 +1,79 @@
+#ifndef __mekdotlu_limit_h
+#define __mekdotlu_limit_h
+
+#include <stddef.h>
+#include <time.h>
+
+/* default bounds of the number of requests a worker has in flight */
+#define LIMIT_MIN 4
+#define LIMIT_MAX 256
+/* where the limit starts, within its bounds */
+#define LIMIT_START 8
+
+/* an adaptive limit on the requests a worker has in flight, in shared
+ * memory so that request children can report how long they took
+ *
+ * every window the limit grows if it was reached while latency stayed
+ * near its baseline, and shrinks by a tenth if latency went well above
+ * it; it doubles at first, and grows by one once it has shrunk
+ */
+struct limit {
+	/* bounds of the limit */
+	unsigned int min;
+	unsigned int max;
+	/* current limit and requests in flight, written by the worker */
+	unsigned int cur;
+	unsigned int inflight;
+	/* whether the limit still doubles as it grows */
+	int slow_start;
+	/* whether the limit was reached during this window */
+	int saturated;
+	/* requests being served rather than waited for on a keep-alive
+	 * connection, written by request children
+	 */
+	unsigned int busy;
+	/* latency samples of this window, written by request children */
+	unsigned long samples;
+	unsigned long nsec;
+	/* average latency of the last window and the lowest one seen,
+	 * which drifts upwards, in seconds
+	 */
+	double latency;
+	double baseline;
+	/* start of this window */
+	struct timespec window;
+	/* queue delay state, CoDel-style, in seconds of the monotonic
+	 * clock: since when the limit has held back waiting connections,
+	 * when the delay will have stayed above the target for too long,
+	 * whether connections are being shed, when to shed the next and
+	 * how many were shed since shedding started
+	 */
+	double queued_since;
+	double first_above;
+	int shedding;
+	double shed_next;
+	unsigned long shed_count;
+	/* times a waiting connection was held back by the limit */
+	unsigned long rejected;
+	/* connections turned away with a 503 */
+	unsigned long shed;
+	/* adjustments made */
+	unsigned long increases;
+	unsigned long decreases;
+};
+
+struct limit *limit_create(unsigned int min, unsigned int max, size_t n);
+int limit_destroy(struct limit *l, size_t n);
+int limit_parse(const char *str, unsigned int *min, unsigned int *max);
+
+int limit_acquire(struct limit *l);
+void limit_release(struct limit *l);
+void limit_begin(struct limit *l);
+void limit_end(struct limit *l, double dt);
+void limit_update(struct limit *l);
+int limit_shed(struct limit *l, int pending);
+void limit_accepted(struct limit *l);
+
+#endif /* __mekdotlu_limit_h */
+
+/* vi: set sts=8 ts=8 sw=8 noexpandtab: */
@@ -4,6 +4,12 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
+
+/* record locks only keep other processes out, this keeps lines from
+ * the threads of this one from interleaving
+ */
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 int vlog_raw(
 	const struct log_cfg *cfg,
@@ -32,6 +38,7 @@ int vlog_raw(
 
 #define RETMINUS(expr) \
 	if (expr == -1) { \
+		pthread_mutex_unlock(&log_mutex); \
 		va_end(vl_sec); \
 		return -1; \
 	}
@@ -41,6 +48,7 @@ int vlog_raw(
 	r += t; \
 	RETMINUS(t)
 
+	pthread_mutex_lock(&log_mutex);
 	/* log to file */
 	if (cfg->_fd != -1) {
 		int tmp;
@@ -112,6 +120,7 @@ int vlog_raw(
 			perror("log: fcntl");
 		}
 	}
+	pthread_mutex_unlock(&log_mutex);
 	va_end(vl_sec);
 	return ret;
 #undef RETMINUS
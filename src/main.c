@@ -4,6 +4,19 @@
 #include "log.h"
 #include "net.h"
 #include "server.h"
+#include "request.h"
+#include "bloom.h"
+#include "journal.h"
+#include "codegen.h"
+#include "hits.h"
+#include "cache.h"
+#include "rules.h"
+#include "urlstore.h"
+#include "limit.h"
+#include "throttle.h"
+#include "cpuset.h"
+#include "pool.h"
+#include "coro.h"
 #include <string.h>
 #include <limits.h>
 #include <stdlib.h>
@@ -36,7 +49,99 @@ void print_usage(FILE *f) {
 	p("        -r<str> Set document root. Default is current directory.");
 	p("        -o<str> Set log file. Can be left blank to not log to a");
 	p("                file. Default is ./mekdotlu.log");
+	p("        -R<str> Limit how fast each client address, or IPv6");
+	p("                /64, may connect as <rate>[:<burst>] per");
+	p("                second. Clients over it get a 429. The burst");
+	p("                defaults to twice the rate.");
+	p("        -s<str> Set listening socket options as a comma-");
+	p("                separated list of `[4.|6.]<key>=<num>', where");
+	p("                the prefix limits an option to IPv4 or IPv6 and");
+	p("                <key> is one of backlog, defer, fastopen,");
+	p("                nodelay, rcvbuf or sndbuf. The backlog defaults");
+	p("                to 128, the rest to system defaults.");
 	p("        -C      Force colored standard output.");
+	p("        -d<num> Give connections <num> seconds to finish when");
+	p("                quitting before killing them. Keep-alive ones");
+	p("                are closed after their current response.");
+	p("                Defaults to 10.");
+	p("        -H<str> Give clients <timeout>[:<rate>] to send the");
+	p("                headers of a request: seconds in all, and bytes");
+	p("                per second to average once two seconds have");
+	p("                passed. Slower ones get a 408 and are cut off.");
+	p("                Zero leaves either unbounded. Defaults to 10:32.");
+	p("        -n<str> Bound the requests each worker serves at once");
+	p("                as [<min>:]<max>. The limit starts at 8 within");
+	p("                those and grows while latency holds, shrinking");
+	p("                when it rises. Defaults to 4:256.");
+	p("        -T<str> Serve connections with <threads>[:<queue>]");
+	p("                threads per worker instead of forking a child");
+	p("                for each, up to <queue> connections waiting for");
+	p("                them before the rest get a 503. The queue");
+	p("                defaults to 256. Defaults to 0, forking.");
+	p("        -E[num] Serve connections in coroutines on the workers");
+	p("                themselves instead of forking a child for each,");
+	p("                with [num] KiB of stack each. The stack defaults");
+	p("                to 64. Can't be combined with -T or -a. Linux");
+	p("                only.");
+	p("        -A<str> Pin the workers and their request children to");
+	p("                CPUs as <ipv4>[:<ipv6>], lists like `0-3,8'.");
+	p("                One list goes for both. Unpinned by default.");
+	p("        -I      Pin each request child to the CPU its");
+	p("                connection came in on, if the worker may run");
+	p("                there. Can't be combined with -T or -E, which");
+	p("                fork no children.");
+	p("        -D      Listen on a single dual-stack IPv6 socket that");
+	p("                takes IPv4 as v4-mapped addresses, served by one");
+	p("                worker with the IPv6 settings of the other");
+	p("                switches.");
+	p("        -U      Start the binary anew on SIGUSR2, handing the");
+	p("                listening sockets over to it. The old workers");
+	p("                finish their connections and quit once the new");
+	p("                ones are up.");
+	p("        -a<str> Enable the insertion API, reading its bearer");
+	p("                token from the first line of the given file.");
+	p("        -J<str> Set the insertion API journal file. Default is");
+	p("                ./mekdotlu.journal");
+	p("        -g<str> Set the length and alphabet of codes generated");
+	p("                for POST requests to / and /e/ as");
+	p("                <len>[:<alphabet>]. Defaults to 6 characters");
+	p("                out of [0-9A-Za-z].");
+	p("        -e<str> Set the redirect policy for the /e/ tree as");
+	p("                <code>[:<max-age>], where <code> is one of 301,");
+	p("                302, 303, 307 or 308 and <max-age> is sent in a");
+	p("                Cache-Control header. Defaults to 302 without");
+	p("                caching. A second line in a redirect file in");
+	p("                the same format overrides the tree policy.");
+	p("        -i<str> Set the redirect policy for the /i/ tree.");
+	p("        -t<str> Read prefix redirect rules from the given file,");
+	p("                one `<prefix> <template> [<policy>]' per line.");
+	p("                The rest of a matching path replaces `{}' in");
+	p("                the template. Rules are checked before the");
+	p("                trees and default to the /i/ tree policy.");
+	p("        -S<str> Set the shard scheme of the trees. <len>[x<n>]");
+	p("                nests codes in <n> directories of <len> code");
+	p("                points each off the start of the code,");
+	p("                h<num>[x<n>] in <n> directories of <num>");
+	p("                entries each named after a hash of the code.");
+	p("                Defaults to 3x1, e.g. /i/mar/marvelous. Use");
+	p("                mekdotlu-insert -M to move existing trees over.");
+	p("        -L      Don't take read locks on redirect files. Only");
+	p("                use this if every writer publishes files by");
+	p("                renaming them into place.");
+	p("        -b<num> Keep a Bloom filter sized for <num> short codes");
+	p("                in memory and answer definite misses with a");
+	p("                404 without touching the filesystem. The filter");
+	p("                is rebuilt from the trees on SIGHUP.");
+	p("        -m<num> Keep a compact copy of the trees in two arenas");
+	p("                of <num> MiB each, and serve redirects from it");
+	p("                without touching the filesystem. It is rebuilt");
+	p("                from the trees on SIGHUP.");
+	p("        -c<str> Count hits per short code in the given file,");
+	p("                flushed every 30 seconds. The hottest codes are");
+	p("                logged on SIGUSR1.");
+	p("        -P<num> Keep up to <num> redirect responses rendered");
+	p("                in memory, and send them in a single write for");
+	p("                as long as their file is unchanged.");
 	p("");
 	p("  (-h)  --help  Show this help and exit.");
 	p("");
@@ -44,6 +149,9 @@ void print_usage(FILE *f) {
 	p("        Run the service on port 80, follow path symlinks and");
 	p("        set the document root to `./urls'.");
 	p("        $ mekdotlu -p80 -f -r./urls");
+	p("");
+	p("        Make /e/ redirects permanent and cacheable for a day.");
+	p("        $ mekdotlu -e301:86400");
 }
 #undef p
 
@@ -67,6 +175,24 @@ char *config_realpath(const char *path, int symlinks) {
 	return rp;
 }
 
+/* reads the API token from the first line of path into token, which
+ * holds REQUEST_TOKEN_MAX bytes; returns 1 on success, 0 otherwise
+ */
+int config_token(const char *path, char *token) {
+	FILE *f = fopen(path, "r");
+	size_t len;
+	if (f == NULL) {
+		return 0;
+	}
+	if (fgets(token, REQUEST_TOKEN_MAX, f) == NULL) {
+		token[0] = '\0';
+	}
+	fclose(f);
+	len = strcspn(token, "\r\n");
+	token[len] = '\0';
+	return len > 0 && len < REQUEST_TOKEN_MAX - 1;
+}
+
 void populate_cfg(
 	struct server_cfg *cfg,
 	int argc,
@@ -74,16 +200,23 @@ void populate_cfg(
 ) {
 	int i, err, symlinks, help;
 	unsigned short port = 0;
+	unsigned int codelen = CODEGEN_LEN;
+	const char *alphabet = CODEGEN_ALPHABET;
 	struct {
 		char *root;
 		char *log;
+		char *token;
+		char *journal;
+		char *codegen;
+		char *hits;
+		char *rules;
 	} f;
 
 	char should_setuid = 0;
 	struct {
 		uid_t uid;
 		gid_t gid;
-	} setuid_info;
+	} setuid_info = { 0, 0 };
 
 	memset(cfg, 0, sizeof(*cfg));
 	memset(&f, 0, sizeof(f));
@@ -95,6 +228,22 @@ void populate_cfg(
 	cfg->_lcfg.forcecolor = 0;
 	cfg->root = config_realpath(NULL, 0);
 	cfg->port = 8081;
+	cfg->_argv = argv;
+	cfg->_sock = -1;
+	cfg->_sock6 = -1;
+	net_opts_init(&(cfg->sockopts[0]));
+	net_opts_init(&(cfg->sockopts[1]));
+	cfg->_rcfg.ext.code = 302;
+	cfg->_rcfg.ext.maxage = -1;
+	cfg->_rcfg.in = cfg->_rcfg.ext;
+	cfg->_rcfg.shard_len = 3;
+	cfg->_rcfg.shard_levels = 1;
+	cfg->_rcfg.drain_timeout = 10;
+	cfg->_rcfg.header_timeout = REQUEST_HEADER_TIMEOUT;
+	cfg->_rcfg.header_rate = REQUEST_HEADER_RATE;
+	cfg->_rcfg.queue = POOL_QUEUE;
+	cfg->_rcfg.limit_min = LIMIT_MIN;
+	cfg->_rcfg.limit_max = LIMIT_MAX;
 	/* parse args */
 	/* look for errors and -f first, and store path indices */
 	for (i = 1; i < argc; i += 1) {
@@ -125,6 +274,18 @@ void populate_cfg(
 		} else if (argv[i][1] == 'C') {
 			NOVAL('C');
 			cfg->_lcfg.forcecolor = 1;
+		} else if (argv[i][1] == 'L') {
+			NOVAL('L');
+			cfg->_rcfg.nolock = 1;
+		} else if (argv[i][1] == 'U') {
+			NOVAL('U');
+			cfg->upgrade = 1;
+		} else if (argv[i][1] == 'I') {
+			NOVAL('I');
+			cfg->_rcfg.follow_cpu = 1;
+		} else if (argv[i][1] == 'D') {
+			NOVAL('D');
+			cfg->dualstack = 1;
 #undef NOVAL
 		} else if (
 			argv[i][1] == 'h' ||
@@ -142,6 +303,252 @@ void populate_cfg(
 			f.root = &(argv[i][2]);
 		} else if (argv[i][1] == 'o') {
 			f.log = &(argv[i][2]);
+		} else if (argv[i][1] == 'a') {
+			f.token = &(argv[i][2]);
+		} else if (argv[i][1] == 'J') {
+			f.journal = &(argv[i][2]);
+		} else if (argv[i][1] == 'g') {
+			f.codegen = &(argv[i][2]);
+		} else if (argv[i][1] == 'c') {
+			f.hits = &(argv[i][2]);
+		} else if (argv[i][1] == 't') {
+			f.rules = &(argv[i][2]);
+		} else if (argv[i][1] == 'e' || argv[i][1] == 'i') {
+			if (
+				request_redir_parse(
+					&(argv[i][2]),
+					(argv[i][1] == 'e') ?
+						&(cfg->_rcfg.ext) :
+						&(cfg->_rcfg.in)
+				) == 0
+			) {
+				fprintf(
+					stderr,
+					"Could not parse redirect policy: %s\n",
+					&(argv[i][2])
+				);
+				err = 1;
+			}
+		} else if (argv[i][1] == 'S') {
+			if (
+				request_shard_parse(
+					&(argv[i][2]),
+					&(cfg->_rcfg)
+				) == 0
+			) {
+				fprintf(
+					stderr,
+					"Could not parse shard scheme: %s\n",
+					&(argv[i][2])
+				);
+				err = 1;
+			}
+		} else if (argv[i][1] == 'b') {
+			unsigned long entries = 0;
+			if (
+				sscanf(&(argv[i][2]), "%lu", &entries) != 1 ||
+				entries == 0
+			) {
+				fprintf(
+					stderr,
+					"Could not parse Bloom filter size: %s\n",
+					&(argv[i][2])
+				);
+				err = 1;
+				continue;
+			}
+			bloom_destroy(cfg->_rcfg._bloom);
+			cfg->_rcfg._bloom = bloom_create(entries);
+			if (cfg->_rcfg._bloom == NULL) {
+				perror("bloom_create");
+				err = 1;
+			}
+		} else if (argv[i][1] == 'm') {
+			unsigned long mib = 0;
+			if (
+				sscanf(&(argv[i][2]), "%lu", &mib) != 1 ||
+				mib == 0
+			) {
+				fprintf(
+					stderr,
+					"Could not parse URL store size: %s\n",
+					&(argv[i][2])
+				);
+				err = 1;
+				continue;
+			}
+			urlstore_destroy(cfg->_rcfg._urlstore);
+			cfg->_rcfg._urlstore = urlstore_create(
+				(size_t) mib << 20
+			);
+			if (cfg->_rcfg._urlstore == NULL) {
+				perror("urlstore_create");
+				err = 1;
+			}
+		} else if (argv[i][1] == 'd') {
+			long timeout = -1;
+			int n = 0;
+			if (
+				sscanf(
+					&(argv[i][2]),
+					"%ld%n",
+					&timeout,
+					&n
+				) != 1 ||
+				argv[i][2 + n] != '\0' ||
+				timeout < 0
+			) {
+				fprintf(
+					stderr,
+					"Could not parse drain deadline: %s\n",
+					&(argv[i][2])
+				);
+				err = 1;
+				continue;
+			}
+			cfg->_rcfg.drain_timeout = timeout;
+		} else if (argv[i][1] == 'T') {
+			if (
+				pool_parse(
+					&(argv[i][2]),
+					&(cfg->_rcfg.threads),
+					&(cfg->_rcfg.queue)
+				) == 0
+			) {
+				fprintf(
+					stderr,
+					"Could not parse thread pool: %s\n",
+					&(argv[i][2])
+				);
+				err = 1;
+			}
+		} else if (argv[i][1] == 'E') {
+			unsigned int stack = CORO_STACK;
+			int n = 0;
+			if (
+				argv[i][2] != '\0' &&
+				(
+					sscanf(
+						&(argv[i][2]),
+						"%u%n",
+						&stack,
+						&n
+					) != 1 ||
+					argv[i][2 + n] != '\0' ||
+					stack == 0
+				)
+			) {
+				fprintf(
+					stderr,
+					"Could not parse coroutine stack: %s\n",
+					&(argv[i][2])
+				);
+				err = 1;
+				continue;
+			}
+			cfg->_rcfg.coro_stack = stack;
+		} else if (argv[i][1] == 'A') {
+			if (
+				cpuset_parse(
+					&(argv[i][2]),
+					&(cfg->cpus[0]),
+					&(cfg->cpus[1])
+				) == 0
+			) {
+				fprintf(
+					stderr,
+					"Could not parse CPU set: %s\n",
+					&(argv[i][2])
+				);
+				err = 1;
+			}
+		} else if (argv[i][1] == 'H') {
+			if (
+				request_header_parse(
+					&(argv[i][2]),
+					&(cfg->_rcfg.header_timeout),
+					&(cfg->_rcfg.header_rate)
+				) == 0
+			) {
+				fprintf(
+					stderr,
+					"Could not parse header deadline: %s\n",
+					&(argv[i][2])
+				);
+				err = 1;
+			}
+		} else if (argv[i][1] == 's') {
+			struct net_opts o4, o6;
+			net_opts_init(&o4);
+			net_opts_init(&o6);
+			if (net_opts_parse(&(argv[i][2]), &o4, &o6) == 0) {
+				fprintf(
+					stderr,
+					"Could not parse socket options: %s\n",
+					&(argv[i][2])
+				);
+				err = 1;
+				continue;
+			}
+			cfg->sockopts[0] = o4;
+			cfg->sockopts[1] = o6;
+		} else if (argv[i][1] == 'R') {
+			double rate = 0.0, burst = 0.0;
+			if (throttle_parse(&(argv[i][2]), &rate, &burst) == 0) {
+				fprintf(
+					stderr,
+					"Could not parse client rate: %s\n",
+					&(argv[i][2])
+				);
+				err = 1;
+				continue;
+			}
+			throttle_destroy(cfg->_rcfg._throttle[0]);
+			throttle_destroy(cfg->_rcfg._throttle[1]);
+			cfg->_rcfg._throttle[0] = throttle_create(rate, burst);
+			cfg->_rcfg._throttle[1] = throttle_create(rate, burst);
+			if (
+				cfg->_rcfg._throttle[0] == NULL ||
+				cfg->_rcfg._throttle[1] == NULL
+			) {
+				perror("throttle_create");
+				err = 1;
+			}
+		} else if (argv[i][1] == 'n') {
+			if (
+				limit_parse(
+					&(argv[i][2]),
+					&(cfg->_rcfg.limit_min),
+					&(cfg->_rcfg.limit_max)
+				) == 0
+			) {
+				fprintf(
+					stderr,
+					"Could not parse request limit: %s\n",
+					&(argv[i][2])
+				);
+				err = 1;
+			}
+		} else if (argv[i][1] == 'P') {
+			unsigned long entries = 0;
+			if (
+				sscanf(&(argv[i][2]), "%lu", &entries) != 1 ||
+				entries == 0
+			) {
+				fprintf(
+					stderr,
+					"Could not parse response cache size: %s\n",
+					&(argv[i][2])
+				);
+				err = 1;
+				continue;
+			}
+			cache_destroy(cfg->_rcfg._cache);
+			cfg->_rcfg._cache = cache_create(entries);
+			if (cfg->_rcfg._cache == NULL) {
+				perror("cache_create");
+				err = 1;
+			}
 		} else if (argv[i][1] == 'u') {
 			char *buffer = NULL;
 			struct passwd pwd, *result = NULL;
@@ -216,6 +623,23 @@ void populate_cfg(
 			err = 1;
 		}
 	}
+	if (cfg->_rcfg.coro_stack > 0 && cfg->_rcfg.threads > 0) {
+		fprintf(stderr, "The -E and -T switches are exclusive\n");
+		err = 1;
+	}
+	/* only forked request children can follow their connection */
+	if (
+		cfg->_rcfg.follow_cpu &&
+		(cfg->_rcfg.coro_stack > 0 || cfg->_rcfg.threads > 0)
+	) {
+		fprintf(stderr, "The -I switch needs request children\n");
+		err = 1;
+	}
+	/* journal syncs would stall every coroutine of the worker */
+	if (cfg->_rcfg.coro_stack > 0 && f.token != NULL) {
+		fprintf(stderr, "The -E and -a switches are exclusive\n");
+		err = 1;
+	}
 	if (err == 1 || help == 1) {
 		if (err == 1) {
 			fputs("\n", stderr);
@@ -237,6 +661,73 @@ void populate_cfg(
 	if (port != 0) {
 		cfg->port = port;
 	}
+	if (f.token != NULL) {
+		if (config_token(f.token, cfg->_rcfg.token) == 0) {
+			fprintf(
+				stderr,
+				"Could not read an API token from %s\n",
+				f.token
+			);
+			exit(EXIT_FAILURE);
+		}
+		cfg->_rcfg._journal = journal_open(
+			(f.journal != NULL) ? f.journal : "mekdotlu.journal"
+		);
+		if (cfg->_rcfg._journal == NULL) {
+			perror("journal_open");
+			exit(EXIT_FAILURE);
+		}
+		/* the token keys the code permutation */
+		if (
+			f.codegen != NULL &&
+			codegen_parse(f.codegen, &codelen, &alphabet) == 0
+		) {
+			errno = EINVAL;
+		} else {
+			cfg->_rcfg._codegen = codegen_create(
+				codelen,
+				alphabet,
+				cfg->_rcfg.token
+			);
+		}
+		if (cfg->_rcfg._codegen == NULL) {
+			fprintf(
+				stderr,
+				"Bad code generator spec %s: %s\n",
+				(f.codegen != NULL) ? f.codegen : "-g",
+				strerror(errno)
+			);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (f.rules != NULL) {
+		cfg->_rcfg._rules = rules_load(
+			f.rules,
+			cfg->_rcfg.in.code,
+			cfg->_rcfg.in.maxage
+		);
+		if (cfg->_rcfg._rules == NULL) {
+			fprintf(
+				stderr,
+				"Could not load redirect rules %s: %s\n",
+				f.rules,
+				strerror(errno)
+			);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (f.hits != NULL) {
+		cfg->_rcfg._hits = hits_open(f.hits);
+		if (cfg->_rcfg._hits == NULL) {
+			fprintf(
+				stderr,
+				"Could not open hit counters %s: %s\n",
+				f.hits,
+				strerror(errno)
+			);
+			exit(EXIT_FAILURE);
+		}
+	}
 	if (should_setuid) {
 		cfg->should_setuid = 1;
 		cfg->uid = setuid_info.uid;
@@ -1,11 +1,188 @@
+/* for accept4() */
+#if defined(__linux) && !defined(_GNU_SOURCE)
+#	define _GNU_SOURCE
+#endif
+
 #include "log.h"
 #include "net.h"
+#include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <errno.h>
 
-int net_listen(const struct log_cfg *lcfg, int af, unsigned short port) {
+void net_opts_init(struct net_opts *opts) {
+	opts->backlog = NET_BACKLOG;
+	opts->defer_accept = -1;
+	opts->fastopen = -1;
+	opts->nodelay = -1;
+	opts->rcvbuf = -1;
+	opts->sndbuf = -1;
+	opts->v6only = 1;
+}
+
+/* Parses a comma-separated list of `[4.|6.]<key>=<value>' options
+ * into the options of either address family or both. Returns 1 on
+ * success, 0 otherwise.
+ */
+int net_opts_parse(
+	const char *str,
+	struct net_opts *opts4,
+	struct net_opts *opts6
+) {
+	while (str != NULL && *str != '\0') {
+		char key[16];
+		int val = -1, n = 0, *p4 = NULL, *p6 = NULL;
+		struct net_opts *o4 = opts4, *o6 = opts6;
+		if (str[0] == '4' && str[1] == '.') {
+			o6 = NULL;
+			str += 2;
+		} else if (str[0] == '6' && str[1] == '.') {
+			o4 = NULL;
+			str += 2;
+		}
+		if (
+			sscanf(str, "%15[a-z]=%d%n", key, &val, &n) != 2 ||
+			val < 0 ||
+			(str[n] != ',' && str[n] != '\0')
+		) {
+			return 0;
+		}
+#define NETOPT(_name, _field) \
+		if (strcmp(key, _name) == 0) { \
+			p4 = (o4 != NULL) ? &(o4->_field) : NULL; \
+			p6 = (o6 != NULL) ? &(o6->_field) : NULL; \
+		}
+		NETOPT("backlog", backlog)
+		else NETOPT("defer", defer_accept)
+		else NETOPT("fastopen", fastopen)
+		else NETOPT("nodelay", nodelay)
+		else NETOPT("rcvbuf", rcvbuf)
+		else NETOPT("sndbuf", sndbuf)
+		else {
+			return 0;
+		}
+#undef NETOPT
+		if (p4 != NULL) {
+			*p4 = val;
+		}
+		if (p6 != NULL) {
+			*p6 = val;
+		}
+		str += n + (str[n] == ',');
+	}
+	return str != NULL;
+}
+
+/* the backlog listen() actually gets, which the system may cap */
+int net_backlog(int backlog) {
+#if defined(__linux)
+	FILE *f = fopen("/proc/sys/net/core/somaxconn", "r");
+	int max = -1;
+	if (f != NULL) {
+		if (fscanf(f, "%d", &max) == 1 && max > 0 && max < backlog) {
+			backlog = max;
+		}
+		fclose(f);
+	}
+#endif
+	return backlog;
+}
+
+/* reads back an integer socket option, -1 if unavailable */
+int net_getopt(int sockfd, int level, int name) {
+	int val = -1;
+	socklen_t len = sizeof(val);
+	if (getsockopt(sockfd, level, name, (void *) &val, &len) == -1) {
+		return -1;
+	}
+	return val;
+}
+
+/* Applies the options to a bound socket and starts listening on it, or
+ * updates the backlog of one that already does. Logs the values the
+ * system ended up using. Returns 1 on success, 0 if listen() failed.
+ */
+int net_tune(
+	const struct log_cfg *lcfg,
+	int sockfd,
+	const char *name,
+	const struct net_opts *opts
+) {
+	int defer = -1, fastopen = -1, nodelay = -1, flags;
+#define SETOPT(_level, _name, _val) \
+	if ((_val) != -1) { \
+		int _v = (_val); \
+		errno = 0; \
+		if (setsockopt( \
+			sockfd, \
+			(_level), \
+			(_name), \
+			(void *) &_v, \
+			sizeof(_v) \
+		) == -1) { \
+			log_perror( \
+				lcfg, \
+				errno, \
+				"net: %s: setsockopt: " #_name, \
+				name \
+			); \
+		} \
+	}
+#ifdef TCP_DEFER_ACCEPT
+	SETOPT(IPPROTO_TCP, TCP_DEFER_ACCEPT, opts->defer_accept);
+#endif
+#ifdef TCP_FASTOPEN
+	SETOPT(IPPROTO_TCP, TCP_FASTOPEN, opts->fastopen);
+#endif
+	/* accepted sockets inherit these */
+	SETOPT(IPPROTO_TCP, TCP_NODELAY, opts->nodelay);
+	SETOPT(SOL_SOCKET, SO_RCVBUF, opts->rcvbuf);
+	SETOPT(SOL_SOCKET, SO_SNDBUF, opts->sndbuf);
+#undef SETOPT
+	/* workers accept until the queue runs dry */
+	errno = 0;
+	flags = fcntl(sockfd, F_GETFL);
+	if (flags == -1 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		log_perror(lcfg, errno, "net: %s: fcntl", name);
+	}
+	errno = 0;
+	if (listen(sockfd, opts->backlog) == -1) {
+		log_perror(lcfg, errno, "net: %s: listen", name);
+		return 0;
+	}
+#ifdef TCP_DEFER_ACCEPT
+	defer = net_getopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT);
+#endif
+#ifdef TCP_FASTOPEN
+	fastopen = net_getopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN);
+#endif
+	nodelay = net_getopt(sockfd, IPPROTO_TCP, TCP_NODELAY);
+	log_reg(
+		lcfg,
+		"net: %s: backlog %d, defer accept %ds, fast open queue %d, "
+		"nodelay %d, rcvbuf %d, sndbuf %d",
+		name,
+		net_backlog(opts->backlog),
+		defer,
+		fastopen,
+		nodelay,
+		net_getopt(sockfd, SOL_SOCKET, SO_RCVBUF),
+		net_getopt(sockfd, SOL_SOCKET, SO_SNDBUF)
+	);
+	return 1;
+}
+
+int net_listen(
+	const struct log_cfg *lcfg,
+	int af,
+	unsigned short port,
+	const struct net_opts *opts
+) {
 	int ret, sockfd;
 	union {
 		struct sockaddr_in addr4;
@@ -30,10 +207,27 @@ int net_listen(const struct log_cfg *lcfg, int af, unsigned short port) {
 		log_perror(lcfg, errno, "net: socket");
 		return -1;
 	}
+	/* don't let connections lingering from a previous run keep us
+	 * from binding
+	 */
+	{
+		int flag = 1;
+		if (setsockopt(
+			sockfd,
+			SOL_SOCKET,
+			SO_REUSEADDR,
+			(void *) &flag,
+			sizeof(flag)
+		) == -1) {
+			log_perror(lcfg, errno, "net: setsockopt");
+		}
+	}
 #ifdef IPV6_V6ONLY
-	/* disable IPv4 support with IPv6 sockets */
+	/* disable IPv4 support with IPv6 sockets, unless asked not to,
+	 * as the system default varies
+	 */
 	if (af == AF_INET6) {
-		int flag = 1;
+		int flag = opts->v6only;
 		if (setsockopt(
 			sockfd,
 			IPPROTO_IPV6,
@@ -68,11 +262,12 @@ int net_listen(const struct log_cfg *lcfg, int af, unsigned short port) {
 		}
 		return -1;
 	}
-	/* have at most 8 items in the backlog */
-	errno = 0;
-	ret = listen(sockfd, 8);
-	if (ret == -1) {
-		log_perror(lcfg, errno, "net: listen");
+	if (net_tune(
+		lcfg,
+		sockfd,
+		(af == AF_INET) ? "ipv4" : "ipv6",
+		opts
+	) == 0) {
 		if (close(sockfd) == -1) {
 			log_perror(lcfg, errno, "net: close");
 		}
@@ -99,14 +294,29 @@ int net_accept(
 	}
 	memset(storeaddr, 0, addr_size);
 	errno = 0;
+	/* children use blocking I/O on their connection, so only keep
+	 * it from leaking into anything they exec
+	 */
+#if defined(__linux) && defined(SOCK_CLOEXEC)
+	ret = accept4(
+		sockfd,
+		storeaddr,
+		&addr_size,
+		SOCK_CLOEXEC
+	);
+#else
 	ret = accept(
 		sockfd,
 		storeaddr,
 		&addr_size
 	);
+#endif
 	if (ret == -1) {
 		storerr = errno;
-		log_perror(lcfg, storerr, "net: accept");
+		/* the queue running dry is business as usual */
+		if (storerr != EAGAIN && storerr != EWOULDBLOCK) {
+			log_perror(lcfg, storerr, "net: accept");
+		}
 	}
 	errno = storerr;
 	return ret;
@@ -4,7 +4,45 @@
 #include "log.h"
 #include <sys/socket.h>
 
-int net_listen(const struct log_cfg *lcfg, int af, unsigned short port);
+/* default listen backlog */
+#define NET_BACKLOG 128
+
+/* options for a listening socket, -1 leaves the system default */
+struct net_opts {
+	int backlog;
+	/* seconds to wait for data before waking us for a connection */
+	int defer_accept;
+	/* TCP Fast Open queue length */
+	int fastopen;
+	/* disable Nagle's algorithm on accepted connections */
+	int nodelay;
+	int rcvbuf;
+	int sndbuf;
+	/* whether an IPv6 socket leaves IPv4 to a socket of its own,
+	 * rather than taking v4-mapped connections too
+	 */
+	int v6only;
+};
+
+void net_opts_init(struct net_opts *opts);
+int net_opts_parse(
+	const char *str,
+	struct net_opts *opts4,
+	struct net_opts *opts6
+);
+
+int net_tune(
+	const struct log_cfg *lcfg,
+	int sockfd,
+	const char *name,
+	const struct net_opts *opts
+);
+int net_listen(
+	const struct log_cfg *lcfg,
+	int af,
+	unsigned short port,
+	const struct net_opts *opts
+);
 int net_accept(
 	const struct log_cfg *lcfg,
 	int sockfd,
@@ -0,0 +1,414 @@
+#include "pool.h"
+#include "clock.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+
+/* Parses a pool size in the `<threads>[:<queue>]' format. The queue
+ * defaults to POOL_QUEUE. Returns 1 on success, 0 otherwise.
+ */
+int pool_parse(const char *str, unsigned int *threads, unsigned int *queue) {
+	unsigned int t = 0, q = POOL_QUEUE;
+	int n = 0, m = 0;
+	if (str == NULL || sscanf(str, "%u%n", &t, &n) != 1) {
+		return 0;
+	}
+	if (str[n] == ':') {
+		if (
+			sscanf(&(str[n + 1]), "%u%n", &q, &m) != 1 ||
+			q == 0
+		) {
+			return 0;
+		}
+		n += 1 + m;
+	}
+	if (str[n] != '\0') {
+		return 0;
+	}
+	*threads = t;
+	*queue = q;
+	return 1;
+}
+
+/* Queues a connection for the threads. Returns 1 on success, 0 if the
+ * queue is full.
+ */
+int pool_push(struct pool *p, const struct pool_conn *c) {
+	struct pool_cell *cell;
+	unsigned long pos = __atomic_load_n(&(p->head), __ATOMIC_RELAXED);
+	for (;;) {
+		long dif;
+		cell = &(p->cells[pos & p->mask]);
+		dif = (long) (
+			__atomic_load_n(&(cell->seq), __ATOMIC_ACQUIRE) - pos
+		);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(
+				&(p->head),
+				&pos,
+				pos + 1,
+				1,
+				__ATOMIC_RELAXED,
+				__ATOMIC_RELAXED
+			)) {
+				break;
+			}
+		} else if (dif < 0) {
+			return 0;
+		} else {
+			pos = __atomic_load_n(&(p->head), __ATOMIC_RELAXED);
+		}
+	}
+	__atomic_fetch_add(&(p->pending), 1, __ATOMIC_RELAXED);
+	cell->conn = *c;
+	__atomic_store_n(&(cell->seq), pos + 1, __ATOMIC_RELEASE);
+	pool_wake(p);
+	return 1;
+}
+
+/* Wakes a parked thread after making a connection available. A thread
+ * about to park either sees the connection or is seen parking here.
+ */
+void pool_wake(struct pool *p) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&(p->parked), __ATOMIC_RELAXED) > 0) {
+		pthread_mutex_lock(&(p->lock));
+		pthread_cond_signal(&(p->cond));
+		pthread_mutex_unlock(&(p->lock));
+	}
+}
+
+/* Takes the oldest queued connection. Returns 1 on success, 0 if the
+ * queue is empty.
+ */
+int pool_pop(struct pool *p, struct pool_conn *c) {
+	struct pool_cell *cell;
+	unsigned long pos = __atomic_load_n(&(p->tail), __ATOMIC_RELAXED);
+	for (;;) {
+		long dif;
+		cell = &(p->cells[pos & p->mask]);
+		dif = (long) (
+			__atomic_load_n(&(cell->seq), __ATOMIC_ACQUIRE) -
+			(pos + 1)
+		);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(
+				&(p->tail),
+				&pos,
+				pos + 1,
+				1,
+				__ATOMIC_RELAXED,
+				__ATOMIC_RELAXED
+			)) {
+				break;
+			}
+		} else if (dif < 0) {
+			return 0;
+		} else {
+			pos = __atomic_load_n(&(p->tail), __ATOMIC_RELAXED);
+		}
+	}
+	*c = cell->conn;
+	__atomic_store_n(&(cell->seq), pos + p->mask + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* Pushes a connection to the bottom of a deque, from its thread only.
+ * Returns 1 on success, 0 if it is full.
+ */
+int pool_deque_push(struct pool_deque *d, const struct pool_conn *c) {
+	long b = __atomic_load_n(&(d->bottom), __ATOMIC_RELAXED);
+	long t = __atomic_load_n(&(d->top), __ATOMIC_ACQUIRE);
+	if (b - t >= POOL_DEQUE) {
+		return 0;
+	}
+	d->conns[b & (POOL_DEQUE - 1)] = *c;
+	__atomic_store_n(&(d->bottom), b + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* Takes the connection at the bottom of a deque, from its thread only.
+ * Returns 1 on success, 0 if it is empty.
+ */
+int pool_deque_take(struct pool_deque *d, struct pool_conn *c) {
+	long b = __atomic_load_n(&(d->bottom), __ATOMIC_RELAXED) - 1, t;
+	int ret = 1;
+	__atomic_store_n(&(d->bottom), b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	t = __atomic_load_n(&(d->top), __ATOMIC_RELAXED);
+	if (t > b) {
+		/* empty */
+		__atomic_store_n(&(d->bottom), b + 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	*c = d->conns[b & (POOL_DEQUE - 1)];
+	if (t == b) {
+		/* the last one, which a thief may be after too */
+		if (!__atomic_compare_exchange_n(
+			&(d->top),
+			&t,
+			t + 1,
+			0,
+			__ATOMIC_SEQ_CST,
+			__ATOMIC_RELAXED
+		)) {
+			ret = 0;
+		}
+		__atomic_store_n(&(d->bottom), b + 1, __ATOMIC_RELAXED);
+	}
+	return ret;
+}
+
+/* Steals the connection at the top of a deque. Returns 1 on success, 0
+ * if it is empty, -1 if another thread got there first.
+ */
+int pool_deque_steal(struct pool_deque *d, struct pool_conn *c) {
+	long t = __atomic_load_n(&(d->top), __ATOMIC_ACQUIRE), b;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	b = __atomic_load_n(&(d->bottom), __ATOMIC_ACQUIRE);
+	if (t >= b) {
+		return 0;
+	}
+	*c = d->conns[t & (POOL_DEQUE - 1)];
+	if (!__atomic_compare_exchange_n(
+		&(d->top),
+		&t,
+		t + 1,
+		0,
+		__ATOMIC_SEQ_CST,
+		__ATOMIC_RELAXED
+	)) {
+		return -1;
+	}
+	return 1;
+}
+
+/* Finds a thread its next connection: off its own deque, then the
+ * shared queue, bringing a few more along for idle threads to steal
+ * should this one get stuck, then the deques of the others. The caller
+ * may hold the pool lock, as told by locked. Returns 1 on success, 0 if
+ * there is nothing to do.
+ */
+int pool_next(struct pool_thread *self, struct pool_conn *c, int locked) {
+	struct pool *p = self->pool;
+	struct pool_conn more;
+	size_t i, n;
+	int r, contended;
+	if (pool_deque_take(&(self->deque), c)) {
+		return 1;
+	}
+	if (pool_pop(p, c)) {
+		for (
+			n = 1;
+			n < POOL_GRAB && pool_pop(p, &more);
+			n += 1
+		) {
+			pool_deque_push(&(self->deque), &more);
+		}
+		if (n > 1 && locked) {
+			pthread_cond_signal(&(p->cond));
+		} else if (n > 1) {
+			pool_wake(p);
+		}
+		return 1;
+	}
+	do {
+		contended = 0;
+		for (i = 1; i < p->nthreads; i += 1) {
+			struct pool_thread *victim =
+				&(p->threads[(self->id + i) % p->nthreads]);
+			r = pool_deque_steal(&(victim->deque), c);
+			if (r == 1) {
+				__atomic_fetch_add(
+					&(p->stats->steals),
+					1,
+					__ATOMIC_RELAXED
+				);
+				return 1;
+			}
+			contended |= (r == -1);
+		}
+	} while (contended);
+	return 0;
+}
+
+/* takes a connection, sleeping until there is one */
+void pool_wait(struct pool_thread *self, struct pool_conn *c) {
+	struct pool *p = self->pool;
+	for (;;) {
+		int got;
+		if (pool_next(self, c, 0)) {
+			return;
+		}
+		pthread_mutex_lock(&(p->lock));
+		__atomic_fetch_add(&(p->parked), 1, __ATOMIC_SEQ_CST);
+		got = pool_next(self, c, 1);
+		if (!got) {
+			__atomic_fetch_add(
+				&(p->stats->parks),
+				1,
+				__ATOMIC_RELAXED
+			);
+			pthread_cond_wait(&(p->cond), &(p->lock));
+		}
+		__atomic_fetch_sub(&(p->parked), 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&(p->lock));
+		if (got) {
+			return;
+		}
+	}
+}
+
+void *pool_run(void *arg) {
+	struct pool_thread *self = arg;
+	struct pool *p = self->pool;
+	struct pool_conn c;
+	struct timespec tp;
+	double dt;
+	for (;;) {
+		pool_wait(self, &c);
+		__atomic_fetch_add(&(p->stats->handled), 1, __ATOMIC_RELAXED);
+		clock_gettime(CLOCK_MONOTONIC, &tp);
+		dt = (double) tp.tv_sec - (double) c.accepted.tv_sec + (
+			(double) tp.tv_nsec -
+			(double) c.accepted.tv_nsec
+		) / (double) 1000000000.0;
+		request_process(
+			p->lcfg,
+			p->rcfg,
+			c.sock,
+			dt,
+			(struct sockaddr *) &(c.addr)
+		);
+		__atomic_fetch_sub(&(p->pending), 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+/* Starts nthreads threads serving connections queued by the caller.
+ * A write to a closed connection must not take the whole pool down, so
+ * this ignores SIGPIPE for the process. Returns NULL on error.
+ */
+struct pool *pool_create(
+	const struct log_cfg *lcfg,
+	const struct request_cfg *rcfg,
+	struct pool_stats *stats,
+	unsigned int nthreads,
+	unsigned int queue
+) {
+	static struct pool_stats nostats;
+	struct pool *p;
+	struct sigaction sa;
+	pthread_attr_t attr;
+	size_t i, len = 1;
+	int err;
+	for (; len < queue; len <<= 1);
+	p = calloc(1, sizeof(*p));
+	if (p == NULL) {
+		return NULL;
+	}
+	p->lcfg = lcfg;
+	p->rcfg = rcfg;
+	p->stats = (stats != NULL) ? stats : &nostats;
+	p->mask = len - 1;
+	p->cells = calloc(len, sizeof(*(p->cells)));
+	p->threads = calloc(nthreads, sizeof(*(p->threads)));
+	if (p->cells == NULL || p->threads == NULL) {
+		free(p->cells);
+		free(p->threads);
+		free(p);
+		return NULL;
+	}
+	for (i = 0; i < len; i += 1) {
+		p->cells[i].seq = i;
+	}
+	pthread_mutex_init(&(p->lock), NULL);
+	pthread_cond_init(&(p->cond), NULL);
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&(sa.sa_mask));
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, POOL_STACK);
+	/* the deques of threads that fail to start merely stay empty */
+	p->nthreads = nthreads;
+	for (i = 0; i < nthreads; i += 1) {
+		p->threads[i].pool = p;
+		p->threads[i].id = i;
+	}
+	for (i = 0; i < nthreads; i += 1) {
+		err = pthread_create(
+			&(p->threads[i].tid),
+			&attr,
+			pool_run,
+			&(p->threads[i])
+		);
+		if (err != 0) {
+			log_perror(lcfg, err, "pool: pthread_create");
+			break;
+		}
+	}
+	pthread_attr_destroy(&attr);
+	if (i < nthreads) {
+		log_wrn(
+			lcfg,
+			"pool: Started %lu threads out of %u",
+			(unsigned long) i,
+			nthreads
+		);
+	}
+	if (i == 0) {
+		/* the threads are the only thing that might use these */
+		free(p->cells);
+		free(p->threads);
+		free(p);
+		return NULL;
+	}
+	return p;
+}
+
+/* Waits for the threads to finish the connections queued or being
+ * served, which close keep-alive connections at the next response
+ * boundary or while idle. Whatever is left at the drain deadline goes
+ * down with the process.
+ */
+void pool_drain(
+	struct pool *p,
+	const char *worker_name,
+	long timeout
+) {
+	struct timespec tp_b, tp_n;
+	unsigned int start, left;
+	start = __atomic_load_n(&(p->pending), __ATOMIC_RELAXED);
+	clock_gettime(CLOCK_MONOTONIC, &tp_b);
+	for (;;) {
+		left = __atomic_load_n(&(p->pending), __ATOMIC_RELAXED);
+		if (left == 0) {
+			break;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &tp_n);
+		if (
+			(double) tp_n.tv_sec - (double) tp_b.tv_sec +
+			(
+				(double) tp_n.tv_nsec -
+				(double) tp_b.tv_nsec
+			) / (double) 1000000000.0 >= (double) timeout
+		) {
+			break;
+		}
+		poll(NULL, 0, 50);
+	}
+	log_reg(
+		p->lcfg,
+		"%s: Drained %u connections, abandoned %u at the %lds deadline",
+		worker_name,
+		(start > left) ? start - left : 0,
+		left,
+		timeout
+	);
+}
+
+/* vi: set sts=8 ts=8 sw=8 noexpandtab: */
@@ -0,0 +1,123 @@
+#ifndef __mekdotlu_pool_h
+#define __mekdotlu_pool_h
+
+#include "log.h"
+#include "request.h"
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+/* default connections waiting for a thread, rounded up to a power of
+ * two
+ */
+#define POOL_QUEUE 256
+/* stack of every thread, request_process needs but a few pages */
+#define POOL_STACK (256 * 1024)
+/* connections a thread takes off the shared queue at once, and room in
+ * its deque, a power of two no smaller than that
+ */
+#define POOL_GRAB 4
+#define POOL_DEQUE 8
+
+/* an accepted connection waiting for a thread */
+struct pool_conn {
+	int sock;
+	/* when it was accepted */
+	struct timespec accepted;
+	union {
+		struct sockaddr_in addr4;
+		struct sockaddr_in6 addr6;
+	} addr;
+};
+
+/* pool counters, in shared memory for the master to log */
+struct pool_stats {
+	/* connections handed to threads */
+	unsigned long handled;
+	/* times a thread went to sleep for want of connections */
+	unsigned long parks;
+	/* connections taken off the deque of another thread */
+	unsigned long steals;
+	/* connections turned away with the queue full */
+	unsigned long overflows;
+};
+
+/* a queue slot, its sequence number telling whose turn it is */
+struct pool_cell {
+	unsigned long seq;
+	struct pool_conn conn;
+};
+
+/* a Chase-Lev deque of connections a thread has taken on: the thread
+ * pushes and takes at the bottom, idle ones steal from the top
+ */
+struct pool_deque {
+	long top;
+	long bottom;
+	struct pool_conn conns[POOL_DEQUE];
+};
+
+struct pool;
+
+/* a thread of the pool */
+struct pool_thread {
+	struct pool *pool;
+	size_t id;
+	pthread_t tid;
+	struct pool_deque deque;
+};
+
+/* threads of a worker serving the connections it accepts, which it
+ * hands over through a bounded lock-free queue: producers and consumers
+ * claim slots by bumping head and tail, and each slot's sequence number
+ * tells whether it has been filled or emptied yet
+ *
+ * threads take a few connections off the queue at a time into deques
+ * of their own, so that ones stuck on a slow client leave the rest to
+ * be stolen by idle threads
+ */
+struct pool {
+	const struct log_cfg *lcfg;
+	const struct request_cfg *rcfg;
+	struct pool_stats *stats;
+	unsigned int nthreads;
+	struct pool_thread *threads;
+	size_t mask;
+	struct pool_cell *cells;
+	/* next slot to fill and to empty */
+	unsigned long head;
+	unsigned long tail;
+	/* connections queued or being served */
+	unsigned int pending;
+	/* for threads with nothing to do */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int parked;
+};
+
+struct pool *pool_create(
+	const struct log_cfg *lcfg,
+	const struct request_cfg *rcfg,
+	struct pool_stats *stats,
+	unsigned int nthreads,
+	unsigned int queue
+);
+int pool_parse(const char *str, unsigned int *threads, unsigned int *queue);
+
+int pool_push(struct pool *p, const struct pool_conn *c);
+int pool_pop(struct pool *p, struct pool_conn *c);
+void pool_wake(struct pool *p);
+
+int pool_deque_push(struct pool_deque *d, const struct pool_conn *c);
+int pool_deque_take(struct pool_deque *d, struct pool_conn *c);
+int pool_deque_steal(struct pool_deque *d, struct pool_conn *c);
+void pool_drain(
+	struct pool *p,
+	const char *worker_name,
+	long timeout
+);
+
+#endif /* __mekdotlu_pool_h */
+
+/* vi: set sts=8 ts=8 sw=8 noexpandtab: */
@@ -1,6 +1,10 @@
 #include "log.h"
 #include "request.h"
 #include "clock.h"
+#include "store.h"
+#include "journal.h"
+#include "codegen.h"
+#include "coro.h"
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -9,10 +13,353 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <netinet/in.h>
 #include <arpa/inet.h>
 
+#if defined(__linux)
+#	include <sys/syscall.h>
+#	if defined(SYS_openat2)
+#		include <linux/openat2.h>
+#	endif
+#endif
+
+/* O_PATH is Linux-specific */
+#ifndef O_PATH
+#	define O_PATH 0
+#endif
+
+/* workers send refusals themselves, and must not die of
+ * a SIGPIPE doing it; elsewhere they will have to live with the signal
+ */
+#ifndef MSG_NOSIGNAL
+#	define MSG_NOSIGNAL 0
+#endif
+
+/* number of shard directory descriptors cached per process */
+#define REQUEST_SHARD_CACHE 16
+/* deepest shard scheme allowed */
+#define REQUEST_SHARD_MAX_LEVELS 4
+/* longest shard directory name that gets cached */
+#define REQUEST_SHARD_NAMELEN 32
+
+struct request_shard {
+	/* the tree descriptor the shard was opened from */
+	int tree;
+	int fd;
+	/* clock bit for eviction */
+	char used;
+	/* empty when the slot is free */
+	char name[REQUEST_SHARD_NAMELEN];
+};
+
+/* every pool thread keeps a cache of its own */
+static __thread struct request_shard request_shards[REQUEST_SHARD_CACHE];
+static __thread int request_shard_hand = 0;
+
+/* how often the header deadline is checked, in microseconds */
+#define REQUEST_DEADLINE_TICK 250000
+/* seconds a client may take before its header rate is held against it */
+#define REQUEST_RATE_GRACE 2.0
+
+/* why a client ran out of time sending its headers */
+#define REQUEST_EXPIRED_DEADLINE 1
+#define REQUEST_EXPIRED_RATE 2
+
+/* the header deadline of the request being read by this thread */
+struct request_deadline {
+	/* whether the ticks are running */
+	int armed;
+	/* whether to check the deadline before every read instead, on a
+	 * socket with a receive timeout of a tick, as pool threads can't
+	 * have timers of their own
+	 */
+	int poll;
+	int sock;
+	long timeout;
+	long rate;
+	/* when reading the headers started, in seconds */
+	double start;
+	/* header bytes read so far */
+	unsigned long bytes;
+	/* one of REQUEST_EXPIRED_*, or 0 */
+	int expired;
+};
+
+static __thread struct request_deadline request_deadline;
+/* set by SIGALRM, which also interrupts the blocking read in progress */
+static __thread volatile sig_atomic_t request_tick = 0;
+
+/* the header deadline of this coroutine, or else this thread */
+struct request_deadline *request_dl(void) {
+	void **local = coro_local();
+	if (local != NULL && *local != NULL) {
+		return *local;
+	}
+	return &request_deadline;
+}
+
+double request_deadline_now(void) {
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (double) tp.tv_sec + (double) tp.tv_nsec / 1000000000.0;
+}
+
+/* Checks the header deadline on a tick. Returns 1 if the client has run
+ * out of time, 0 otherwise.
+ */
+int request_deadline_check(void) {
+	struct request_deadline *d = request_dl();
+	double elapsed;
+	if (!d->armed) {
+		return 0;
+	}
+	elapsed = request_deadline_now() - d->start;
+	if (d->timeout > 0 && elapsed >= (double) d->timeout) {
+		d->expired = REQUEST_EXPIRED_DEADLINE;
+	} else if (
+		d->rate > 0 &&
+		elapsed >= REQUEST_RATE_GRACE &&
+		(double) d->bytes < (double) d->rate * elapsed
+	) {
+		d->expired = REQUEST_EXPIRED_RATE;
+	}
+	return d->expired != 0;
+}
+
+void request_deadline_alarm(int sig) {
+	(void) sig;
+	request_tick = 1;
+}
+
+/* Starts the header deadline of a request on sock, ticking every
+ * REQUEST_DEADLINE_TICK. The ticks interrupt blocking reads, so that
+ * request_getline gets to check the deadline without any syscalls of
+ * its own. Returns 1 on success, 0 otherwise.
+ */
+int request_deadline_arm(
+	const struct log_cfg *lcfg,
+	const struct request_cfg *rcfg,
+	int sock
+) {
+	struct request_deadline *d = request_dl();
+	struct sigaction sa;
+	struct itimerval it;
+	memset(d, 0, sizeof(*d));
+	request_tick = 0;
+	if (
+		rcfg == NULL ||
+		(rcfg->header_timeout <= 0 && rcfg->header_rate <= 0)
+	) {
+		return 1;
+	}
+	if (coro_active()) {
+		/* request_read waits a tick at a time */
+		d->timeout = rcfg->header_timeout;
+		d->rate = rcfg->header_rate;
+		d->start = request_deadline_now();
+		d->poll = 1;
+		d->armed = 1;
+		return 1;
+	}
+	if (rcfg->threads > 0) {
+		struct timeval tv;
+		tv.tv_sec = 0;
+		tv.tv_usec = REQUEST_DEADLINE_TICK;
+		errno = 0;
+		if (
+			setsockopt(
+				sock,
+				SOL_SOCKET,
+				SO_RCVTIMEO,
+				&tv,
+				sizeof(tv)
+			) == -1
+		) {
+			log_perror(lcfg, errno, "request: setsockopt");
+			return 0;
+		}
+		d->timeout = rcfg->header_timeout;
+		d->rate = rcfg->header_rate;
+		d->start = request_deadline_now();
+		d->sock = sock;
+		d->poll = 1;
+		d->armed = 1;
+		return 1;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	/* no SA_RESTART, the reads have to be interrupted */
+	sa.sa_flags = 0;
+	sa.sa_handler = request_deadline_alarm;
+	errno = 0;
+	if (sigaction(SIGALRM, &sa, NULL) == -1) {
+		log_perror(lcfg, errno, "request: sigaction");
+		return 0;
+	}
+	memset(&it, 0, sizeof(it));
+	it.it_value.tv_usec = REQUEST_DEADLINE_TICK;
+	it.it_interval.tv_usec = REQUEST_DEADLINE_TICK;
+	d->timeout = rcfg->header_timeout;
+	d->rate = rcfg->header_rate;
+	d->start = request_deadline_now();
+	errno = 0;
+	if (setitimer(ITIMER_REAL, &it, NULL) == -1) {
+		log_perror(lcfg, errno, "request: setitimer");
+		return 0;
+	}
+	d->armed = 1;
+	return 1;
+}
+
+/* stops the ticks once the headers are in */
+void request_deadline_disarm(const struct log_cfg *lcfg) {
+	struct request_deadline *d = request_dl();
+	struct itimerval it;
+	if (!d->armed) {
+		return;
+	}
+	d->armed = 0;
+	if (coro_active()) {
+		return;
+	}
+	if (d->poll) {
+		struct timeval tv;
+		memset(&tv, 0, sizeof(tv));
+		errno = 0;
+		if (
+			setsockopt(
+				d->sock,
+				SOL_SOCKET,
+				SO_RCVTIMEO,
+				&tv,
+				sizeof(tv)
+			) == -1
+		) {
+			log_perror(lcfg, errno, "request: setsockopt");
+		}
+		return;
+	}
+	memset(&it, 0, sizeof(it));
+	errno = 0;
+	if (setitimer(ITIMER_REAL, &it, NULL) == -1) {
+		log_perror(lcfg, errno, "request: setitimer");
+	}
+	request_tick = 0;
+}
+
+/* Socket IO of request_process: the plain syscalls, unless running in
+ * a coroutine, which yields instead of blocking whenever the
+ * connection isn't ready.
+ */
+
+/* Reads like read(2). In a coroutine, a header deadline being armed
+ * makes it give up after a tick with EAGAIN, for it to be checked.
+ */
+ssize_t request_read(int fd, void *buf, size_t len) {
+	int w;
+	if (!coro_active()) {
+		return read(fd, buf, len);
+	}
+	for (;;) {
+		ssize_t r = recv(fd, buf, len, MSG_DONTWAIT);
+		if (r != -1 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+			return r;
+		}
+		w = coro_wait(
+			fd,
+			POLLIN,
+			request_dl()->armed ? REQUEST_DEADLINE_TICK / 1000 : -1
+		);
+		if (w == -1) {
+			return -1;
+		} else if (w == 0) {
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+}
+
+/* Writes all of buf, returning len, or -1 on error. */
+ssize_t request_write(int fd, const void *buf, size_t len) {
+	size_t off = 0;
+	if (!coro_active()) {
+		return write(fd, buf, len);
+	}
+	while (off < len) {
+		ssize_t r = send(
+			fd,
+			(const char *) buf + off,
+			len - off,
+			MSG_DONTWAIT | MSG_NOSIGNAL
+		);
+		if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (coro_wait(fd, POLLOUT, -1) == -1) {
+				return -1;
+			}
+			continue;
+		} else if (r == -1) {
+			return -1;
+		}
+		off += r;
+	}
+	return off;
+}
+
+/* Prints like dprintf(3), formatting the whole thing first in a
+ * coroutine so that it can't be cut short by a full socket buffer.
+ */
+int request_dprintf(int fd, const char *format, ...) {
+	char buf[1024], *p = buf;
+	va_list vl;
+	int len;
+	va_start(vl, format);
+	if (!coro_active()) {
+		len = vdprintf(fd, format, vl);
+		va_end(vl);
+		return len;
+	}
+	len = vsnprintf(buf, sizeof(buf), format, vl);
+	va_end(vl);
+	if (len < 0) {
+		return -1;
+	}
+	if ((size_t) len >= sizeof(buf)) {
+		p = malloc(len + 1);
+		if (p == NULL) {
+			return -1;
+		}
+		va_start(vl, format);
+		vsnprintf(p, len + 1, format, vl);
+		va_end(vl);
+	}
+	if (request_write(fd, p, len) == -1) {
+		len = -1;
+	}
+	if (p != buf) {
+		free(p);
+	}
+	return len;
+}
+
+/* polls a single descriptor like poll(2) */
+int request_poll(struct pollfd *pfd, int timeout) {
+	int r;
+	if (!coro_active()) {
+		return poll(pfd, 1, timeout);
+	}
+	r = coro_wait(pfd->fd, pfd->events, timeout);
+	if (r > 0) {
+		pfd->revents = r;
+		return 1;
+	}
+	pfd->revents = 0;
+	return r;
+}
+
 /* Reads a line from descriptor f, and stores it in buf.
  * In case it is longer than len, it is truncated to
  * len - 1 bytes, and the number of bytes (excluding
@@ -20,6 +367,8 @@
  * an error, if any bytes were read, the number of bytes
  * read will be returned, and errno will stay the same.
  * If no bytes were read, errno is set accordingly.
+ * Running out of time for the headers is an error
+ * regardless, with errno set to ETIMEDOUT.
  *
  * The buffer is guaranteed to be NULL-terminated but
  * may contain embedded NULL bytes.
@@ -29,6 +378,7 @@
 int request_getline(char *buf, int len, int fd) {
 	int ret = 0, storerr = errno, r = -1;
 	char b = 0;
+	struct request_deadline *d = request_dl();
 
 	if (buf == NULL || len <= 0 || fd < 0) {
 		errno = EINVAL;
@@ -36,15 +386,41 @@ int request_getline(char *buf, int len, int fd) {
 	}
 
 	errno = 0;
-	while (ret < len - 1 && (r = read(fd, &b, 1)) > 0) {
+	while (ret < len - 1) {
+		/* the header deadline is only looked at when it ticks */
+		if (request_tick || d->poll) {
+			request_tick = 0;
+			if (request_deadline_check()) {
+				errno = ETIMEDOUT;
+				r = -1;
+				break;
+			}
+		}
+		r = request_read(fd, &b, 1);
+		if (
+			r == -1 &&
+			d->armed &&
+			(
+				errno == EINTR ||
+				errno == EAGAIN ||
+				errno == EWOULDBLOCK
+			)
+		) {
+			errno = 0;
+			continue;
+		}
+		if (r <= 0) {
+			break;
+		}
 		buf[ret] = b;
 		ret += 1;
+		d->bytes += 1;
 		if (b == '\n') {
 			break;
 		}
 		errno = 0;
 	}
-	if (r == -1 && ret == 0) {
+	if (r == -1 && (ret == 0 || d->expired)) {
 		storerr = errno;
 		ret = -1;
 	} else {
@@ -275,18 +651,67 @@ size_t request_utf8cplen(const char *buf, size_t len) {
 	return i;
 }
 
+/* Parses a shard scheme into rcfg: `<len>[x<levels>]' takes levels
+ * directories of len code points each from the start of the code,
+ * `h<fanout>[x<levels>]' takes levels directories named after a hash
+ * of the code, each with fanout entries, which must be a power of two.
+ * Zero levels make a flat tree. Returns 1 on success, 0 otherwise.
+ */
+int request_shard_parse(const char *str, struct request_cfg *rcfg) {
+	unsigned int num = 0, levels = 1;
+	int n = 0, hash = (str[0] == 'h');
+	if (sscanf(&(str[hash]), "%u%n", &num, &n) != 1) {
+		return 0;
+	}
+	n += hash;
+	if (str[n] == 'x') {
+		int m = 0;
+		if (sscanf(&(str[n + 1]), "%u%n", &levels, &m) != 1) {
+			return 0;
+		}
+		n += 1 + m;
+	}
+	if (
+		str[n] != '\0' ||
+		levels > REQUEST_SHARD_MAX_LEVELS ||
+		num == 0 ||
+		(hash && (
+			levels == 0 ||
+			num < 2 ||
+			num > 65536 ||
+			(num & (num - 1)) != 0
+		))
+	) {
+		return 0;
+	}
+	rcfg->shard_levels = levels;
+	rcfg->shard_len = hash ? 0 : num;
+	rcfg->shard_fanout = hash ? num : 0;
+	return 1;
+}
+
 /* Rewrites the requested path and sets the response code to 400
  * and returns -1 if the path looks dreadful. Returns 0 on redirect,
  * 1 on HTML, 2 on text.
+ *
+ * Redirects are rewritten to [ei]/<shard>/<code>, where the shard
+ * directories follow the scheme in the request config, and default
+ * to the first three code points of the code.
+ *
+ * Paths matching a prefix rule return 4 with the target URL in the
+ * location field instead, without touching the trees.
  */
 int request_rewrite(struct request_ent *rent) {
-	size_t readsize;
-	/* get the base directory (/[ei]/%s) byte length */
-	size_t u8prefix;
-	/* <path> + i/ + fff/ + '\0' - initial '/' */
-	size_t bufsize;
+	unsigned int len = 3, levels = 1, fanout = 0, level;
+	/* shard directory boundaries within the code */
+	size_t bounds[REQUEST_SHARD_MAX_LEVELS + 1];
+	size_t readsize, clen, bufsize, wi;
+	const char *code;
 	char *buf;
-	unsigned int ri, wi, di, fail = 0;
+	char ext;
+	/* hash-based shard directories use successive bits of it */
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	unsigned int bits = 0;
 	if (rent->path == NULL) {
 		return -1;
 	}
@@ -307,33 +732,94 @@ int request_rewrite(struct request_ent *rent) {
 		readsize < 2 ||
 		request_utf8validate(rent->path) == 0
 	) {
-		rent->code = 400;
-		rent->path[0] = '\0';
-		return -1;
+		goto bad;
 	}
-	/* get the base directory (/[ei]/%s) byte length */
-	u8prefix = request_utf8cplen(
-		&(rent->path[1 + ((
-			rent->path[1] == 'e' &&
-			rent->path[2] == '/'
-		) ? 2 : 0)]),
-		3
-	);
-	/* <path> + i/ + fff/ + '\0' - initial '/' */
-	bufsize = readsize + 2 + u8prefix + 1;
-	/* minimum tiny length is '/' + 3 bytes (base dir)
-	 * this is two characters longer with e/ urls
-	 */
+	if (rent->cfg != NULL && rent->cfg->_rules != NULL) {
+		const struct rules_rule *rule;
+		size_t plen = 0, i;
+		rule = rules_match(rent->cfg->_rules, rent->path, &plen);
+		if (rule != NULL) {
+			const char *rest = &(rent->path[plen]);
+			/* the rest ends up in a header */
+			for (i = 0; rest[i] != '\0'; i += 1) {
+				unsigned char c = rest[i];
+				if (c <= ' ' || c == 0x7F) {
+					goto bad;
+				}
+			}
+			free(rent->location);
+			rent->location = rules_expand(rule, rest);
+			if (rent->location == NULL) {
+				rent->code = 500;
+				rent->path[0] = '\0';
+				return -1;
+			}
+			rent->code = rule->code;
+			rent->maxage = rule->maxage;
+			return 4;
+		}
+	}
+	if (rent->cfg != NULL) {
+		len = rent->cfg->shard_len;
+		levels = rent->cfg->shard_levels;
+		fanout = rent->cfg->shard_fanout;
+	}
+	ext = (rent->path[1] == 'e' && rent->path[2] == '/');
+	code = &(rent->path[ext ? 3 : 1]);
+	clen = strlen(code);
+	/* harsh directory traversal mitigation */
 	if (
-		readsize < 1 + u8prefix ||
-		(
-			(rent->path[1] == 'e' && rent->path[2] == '/') &&
-			readsize < 1 + u8prefix + 2
-		)
+		clen == 0 ||
+		strchr(code, '/') != NULL ||
+		strchr(code, '\\') != NULL ||
+		strcmp(code, ".") == 0 ||
+		strcmp(code, "..") == 0 ||
+		/* flat trees hold the temporary files of writers too */
+		(levels == 0 && code[0] == '.')
 	) {
-		rent->code = 400;
-		rent->path[0] = '\0';
-		return -1;
+		goto bad;
+	}
+	/* the code must at least fill the prefix shard directories,
+	 * and no shard directory may be . or ..
+	 */
+	bounds[0] = 0;
+	for (level = 1; level <= levels; level += 1) {
+		if (fanout != 0) {
+			continue;
+		}
+		bounds[level] = request_utf8cplen(code, level * len);
+		if (bounds[level] > clen) {
+			goto bad;
+		}
+		if (
+			code[bounds[level - 1]] == '.' &&
+			(
+				bounds[level] - bounds[level - 1] == 1 ||
+				(
+					bounds[level] - bounds[level - 1] == 2 &&
+					code[bounds[level - 1] + 1] == '.'
+				)
+			)
+		) {
+			goto bad;
+		}
+	}
+	/* i/ + shard directories and slashes + code + '\0' */
+	bufsize = 2 + clen + 1;
+	if (fanout != 0) {
+		size_t i;
+		for (i = 0; i < clen; i += 1) {
+			hash ^= (unsigned char) code[i];
+			hash *= 0x100000001b3ULL;
+		}
+		while ((1U << bits) < fanout) {
+			bits += 1;
+		}
+		/* hexadecimal digits per directory */
+		len = (bits + 3) / 4;
+		bufsize += levels * (len + 1);
+	} else {
+		bufsize += bounds[levels] + levels;
 	}
 	buf = malloc(bufsize);
 	if (buf == NULL) {
@@ -341,50 +827,296 @@ int request_rewrite(struct request_ent *rent) {
 		rent->path[0] = '\0';
 		return -1;
 	}
-	wi = 0;
-	ri = 1;
-	/* handle all the allowed slashes */
-	if (rent->path[1] == 'e' && rent->path[2] == '/') {
-		buf[wi + 0] = rent->path[ri + 0];
-		buf[wi + 1] = rent->path[ri + 1];
-		wi += 2;
-		ri += 2;
-	} else {
-		buf[wi + 0] = 'i';
-		buf[wi + 1] = '/';
-		wi += 2;
-	}
-	/* do the rest of the rewrite */
-	di = 0;
-	while (ri < readsize) {
-		if (rent->path[ri] == '/' || rent->path[ri] == '\\') {
-			fail = 1;
-			break;
+	buf[0] = ext ? 'e' : 'i';
+	buf[1] = '/';
+	wi = 2;
+	for (level = 1; level <= levels; level += 1) {
+		if (fanout != 0) {
+			unsigned int v = (unsigned int) (
+				(hash >> ((level - 1) * bits)) & (fanout - 1)
+			);
+			wi += sprintf(&(buf[wi]), "%0*x/", (int) len, v);
+		} else {
+			size_t slen = bounds[level] - bounds[level - 1];
+			memcpy(&(buf[wi]), &(code[bounds[level - 1]]), slen);
+			wi += slen;
+			buf[wi] = '/';
+			wi += 1;
 		}
-		buf[wi] = rent->path[ri];
-		/* base directory, fff/ */
-		if (di < u8prefix + 1) {
-			di += 1;
-			if (di == u8prefix) {
-				wi += 1;
-				buf[wi] = '/';
-				ri -= di;
-			}
+	}
+	memcpy(&(buf[wi]), code, clen + 1);
+	free(rent->path);
+	rent->path = buf;
+	return 0;
+bad:
+	rent->code = 400;
+	rent->path[0] = '\0';
+	return -1;
+}
+
+/* Parses a header deadline of the form `<timeout>[:<rate>]', seconds
+ * and bytes per second, either of which may be 0 to leave it unbounded.
+ * The rate keeps its value if left out. Returns 1 on success, 0 if the
+ * string is malformed.
+ */
+int request_header_parse(const char *str, long *timeout, long *rate) {
+	long t = -1, r = *rate;
+	int n = 0, m = 0;
+	if (str == NULL || sscanf(str, "%ld%n", &t, &n) != 1 || t < 0) {
+		return 0;
+	}
+	if (str[n] == ':') {
+		if (
+			sscanf(&(str[n + 1]), "%ld%n", &r, &m) != 1 ||
+			r < 0
+		) {
+			return 0;
 		}
-		wi += 1;
-		ri += 1;
+		n += 1 + m;
 	}
-	/* terminate */
-	buf[wi] = '\0';
-	if (fail == 1) {
+	if (str[n] != '\0') {
+		return 0;
+	}
+	*timeout = t;
+	*rate = r;
+	return 1;
+}
+
+/* Parses a redirect policy of the form `<code>[:<max-age>]' into
+ * redir. Returns 1 on success, 0 if the string is malformed.
+ */
+int request_redir_parse(const char *str, struct request_redir *redir) {
+	int code = 0, n = 0;
+	long maxage = -1;
+	if (str == NULL || sscanf(str, "%d%n", &code, &n) != 1) {
+		return 0;
+	}
+	if (str[n] == ':') {
+		int m = 0;
+		if (
+			sscanf(&(str[n + 1]), "%ld%n", &maxage, &m) != 1 ||
+			maxage < 0
+		) {
+			return 0;
+		}
+		n += 1 + m;
+	}
+	if (str[n] != '\0') {
+		return 0;
+	}
+	switch (code) {
+	case 301:
+	case 302:
+	case 303:
+	case 307:
+	case 308:
+		break;
+	default:
+		return 0;
+	}
+	redir->code = code;
+	redir->maxage = maxage;
+	return 1;
+}
+
+/* Reads the redirect file f of fsize bytes. The first line is the
+ * target URL, which is stored in *loc and needs to be freed. An
+ * optional second line in the `<code>[:<max-age>]' format overrides
+ * the policy of the tree the file is in. Sets the response code and
+ * max-age of rent and returns the URL length, or -1 on error.
+ */
+int request_read_redirect(
+	struct request_ent *rent,
+	int f,
+	int fsize,
+	char **loc
+) {
+	struct request_redir redir;
+	char *buf, *nl;
+	int len = 0, r = 0;
+	/* tree policy */
+	redir.code = 302;
+	redir.maxage = -1;
+	if (rent->cfg != NULL) {
+		redir = (rent->path[0] == 'e') ?
+			rent->cfg->ext :
+			rent->cfg->in;
+	}
+	buf = malloc(fsize + 1);
+	if (buf == NULL) {
+		return -1;
+	}
+	while (
+		len < fsize &&
+		(r = read(f, &(buf[len]), fsize - len)) > 0
+	) {
+		len += r;
+	}
+	if (r == -1) {
 		free(buf);
-		rent->code = 400;
-		rent->path[0] = '\0';
 		return -1;
 	}
-	free(rent->path);
-	rent->path = buf;
-	return 0;
+	buf[len] = '\0';
+	nl = memchr(buf, '\n', len);
+	if (nl != NULL) {
+		/* per-file marker */
+		char *marker = &(nl[1]);
+		marker[strcspn(marker, "\r\n")] = '\0';
+		/* a malformed marker keeps the tree policy */
+		if (marker[0] != '\0') {
+			request_redir_parse(marker, &redir);
+		}
+		/* cut the URL at the line terminator */
+		len = nl - buf;
+		if (len > 0 && buf[len - 1] == '\r') {
+			len -= 1;
+		}
+		buf[len] = '\0';
+	}
+	rent->code = redir.code;
+	rent->maxage = redir.maxage;
+	*loc = buf;
+	return len;
+}
+
+/* An openat() that refuses to resolve paths outside of dirfd, where
+ * the kernel supports it. The rewrite already rejects any slashes, so
+ * this merely makes the traversal protection structural.
+ */
+int request_openat(int dirfd, const char *path, int flags) {
+#if defined(__linux) && defined(SYS_openat2)
+	static char noopenat2 = 0;
+	if (noopenat2 == 0) {
+		struct open_how how;
+		int fd;
+		memset(&how, 0, sizeof(how));
+		how.flags = flags;
+		how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+		fd = syscall(SYS_openat2, dirfd, path, &how, sizeof(how));
+		/* seccomp filters tend to answer with EPERM */
+		if (fd != -1 || (errno != ENOSYS && errno != EPERM)) {
+			return fd;
+		}
+		noopenat2 = 1;
+	}
+#endif
+	return openat(dirfd, path, flags);
+}
+
+/* Opens the /e/ and /i/ tree directories relative to the working
+ * directory, i.e. after the server has been constrained to the
+ * document root. Returns 1 if both trees were opened, 0 otherwise.
+ */
+int request_init(const struct log_cfg *lcfg, struct request_cfg *rcfg) {
+	const int flags = O_RDONLY | O_DIRECTORY | O_PATH | O_CLOEXEC;
+	errno = 0;
+	rcfg->_efd = open("e", flags);
+	log_perror(lcfg, errno, "request: open: e");
+	errno = 0;
+	rcfg->_ifd = open("i", flags);
+	log_perror(lcfg, errno, "request: open: i");
+	return rcfg->_efd != -1 && rcfg->_ifd != -1;
+}
+
+int request_kill(struct request_cfg *rcfg) {
+	if (rcfg->_efd != -1) {
+		close(rcfg->_efd);
+		rcfg->_efd = -1;
+	}
+	if (rcfg->_ifd != -1) {
+		close(rcfg->_ifd);
+		rcfg->_ifd = -1;
+	}
+	return 1;
+}
+
+/* Caches the shard directory descriptor fd, evicting the first
+ * entry the clock hand finds unused since its last pass.
+ */
+void request_shard_put(int tree, const char *shard, int fd) {
+	struct request_shard *s;
+	for (;;) {
+		s = &(request_shards[request_shard_hand]);
+		request_shard_hand = (request_shard_hand + 1) %
+			REQUEST_SHARD_CACHE;
+		if (s->name[0] == '\0' || s->used == 0) {
+			break;
+		}
+		s->used = 0;
+	}
+	if (s->name[0] != '\0') {
+		close(s->fd);
+	}
+	s->tree = tree;
+	s->fd = fd;
+	s->used = 1;
+	strcpy(s->name, shard);
+}
+
+/* Opens a rewritten [ei]/<shard>/<name> path with openat() relative
+ * to the tree and cached shard directory descriptors, skipping the
+ * path walk from the root. Other paths, e.g. index.html, are opened
+ * relative to the working directory.
+ */
+int request_open(const struct request_ent *rent, int flags) {
+	const char *path = rent->path, *name = NULL;
+	char shard[REQUEST_SHARD_NAMELEN];
+	int i, tree = -1, fd, sfd, storerr;
+	size_t slen;
+	if (rent->cfg != NULL && path[0] != '\0' && path[1] == '/') {
+		if (path[0] == 'e') {
+			tree = rent->cfg->_efd;
+		} else if (path[0] == 'i') {
+			tree = rent->cfg->_ifd;
+		}
+	}
+	if (tree != -1) {
+		name = strchr(&(path[2]), '/');
+	}
+	if (name == NULL) {
+		return open(path, flags);
+	}
+	slen = name - &(path[2]);
+	name = &(name[1]);
+	if (slen == 0 || slen >= sizeof(shard)) {
+		return request_openat(tree, &(path[2]), flags);
+	}
+	memcpy(shard, &(path[2]), slen);
+	shard[slen] = '\0';
+	for (i = 0; i < REQUEST_SHARD_CACHE; i += 1) {
+		struct request_shard *s = &(request_shards[i]);
+		struct stat st;
+		if (s->tree != tree || strcmp(s->name, shard) != 0) {
+			continue;
+		}
+		s->used = 1;
+		fd = request_openat(s->fd, name, flags);
+		if (fd != -1 || errno != ENOENT) {
+			return fd;
+		}
+		/* a miss, unless the shard itself was removed */
+		storerr = errno;
+		if (fstat(s->fd, &st) == 0 && st.st_nlink > 0) {
+			errno = storerr;
+			return -1;
+		}
+		close(s->fd);
+		s->name[0] = '\0';
+		break;
+	}
+	sfd = request_openat(
+		tree,
+		shard,
+		O_RDONLY | O_DIRECTORY | O_PATH | O_CLOEXEC
+	);
+	if (sfd == -1) {
+		return -1;
+	}
+	fd = request_openat(sfd, name, flags);
+	storerr = errno;
+	request_shard_put(tree, shard, sfd);
+	errno = storerr;
+	return fd;
 }
 
 #define RESPCASE(x, s) \
@@ -395,17 +1127,27 @@ const char *request_get_respstr(
 ) {
 	switch (code) {
 	RESPCASE(200, "OK");
+	RESPCASE(201, "Created");
+	RESPCASE(301, "Moved Permanently");
 	RESPCASE(302, "Found");
+	RESPCASE(303, "See Other");
+	RESPCASE(307, "Temporary Redirect");
+	RESPCASE(308, "Permanent Redirect");
 	RESPCASE(400, "Bad Request");
+	RESPCASE(401, "Unauthorized");
 	RESPCASE(403, "Forbidden");
 	RESPCASE(404, "Not Found");
 	RESPCASE(405, "Method Not Allowed");
 	RESPCASE(408, "Request Timeout");
+	RESPCASE(409, "Conflict");
+	RESPCASE(411, "Length Required");
 	RESPCASE(413, "Request Entity Too Large");
 	RESPCASE(418, "I'm a teapot");
+	RESPCASE(429, "Too Many Requests");
 	RESPCASE(431, "Request Header Fields Too Large");
 	RESPCASE(500, "Internal Server Error");
 	RESPCASE(501, "Not Implemented");
+	RESPCASE(503, "Service Unavailable");
 	RESPCASE(505, "HTTP Version Not Supported");
 	default:
 		return "Unknown Response Code";
@@ -466,6 +1208,30 @@ int request_log(
 			port = htons(
 				((const struct sockaddr_in*) rent->ip)->sin_port
 			);
+		} else if (
+			rent->ip->sa_family == AF_INET6 &&
+			IN6_IS_ADDR_V4MAPPED(
+				&(((const struct sockaddr_in6*) rent->ip)
+				->sin6_addr)
+			)
+		) {
+			/* IPv4 clients of a dual-stack socket, logged as
+			 * they would be otherwise
+			 */
+			ipret = inet_ntop(
+				AF_INET,
+				(void *) &(
+					((const struct sockaddr_in6*) rent->ip)
+					->sin6_addr.s6_addr[12]
+				),
+				ipbuf,
+				INET_ADDRSTRLEN
+			);
+			storerr = errno;
+			port = htons(
+				((const struct sockaddr_in6*) rent->ip)
+				->sin6_port
+			);
 		} else if (rent->ip->sa_family == AF_INET6) {
 			/* starting bracket */
 			ipbuf[0] = '[';
@@ -512,50 +1278,205 @@ int request_log(
 	);
 }
 
-/* shove common headers, parsed from rent */
-void request_put_common(
+/* shove common headers, parsed from rent */
+void request_put_common(
+	const struct log_cfg *lcfg,
+	const struct request_ent *rent
+) {
+	int ret;
+	/* HTTP protocol line */
+	errno = 0;
+	ret = request_dprintf(
+		rent->sock,
+		"HTTP/%d.%d %d %s\r\n",
+		rent->v_major,
+		rent->v_minor,
+		rent->code,
+		request_get_respstr(rent->code)
+	);
+	if (ret == -1) {
+		log_perror(
+			lcfg,
+			errno,
+			"request: dprintf"
+		);
+		return;
+	}
+	/* Server header */
+	request_dprintf(rent->sock, "Server: mek.lu\r\n");
+	/* Date header */
+	{
+		const char *dformat = "%a, %d %b %Y %H:%M:%S GMT";
+		char datebuf[64];
+		struct timespec tp;
+		struct tm t;
+		datebuf[0] = '\0';
+		clock_gettime(CLOCK_REALTIME, &tp);
+		gmtime_r(&(tp.tv_sec), &t);
+		strftime(datebuf, sizeof(datebuf), dformat, &t);
+		if (datebuf[0] != '\0') {
+			request_dprintf(
+				rent->sock,
+				"%s: %s\r\n",
+				"Date",
+				datebuf
+			);
+		}
+	}
+}
+
+/* Renders the redirect response for rent to loc into resp, leaving the
+ * Date blank. Returns 1 on success, 0 if it does not fit.
+ */
+int request_render_redirect(
+	const struct request_ent *rent,
+	const char *loc,
+	int loclen,
+	time_t fmodified,
+	struct cache_resp *resp
+) {
+	const char *dformat = "%a, %d %b %Y %H:%M:%S GMT";
+	char datebuf[64], maxage[64];
+	struct tm t;
+	int len;
+	gmtime_r(&(fmodified), &t);
+	if (strftime(datebuf, sizeof(datebuf), dformat, &t) == 0) {
+		return 0;
+	}
+	maxage[0] = '\0';
+	if (rent->maxage >= 0) {
+		snprintf(
+			maxage,
+			sizeof(maxage),
+			"Cache-Control: max-age=%ld\r\n",
+			rent->maxage
+		);
+	}
+	/* the same headers request_process puts, in the same order */
+	len = snprintf(
+		resp->image,
+		sizeof(resp->image),
+		"HTTP/1.1 %d %s\r\n"
+		"Server: mek.lu\r\n"
+		"Date: %*s\r\n"
+		"Location: %.*s\r\n"
+		"%s"
+		"Last-Modified: %s\r\n"
+		"Content-Type: text/plain; charset=utf-8\r\n"
+		"Content-Length: 0\r\n",
+		rent->code,
+		request_get_respstr(rent->code),
+		CACHE_DATE_LEN, "",
+		loclen, loc,
+		maxage,
+		datebuf
+	);
+	if (len < 0 || (size_t) len >= sizeof(resp->image)) {
+		return 0;
+	}
+	resp->code = rent->code;
+	resp->len = len;
+	resp->date_off = strstr(resp->image, "\r\nDate: ") + 8 - resp->image;
+	return 1;
+}
+
+/* Renders a response workers send to connections they turn away, e.g.
+ * when shedding load. Returns 1 on success, 0 otherwise.
+ */
+int request_render_refusal(struct request_refusal *r, int code) {
+	int len = snprintf(
+		r->image,
+		sizeof(r->image),
+		"HTTP/1.1 %d %s\r\n"
+		"Server: mek.lu\r\n"
+		"Retry-After: %d\r\n"
+		"Content-Type: text/plain; charset=utf-8\r\n"
+		"Content-Length: 0\r\n"
+		"Connection: close\r\n"
+		"\r\n",
+		code,
+		request_get_respstr(code),
+		REQUEST_RETRY_AFTER
+	);
+	if (len < 0 || (size_t) len >= sizeof(r->image)) {
+		r->len = 0;
+		return 0;
+	}
+	r->code = code;
+	r->len = len;
+	return 1;
+}
+
+/* Turns a freshly accepted connection away with a refusal, without
+ * waiting for the request. Whatever the client has sent is read first,
+ * so that closing the socket doesn't reset the connection before the
+ * response gets there.
+ */
+void request_put_refusal(
+	const struct log_cfg *lcfg,
+	const struct request_refusal *r,
+	int sock
+) {
+	char buf[4096];
+	for (;;) {
+		ssize_t ret = recv(sock, buf, sizeof(buf), MSG_DONTWAIT);
+		if (ret <= 0 || (size_t) ret < sizeof(buf)) {
+			break;
+		}
+	}
+	errno = 0;
+	if (
+		send(sock, r->image, r->len, MSG_NOSIGNAL) == -1 &&
+		errno != EPIPE &&
+		errno != ECONNRESET
+	) {
+		log_perror(lcfg, errno, "request: refusal: write");
+	}
+	shutdown(sock, SHUT_WR);
+}
+
+/* Sends a pre-rendered response with the HTTP version, Date and
+ * Connection header of rent filled in, in a single write.
+ */
+void request_put_cached(
 	const struct log_cfg *lcfg,
-	const struct request_ent *rent
+	const struct request_ent *rent,
+	const struct cache_resp *resp
 ) {
-	int ret;
-	/* HTTP protocol line */
+	const char *dformat = "%a, %d %b %Y %H:%M:%S GMT";
+	const char *conn = "";
+	char buf[CACHE_IMAGE_MAX + 64];
+	char datebuf[64];
+	struct timespec tp;
+	struct tm t;
+	size_t len = resp->len, clen;
+	memcpy(buf, resp->image, len);
+	buf[7] = '0' + rent->v_minor;
+	clock_gettime(CLOCK_REALTIME, &tp);
+	gmtime_r(&(tp.tv_sec), &t);
+	if (
+		strftime(datebuf, sizeof(datebuf), dformat, &t) ==
+		CACHE_DATE_LEN
+	) {
+		memcpy(&(buf[resp->date_off]), datebuf, CACHE_DATE_LEN);
+	}
+	if (rent->kill) {
+		conn = "Connection: close\r\n";
+	} else if (rent->v_minor == 0) {
+		conn = "Connection: keep-alive\r\n";
+	}
+	clen = strlen(conn);
+	memcpy(&(buf[len]), conn, clen);
+	len += clen;
+	memcpy(&(buf[len]), "\r\n", 2);
+	len += 2;
 	errno = 0;
-	ret = dprintf(
-		rent->sock,
-		"HTTP/%d.%d %d %s\r\n",
-		rent->v_major,
-		rent->v_minor,
-		rent->code,
-		request_get_respstr(rent->code)
-	);
-	if (ret == -1) {
+	if (request_write(rent->sock, buf, len) == -1) {
 		log_perror(
 			lcfg,
 			errno,
-			"request: dprintf"
+			"request: write"
 		);
-		return;
-	}
-	/* Server header */
-	dprintf(rent->sock, "Server: mek.lu\r\n");
-	/* Date header */
-	{
-		const char *dformat = "%a, %d %b %Y %H:%M:%S GMT";
-		char datebuf[64];
-		struct timespec tp;
-		struct tm t;
-		datebuf[0] = '\0';
-		clock_gettime(CLOCK_REALTIME, &tp);
-		gmtime_r(&(tp.tv_sec), &t);
-		strftime(datebuf, sizeof(datebuf), dformat, &t);
-		if (datebuf[0] != '\0') {
-			dprintf(
-				rent->sock,
-				"%s: %s\r\n",
-				"Date",
-				datebuf
-			);
-		}
 	}
 }
 
@@ -604,7 +1525,7 @@ void request_put_error_body(
 	const char *respstr = request_get_respstr(rent->code);
 	int ret;
 	errno = 0;
-	ret = dprintf(
+	ret = request_dprintf(
 		rent->sock,
 		request_error_fmt,
 		rent->code, respstr,
@@ -640,6 +1561,11 @@ int request_populate(struct request_ent *rent) {
 				break;
 			}
 		}
+		/* too slow */
+		if (request_dl()->expired) {
+			rent->code = 408;
+			return 0;
+		}
 		/* nothing to see here */
 		if (line == 0 && lineret <= 0) {
 			rent->code = 0;
@@ -688,9 +1614,18 @@ int request_populate(struct request_ent *rent) {
 				if (spaces == 0) {
 					/* method */
 					char *m = strndup(lpl, lp - lpl);
+					/* PUT and POST only with the API */
+					char api = (
+						rent->cfg != NULL &&
+						rent->cfg->token[0] != '\0'
+					);
 					if (
 						strcmp(m, "GET") != 0 &&
-						strcmp(m, "HEAD") != 0
+						strcmp(m, "HEAD") != 0 &&
+						!(api && (
+							strcmp(m, "PUT") == 0 ||
+							strcmp(m, "POST") == 0
+						))
 					) {
 						rent->code = 400;
 						if (strcmp(m, "BREW") == 0) {
@@ -795,14 +1730,434 @@ int request_populate(struct request_ent *rent) {
 					cp = &(cp[1]);
 				} while (cp[0] == ' ' || cp[0] == '\t');
 				rent->ua = strdup(cp);
+			} else if (
+				strncasecmp(
+					"Authorization:",
+					buf,
+					sizeof("Authorization:") - 1
+				) == 0
+			) {
+				do {
+					cp = &(cp[1]);
+				} while (cp[0] == ' ' || cp[0] == '\t');
+				free(rent->auth);
+				rent->auth = strdup(cp);
+			} else if (
+				strncasecmp(
+					"Content-Length:",
+					buf,
+					sizeof("Content-Length:") - 1
+				) == 0
+			) {
+				char *ep = NULL;
+				errno = 0;
+				rent->clen = strtol(&(cp[1]), &ep, 10);
+				/* nothing but whitespace may follow */
+				while (
+					ep != NULL &&
+					*ep != '\0' &&
+					strchr(" \t\r\n", *ep) != NULL
+				) {
+					ep = &(ep[1]);
+				}
+				if (
+					errno != 0 ||
+					ep == &(cp[1]) ||
+					*ep != '\0' ||
+					rent->clen < 0
+				) {
+					rent->code = 400;
+					return 0;
+				}
 			}
 		}
 	}
 	return ret;
 }
 
+/* largest accepted insertion request body */
+#define REQUEST_MAX_BODY 8192
+/* generated codes to try before giving up on collisions */
+#define REQUEST_CODEGEN_TRIES 8
+
+/* Returns 1 if a rewritten path can be journaled as is, 0 if it holds
+ * spaces or control characters, which a decoded code may well do.
+ */
+int request_path_plain(const char *path) {
+	for (; *path != '\0'; path += 1) {
+		if ((unsigned char) *path <= ' ' || *path == 0x7F) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Returns 1 if no component of path is empty, . or .., as none is in
+ * a path request_rewrite() produced, 0 otherwise.
+ */
+int request_path_contained(const char *path) {
+	const char *c = path;
+	for (;;) {
+		size_t n = strcspn(c, "/");
+		if (
+			n == 0 ||
+			(n == 1 && c[0] == '.') ||
+			(n == 2 && c[0] == '.' && c[1] == '.')
+		) {
+			return 0;
+		}
+		if (c[n] == '\0') {
+			return 1;
+		}
+		c = &(c[n + 1]);
+	}
+}
+
+/* Publishes url as the redirect file at the rewritten path, and adds
+ * it to the lookup structures. With op 'C' an existing file is left
+ * alone and EEXIST is returned, with 'R' it is replaced unless it
+ * already holds url. Doubles as the journal replay callback, with the
+ * request config as arg. Returns 0 on success, -1 on error with errno
+ * set.
+ */
+int request_materialise(char op, const char *path, const char *url, void *arg) {
+	const struct request_cfg *rcfg = arg;
+	size_t len = strlen(url);
+	char *data;
+	int ret;
+	if (
+		(path[0] != 'e' && path[0] != 'i') ||
+		path[1] != '/' ||
+		request_path_contained(path) == 0 ||
+		request_path_plain(path) == 0
+	) {
+		errno = EINVAL;
+		return -1;
+	}
+	data = malloc(len + 2);
+	if (data == NULL) {
+		return -1;
+	}
+	memcpy(data, url, len);
+	data[len] = '\n';
+	data[len + 1] = '\0';
+	if (op == 'R') {
+		/* skip rewriting identical files, e.g. on replay */
+		char cur[REQUEST_MAX_BODY + 2];
+		int fd = open(path, O_RDONLY | O_CLOEXEC);
+		ssize_t r = -1;
+		if (fd != -1) {
+			r = read(fd, cur, sizeof(cur));
+			close(fd);
+		}
+		if (r == (ssize_t) (len + 1) && memcmp(cur, data, r) == 0) {
+			free(data);
+			return 0;
+		}
+	}
+	ret = store_mkdirs(AT_FDCWD, path);
+	if (ret == 0) {
+		ret = store_publish(
+			AT_FDCWD,
+			path,
+			data,
+			len + 1,
+			(op == 'R') ? STORE_REPLACE : 0
+		);
+	}
+	free(data);
+	if (ret == 0 && rcfg != NULL && rcfg->_bloom != NULL) {
+		char key[256];
+		if (bloom_key(key, sizeof(key), path) == 1) {
+			bloom_add(rcfg->_bloom, key);
+		}
+	}
+	return ret;
+}
+
+/* Returns 1 if the Authorization header carries the API token, 0
+ * otherwise. The comparison takes the same time regardless of where
+ * the token differs.
+ */
+int request_authorized(const struct request_cfg *rcfg, const char *auth) {
+	const char *tok;
+	size_t i, tlen, alen;
+	unsigned char diff = 0;
+	if (
+		rcfg == NULL ||
+		rcfg->token[0] == '\0' ||
+		auth == NULL ||
+		strncasecmp(auth, "Bearer ", 7) != 0
+	) {
+		return 0;
+	}
+	tok = &(auth[7]);
+	tlen = strlen(rcfg->token);
+	alen = strlen(tok);
+	for (i = 0; i < tlen; i += 1) {
+		diff |= rcfg->token[i] ^ ((i < alen) ? tok[i] : 0);
+	}
+	return diff == 0 && alen == tlen;
+}
+
+/* Handles a PUT or POST to a short URL: the body is the target URL.
+ * POST creates the short URL, PUT creates or replaces it. A POST to /
+ * or /e/ creates a short URL with a generated code instead. The insert
+ * is written to the journal before it is published. The header
+ * deadline must still be armed, and is disarmed once the body is in.
+ * Sets the response code and returns 0 on success, -1 on error.
+ */
+int request_insert(
+	const struct log_cfg *lcfg,
+	const struct request_cfg *rcfg,
+	struct request_ent *rent
+) {
+	char op = (strcmp(rent->method, "PUT") == 0) ? 'R' : 'C';
+	char *body, *rec, *code;
+	/* POST to / or /e/ picks a code */
+	char ext = strcmp(rent->path, "/e/") == 0;
+	char gen = (
+		op == 'C' &&
+		rcfg->_codegen != NULL &&
+		(ext || strcmp(rent->path, "/") == 0)
+	);
+	long off = 0, len;
+	int rlen, tries;
+	/* end of the batch of counters the generated code came from */
+	uint64_t reserved = 0;
+	struct stat s;
+	struct request_deadline *d = request_dl();
+	if (rent->clen < 0) {
+		rent->code = 411;
+		rent->kill = 1;
+		return -1;
+	}
+	/* before waiting for a body that anyone could trickle in */
+	if (request_authorized(rcfg, rent->auth) == 0) {
+		rent->code = 401;
+		rent->kill = 1;
+		return -1;
+	}
+	if (rent->clen > REQUEST_MAX_BODY) {
+		rent->code = 413;
+		rent->kill = 1;
+		return -1;
+	}
+	/* always consume the body to keep the connection usable, against
+	 * the header deadline, which is only disarmed once it is in
+	 */
+	body = malloc(rent->clen + 1);
+	if (body == NULL) {
+		rent->code = 500;
+		return -1;
+	}
+	while (off < rent->clen) {
+		ssize_t r;
+		if (request_tick || d->poll) {
+			request_tick = 0;
+			if (request_deadline_check()) {
+				free(body);
+				rent->code = 408;
+				rent->kill = 1;
+				return -1;
+			}
+		}
+		r = request_read(rent->sock, &(body[off]), rent->clen - off);
+		if (
+			r == -1 &&
+			d->armed &&
+			(
+				errno == EINTR ||
+				errno == EAGAIN ||
+				errno == EWOULDBLOCK
+			)
+		) {
+			continue;
+		}
+		if (r <= 0) {
+			free(body);
+			rent->code = 400;
+			rent->kill = 1;
+			return -1;
+		}
+		off += r;
+		d->bytes += r;
+	}
+	body[off] = '\0';
+	request_deadline_disarm(lcfg);
+	/* the URL, sans trailing whitespace */
+	len = strlen(body);
+	while (
+		len > 0 &&
+		strchr(" \t\r\n", body[len - 1]) != NULL
+	) {
+		len -= 1;
+	}
+	body[len] = '\0';
+	for (off = 0; off < len; off += 1) {
+		unsigned char c = body[off];
+		if (c <= ' ' || c == 0x7F) {
+			break;
+		}
+	}
+	if (len == 0 || off != len) {
+		free(body);
+		rent->code = 400;
+		return -1;
+	}
+	for (tries = 0; ; tries += 1) {
+		int mr;
+		if (gen) {
+			/* /e/<code> or /<code> */
+			char c[64];
+			if (
+				codegen_next(
+					rcfg->_codegen,
+					c,
+					sizeof(c),
+					&reserved
+				) == -1
+			) {
+				log_perror(lcfg, errno, "request: codegen");
+				free(body);
+				rent->code = 500;
+				return -1;
+			}
+			free(rent->path);
+			rent->path = malloc(strlen(c) + 4);
+			if (rent->path == NULL) {
+				free(body);
+				rent->code = 500;
+				return -1;
+			}
+			sprintf(rent->path, "%s%s", ext ? "/e/" : "/", c);
+		}
+		mr = request_rewrite(rent);
+		if (mr != 0) {
+			free(body);
+			/* shadowed by a prefix rule */
+			rent->code = (mr == 4) ? 409 : 400;
+			return -1;
+		}
+		/* records are split on spaces */
+		if (request_path_plain(rent->path) == 0) {
+			free(body);
+			rent->code = 400;
+			return -1;
+		}
+		if (op == 'C' && stat(rent->path, &s) == 0) {
+			/* generated codes may collide with picked ones */
+			if (gen && tries < REQUEST_CODEGEN_TRIES) {
+				continue;
+			}
+			free(body);
+			rent->code = 409;
+			return -1;
+		}
+		/* [N <counter>\n]<op> <path> <url>\n, the former so that
+		 * the counter starts past this batch after a restart
+		 */
+		rlen = strlen(rent->path) + len + 5 + 24;
+		rec = malloc(rlen);
+		if (rec == NULL) {
+			free(body);
+			rent->code = 500;
+			return -1;
+		}
+		off = 0;
+		if (gen) {
+			off = snprintf(
+				rec,
+				rlen,
+				"N %llu\n",
+				(unsigned long long) reserved
+			);
+		}
+		rlen = off + snprintf(
+			&(rec[off]),
+			rlen - off,
+			"%c %s %s\n",
+			op,
+			rent->path,
+			body
+		);
+		if (journal_append(rcfg->_journal, rec, rlen) == -1) {
+			log_perror(lcfg, errno, "request: journal");
+			free(rec);
+			free(body);
+			rent->code = 500;
+			return -1;
+		}
+		free(rec);
+		mr = request_materialise(op, rent->path, body, (void *) rcfg);
+		if (mr == 0) {
+			break;
+		}
+		if (errno == EEXIST && gen && tries < REQUEST_CODEGEN_TRIES) {
+			continue;
+		}
+		rent->code = (errno == EEXIST) ? 409 : 500;
+		if (rent->code == 500) {
+			log_perror(lcfg, errno, "request: publish");
+		}
+		free(body);
+		return -1;
+	}
+	free(body);
+	/* /e/<code> or /<code> */
+	code = strrchr(rent->path, '/');
+	rent->location = malloc(strlen(code) + 3);
+	if (rent->location != NULL) {
+		sprintf(
+			rent->location,
+			"%s%s",
+			(rent->path[0] == 'e') ? "/e" : "",
+			code
+		);
+	}
+	rent->code = 201;
+	return 0;
+}
+
+/* returns 1 if the server is draining connections, 0 otherwise */
+int request_draining(const struct request_cfg *rcfg) {
+	return (
+		rcfg != NULL &&
+		rcfg->_drain != NULL &&
+		__atomic_load_n(&(rcfg->_drain->active), __ATOMIC_RELAXED)
+	);
+}
+
+/* Waits up to timeout milliseconds for the next request on an idle
+ * keep-alive connection, giving up early if draining starts. Returns
+ * what poll() would.
+ */
+int request_idle_wait(
+	const struct request_cfg *rcfg,
+	struct pollfd *pfd,
+	int timeout
+) {
+	int r = 0;
+	if (rcfg == NULL || rcfg->_drain == NULL) {
+		return request_poll(pfd, timeout);
+	}
+	for (; timeout > 0 && r == 0; timeout -= 250) {
+		if (request_draining(rcfg)) {
+			__atomic_fetch_add(
+				&(rcfg->_drain->closed),
+				1,
+				__ATOMIC_RELAXED
+			);
+			return 0;
+		}
+		r = request_poll(pfd, (timeout < 250) ? timeout : 250);
+	}
+	return r;
+}
+
 int request_process(
 	const struct log_cfg *lcfg,
+	const struct request_cfg *rcfg,
 	int sockfd,
 	double delay,
 	const struct sockaddr *addr
@@ -810,11 +2165,27 @@ int request_process(
 	int ret = EXIT_FAILURE;
 	struct request_ent rent;
 	struct pollfd pfd;
+	/* the limit of the worker that accepted us */
+	struct limit *lim = NULL;
+	struct request_deadline local, *deadline;
+	void **slot;
+	if (rcfg != NULL && rcfg->_limit != NULL) {
+		lim = &(rcfg->_limit[(addr->sa_family == AF_INET6) ? 1 : 0]);
+	}
+	memset(&rent, 0, sizeof(rent));
+	/* coroutines share their thread, so each gets a deadline of its
+	 * own
+	 */
+	memset(&local, 0, sizeof(local));
+	if ((slot = coro_local()) != NULL) {
+		*slot = &local;
+	}
+	deadline = request_dl();
 	pfd.fd = sockfd;
 	pfd.events = POLLIN | POLLHUP;
 	pfd.revents = 0;
 	/* initial one-second timeout */
-	if (poll(&pfd, 1, 1000) > 0) {
+	if (request_poll(&pfd, 1000) > 0) {
 		/* quit on hangup */
 		if ((pfd.revents & POLLHUP) == POLLHUP) {
 			goto quit;
@@ -826,8 +2197,16 @@ int request_process(
 	/* all is okay */
 	for (;;) {
 		struct timespec tp_b, tp_e;
-		int rr = -1, fsize = 0;
+		int rr = -1, fsize = 0, loclen = 0, insert;
 		time_t fmodified = 0;
+		/* the redirect file, and whether its response may be
+		 * served from or stored in the cache
+		 */
+		struct stat fst;
+		int cacheable = 0, cached = 0;
+		struct cache_resp resp;
+		/* redirect target */
+		char *loc = NULL;
 		/* a file to be read */
 		int f = -1;
 		/* a lock for the file */
@@ -835,7 +2214,10 @@ int request_process(
 		clock_gettime(CLOCK_MONOTONIC, &tp_b);
 		/* initialise the request */
 		memset(&rent, 0, sizeof(rent));
+		rent.cfg = rcfg;
 		rent.sock = sockfd;
+		rent.maxage = -1;
+		rent.clen = -1;
 		/* internal value to indicate not being set */
 		rent.code = -1;
 		rent.ip = addr;
@@ -843,9 +2225,39 @@ int request_process(
 		rent.v_major = 1;
 		rent.v_minor = 0;
 		errno = 0;
-		/* populate the request entity */
+		/* populate the request entity, against the header deadline */
+		if (!request_deadline_arm(lcfg, rcfg, sockfd)) {
+			goto quit;
+		}
 		rr = request_populate(&rent);
-		if (rr == -1) {
+		insert = (
+			rr > 0 &&
+			(
+				strcmp(rent.method, "PUT") == 0 ||
+				strcmp(rent.method, "POST") == 0
+			)
+		);
+		if (insert) {
+			/* 3 signifies a successful insert */
+			rr = (request_insert(lcfg, rcfg, &rent) == 0) ? 3 : -1;
+		}
+		request_deadline_disarm(lcfg);
+		if (
+			deadline->expired &&
+			rcfg != NULL &&
+			rcfg->_timeouts != NULL
+		) {
+			__atomic_fetch_add(
+				(deadline->expired == REQUEST_EXPIRED_RATE) ?
+					&(rcfg->_timeouts->rate) :
+					&(rcfg->_timeouts->deadline),
+				1,
+				__ATOMIC_RELAXED
+			);
+		}
+		if (insert) {
+			/* the insert set the response code */
+		} else if (rr == -1) {
 			/* quit on read error */
 			goto quit;
 		} else if (rr == 0 && rent.code == 0) {
@@ -861,24 +2273,84 @@ int request_process(
 			 */
 			rr = -1;
 		}
-		if (rr >= 0) {
+		if (lim != NULL) {
+			limit_begin(lim);
+		}
+		/* skip the filesystem for codes that surely don't exist */
+		if (rr == 0 && rcfg != NULL && rcfg->_bloom != NULL) {
+			char key[256];
+			if (
+				bloom_key(key, sizeof(key), rent.path) == 1 &&
+				bloom_check(rcfg->_bloom, key) == 0
+			) {
+				rent.code = 404;
+				rr = -1;
+			}
+		}
+		/* answer from the resident URL store if it has the code */
+		if (
+			rr == 0 &&
+			rcfg != NULL &&
+			rcfg->_urlstore != NULL &&
+			rent.v_major == 1 &&
+			rent.v_minor <= 1
+		) {
+			char key[256], url[URLSTORE_URL_MAX];
+			time_t mtime = 0;
+			int ulen = -1;
+			if (bloom_key(key, sizeof(key), rent.path) == 1) {
+				ulen = urlstore_get(
+					rcfg->_urlstore,
+					key,
+					url,
+					sizeof(url),
+					&mtime
+				);
+			}
+			if (ulen >= 0) {
+				/* stored files follow the tree policy */
+				const struct request_redir *redir =
+					(rent.path[0] == 'e') ?
+						&(rcfg->ext) :
+						&(rcfg->in);
+				rent.code = redir->code;
+				rent.maxage = redir->maxage;
+				cached = request_render_redirect(
+					&rent,
+					url,
+					ulen,
+					mtime,
+					&resp
+				);
+			}
+		}
+		if (rr >= 0 && rr <= 2 && !cached) {
 			errno = 0;
-			f = open(rent.path, O_RDONLY);
+			f = request_open(&rent, O_RDONLY);
 			if (f == -1) {
 				if (errno == EACCES) {
 					rent.code = 403;
 				} else {
 					rent.code = 404;
+					if (
+						rr == 0 &&
+						rcfg != NULL &&
+						rcfg->_bloom != NULL
+					) {
+						bloom_falsepos(rcfg->_bloom);
+					}
 				}
 				rr = -1;
 			} else {
-				struct stat s;
 				/* initialize the lock */
 				fl.l_type = F_RDLCK;
 				fl.l_whence = SEEK_END;
 				fl.l_start = 0;
 				fl.l_len = 0;
-				if (fcntl(f, F_SETLKW, &fl) == -1) {
+				if (
+					(rcfg == NULL || rcfg->nolock == 0) &&
+					fcntl(f, F_SETLKW, &fl) == -1
+				) {
 					log_perror(
 						lcfg,
 						errno,
@@ -886,14 +2358,57 @@ int request_process(
 					);
 				}
 				/* stat the file */
-				if (fstat(f, &s) == 0) {
-					fsize = s.st_size;
-					fmodified = s.st_mtime;
+				if (fstat(f, &fst) == 0) {
+					fsize = fst.st_size;
+					fmodified = fst.st_mtime;
+					cacheable = (
+						rcfg != NULL &&
+						rcfg->_cache != NULL &&
+						rent.v_major == 1 &&
+						rent.v_minor <= 1
+					);
 				}
 			}
 		}
+		if (
+			rr == 0 &&
+			cacheable &&
+			cache_get(rcfg->_cache, rent.path, &fst, &resp) == 1
+		) {
+			/* pre-rendered */
+			rent.code = resp.code;
+			cached = 1;
+		} else if (rr == 0 && !cached) {
+			loclen = request_read_redirect(&rent, f, fsize, &loc);
+			if (loclen == -1) {
+				log_perror(
+					lcfg,
+					errno,
+					"request: read"
+				);
+				rent.code = 500;
+				rr = -1;
+			} else if (
+				cacheable &&
+				request_render_redirect(
+					&rent,
+					loc,
+					loclen,
+					fmodified,
+					&resp
+				) == 1
+			) {
+				cache_put(rcfg->_cache, rent.path, &fst, &resp);
+				cached = 1;
+			}
+		}
 		if (rr == 0) {
-			rent.code = 302;
+			if (rcfg != NULL && rcfg->_hits != NULL) {
+				char key[256];
+				if (bloom_key(key, sizeof(key), rent.path) == 1) {
+					hits_add(rcfg->_hits, key);
+				}
+			}
 			fsize = 0;
 		} else if (rr == 1 || rr == 2) {
 			if (rent.code == -1) {
@@ -904,6 +2419,15 @@ int request_process(
 		if (rent.code == -1) {
 			rent.code = 500;
 		}
+		/* close keep-alive connections at the response boundary */
+		if (rent.kill == 0 && request_draining(rcfg)) {
+			rent.kill = 1;
+			__atomic_fetch_add(
+				&(rcfg->_drain->closed),
+				1,
+				__ATOMIC_RELAXED
+			);
+		}
 		/* determine whether or not we want to kill the connection */
 		if (
 			/* server error */
@@ -911,47 +2435,62 @@ int request_process(
 			/* malformed request, there may still be bytes on the
 			 * pipe, which we do not appreciate */
 			rent.code == 400 ||
+			/* too slow to bother with further */
+			rent.code == 408 ||
 			/* a teapot cannot make coffee, give up */
 			rent.code == 418
 		) {
 			rent.kill = 1;
 		}
+		if (cached) {
+			request_put_cached(lcfg, &rent, &resp);
+			goto sent;
+		}
 		/* put common headers */
 		request_put_common(lcfg, &rent);
 		/* put request-specific headers */
 		if (rr == 0) {
 			/* redirection */
-			char buf[64];
-			int ws = 0;
-			dprintf(sockfd, "Location: ");
-			while (
-				(ws = request_getline(
-					buf, sizeof(buf), f
-				)) > 0
+			request_dprintf(sockfd, "Location: ");
+			errno = 0;
+			if (
+				loclen > 0 &&
+				request_write(sockfd, loc, loclen) == -1
 			) {
-				char die = 0;
-				if (buf[ws - 1] == '\n') {
-					die = 1;
-					if (ws > 1 && buf[ws - 2] == '\r') {
-						ws -= 1;
-					}
-					ws -= 1;
-				}
-				if (ws > 0) {
-					errno = 0;
-					if (write(sockfd, buf, ws) == -1) {
-						log_perror(
-							lcfg,
-							errno,
-							"request: write"
-						);
-					}
-				}
-				if (die == 1) {
-					break;
-				}
+				log_perror(
+					lcfg,
+					errno,
+					"request: write"
+				);
+			}
+			request_dprintf(sockfd, "\r\n");
+			if (rent.maxage >= 0) {
+				request_dprintf(
+					sockfd,
+					"Cache-Control: max-age=%ld\r\n",
+					rent.maxage
+				);
 			}
-			dprintf(sockfd, "\r\n");
+		}
+		if (rr == 3 || rr == 4) {
+			/* insertion, or a prefix rule redirect */
+			if (rent.location != NULL) {
+				request_dprintf(
+					sockfd,
+					"Location: %s\r\n",
+					rent.location
+				);
+			}
+			if (rr == 4 && rent.maxage >= 0) {
+				request_dprintf(
+					sockfd,
+					"Cache-Control: max-age=%ld\r\n",
+					rent.maxage
+				);
+			}
+			request_dprintf(sockfd, "Content-Length: 0\r\n");
+		} else if (rent.code == 401) {
+			request_dprintf(sockfd, "WWW-Authenticate: Bearer\r\n");
 		}
 		if (rr >= 0 && rr <= 2) {
 			/* modification date */
@@ -962,7 +2501,7 @@ int request_process(
 			gmtime_r(&(fmodified), &t);
 			strftime(datebuf, sizeof(datebuf), dformat, &t);
 			if (datebuf[0] != '\0') {
-				dprintf(
+				request_dprintf(
 					rent.sock,
 					"%s: %s\r\n",
 					"Last-Modified",
@@ -970,7 +2509,7 @@ int request_process(
 				);
 			}
 			/* content type and length */
-			dprintf(
+			request_dprintf(
 				sockfd,
 				"Content-Type: %s; charset=utf-8\r\n"
 				"Content-Length: %d\r\n",
@@ -982,15 +2521,15 @@ int request_process(
 		}
 		/* error :( */
 		if (rent.kill) {
-			dprintf(sockfd, "Connection: close\r\n");
+			request_dprintf(sockfd, "Connection: close\r\n");
 		} else if (rent.v_major == 1 && rent.v_minor == 0) {
 			/* do explicit keepalives for HTTP/1.0 when no
 			 * error has been encountered; implicit with HTTP/1.1
 			 */
-			dprintf(sockfd, "Connection: keep-alive\r\n");
+			request_dprintf(sockfd, "Connection: keep-alive\r\n");
 		}
 		if (rent.code >= 400) {
-			dprintf(
+			request_dprintf(
 				sockfd,
 				"Content-Type: %s\r\n"
 				"Content-Length: %d\r\n",
@@ -999,7 +2538,7 @@ int request_process(
 			);
 		}
 		/* close headers */
-		dprintf(rent.sock, "\r\n");
+		request_dprintf(rent.sock, "\r\n");
 		/* put body, if any
 		 * e.g. /robots.txt, /, error pages
 		 */
@@ -1015,7 +2554,13 @@ int request_process(
 					)) > 0
 				) {
 					errno = 0;
-					if (write(sockfd, fbuf, fret) == -1) {
+					if (
+						request_write(
+							sockfd,
+							fbuf,
+							fret
+						) == -1
+					) {
 						log_perror(
 							lcfg,
 							errno,
@@ -1029,6 +2574,7 @@ int request_process(
 				request_put_error_body(lcfg, &rent);
 			}
 		}
+sent:
 		/* calculate delta time */
 		clock_gettime(CLOCK_MONOTONIC, &tp_e);
 		rent.dt = (double) (
@@ -1038,6 +2584,9 @@ int request_process(
 				(double) tp_b.tv_nsec
 			) / (double) 1000000000.0
 		);
+		if (lim != NULL) {
+			limit_end(lim, rent.dt);
+		}
 		/* log it */
 		request_log(lcfg, &rent);
 		/* free the relevant fields */
@@ -1046,6 +2595,9 @@ int request_process(
 		FREEANDNULL(rent.path);
 		FREEANDNULL(rent.ua);
 		FREEANDNULL(rent.raw_request);
+		FREEANDNULL(rent.auth);
+		FREEANDNULL(rent.location);
+		FREEANDNULL(loc);
 		/* close the file we opened */
 		if (f != -1) {
 			if (close(f) == -1) {
@@ -1059,7 +2611,7 @@ int request_process(
 		} else {
 			/* 5 second keepalive timeout */
 			if (
-				poll(&pfd, 1, 5000) > 0 &&
+				request_idle_wait(rcfg, &pfd, 5000) > 0 &&
 				(pfd.revents & POLLHUP) != POLLHUP
 			) {
 				continue;
@@ -1070,6 +2622,13 @@ int request_process(
 	}
 	ret = EXIT_SUCCESS;
 quit:
+	/* a pool thread lives on, so don't leave anything behind */
+	FREEANDNULL(rent.method);
+	FREEANDNULL(rent.path);
+	FREEANDNULL(rent.ua);
+	FREEANDNULL(rent.raw_request);
+	FREEANDNULL(rent.auth);
+	FREEANDNULL(rent.location);
 	/* close the connection */
 	errno = 0;
 	shutdown(sockfd, SHUT_RDWR);
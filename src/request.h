@@ -2,10 +2,133 @@
 #define __mekdotlu_request_h
 
 #include "log.h"
+#include "bloom.h"
+#include "journal.h"
+#include "codegen.h"
+#include "hits.h"
+#include "cache.h"
+#include "rules.h"
+#include "urlstore.h"
+#include "limit.h"
+#include "throttle.h"
 #include <stdio.h>
 #include <sys/socket.h>
 
+/* connection draining state in shared memory, set when quitting */
+struct request_drain {
+	int active;
+	/* keep-alive connections closed at a response boundary, or while
+	 * idle
+	 */
+	unsigned long closed;
+};
+
+/* clients cut off while sending their headers, in shared memory */
+struct request_timeouts {
+	/* past the header deadline */
+	unsigned long deadline;
+	/* below the minimum header rate */
+	unsigned long rate;
+};
+
+/* a canned response workers answer connections with right away */
+struct request_refusal {
+	int code;
+	size_t len;
+	char image[256];
+};
+
+/* longest accepted insertion API token */
+#define REQUEST_TOKEN_MAX 128
+/* seconds shed clients are told to wait before retrying */
+#define REQUEST_RETRY_AFTER 1
+/* default seconds a client gets to send its headers, and the fewest
+ * bytes per second it has to average while at it
+ */
+#define REQUEST_HEADER_TIMEOUT 10
+#define REQUEST_HEADER_RATE 32
+
+/* how to redirect requests within a URL tree */
+struct request_redir {
+	/* status code: 301, 302, 303, 307 or 308 */
+	int code;
+	/* Cache-Control max-age in seconds, -1 omits the header */
+	long maxage;
+};
+
+struct request_cfg {
+	/* /e/ tree */
+	struct request_redir ext;
+	/* /i/ tree */
+	struct request_redir in;
+	/* shard scheme: levels directories of len code points each, or
+	 * of fanout entries named after a hash of the code if non-zero
+	 */
+	unsigned int shard_len;
+	unsigned int shard_levels;
+	unsigned int shard_fanout;
+	/* skip read locks on redirect files, which writers then need to
+	 * publish atomically with rename(2)
+	 */
+	char nolock;
+	/* pin request children to the CPU their connection came in on */
+	char follow_cpu;
+	/* directory descriptors for the /e/ and /i/ trees */
+	int _efd;
+	int _ifd;
+	/* known short codes, NULL if disabled */
+	struct bloom *_bloom;
+	/* bearer token for PUT and POST, empty if the API is disabled */
+	char token[REQUEST_TOKEN_MAX];
+	/* insert log, NULL if the API is disabled */
+	struct journal *_journal;
+	/* short code generator, NULL if the API is disabled */
+	struct codegen *_codegen;
+	/* hit counters, NULL if disabled */
+	struct hits *_hits;
+	/* pre-rendered redirect responses, NULL if disabled */
+	struct cache *_cache;
+	/* prefix redirect rules, NULL if none */
+	struct rules *_rules;
+	/* resident copy of the trees, NULL if disabled */
+	struct urlstore *_urlstore;
+	/* seconds connections get to finish once draining */
+	long drain_timeout;
+	struct request_drain *_drain;
+	/* seconds the headers of a request may take, and bytes per second
+	 * they have to come in at, 0 if unbounded
+	 */
+	long header_timeout;
+	long header_rate;
+	struct request_timeouts *_timeouts;
+	/* threads per worker serving connections instead of forked
+	 * children, 0 to fork, and connections that may wait for them
+	 */
+	unsigned int threads;
+	unsigned int queue;
+	/* KiB of stack of the coroutine serving each connection on the
+	 * worker itself, 0 for none
+	 */
+	unsigned int coro_stack;
+	/* bounds of the in-flight request limits */
+	unsigned int limit_min;
+	unsigned int limit_max;
+	/* in-flight request limits of the IPv4 and IPv6 workers */
+	struct limit *_limit;
+	/* per-client connection rate limits of the IPv4 and IPv6
+	 * workers, NULL if unlimited
+	 */
+	struct throttle *_throttle[2];
+	/* the responses to connections shed while overloaded, and to
+	 * clients over their rate
+	 */
+	struct request_refusal _overload;
+	struct request_refusal _throttled;
+};
+
 struct request_ent {
+	/* server-wide request settings, may be NULL */
+	const struct request_cfg *cfg;
 	/* the request socket */
 	int sock;
 	/* response code */
@@ -21,6 +144,8 @@ struct request_ent {
 	double wait;
 	/* whether to kill the request after processing */
 	char kill;
+	/* Cache-Control max-age for redirects, -1 if unset */
+	long maxage;
 	/* remote address */
 	const struct sockaddr *ip;
 	/* request method: GET/HEAD */
@@ -31,14 +156,37 @@ struct request_ent {
 	char *ua;
 	/* client's raw request */
 	char *raw_request;
+	/* Authorization header */
+	char *auth;
+	/* Content-Length header, -1 if not sent */
+	long clen;
+	/* Location header for non-redirects, e.g. created short URLs */
+	char *location;
 };
 
 int request_getline(char *buf, int len, int fd);
 int request_decodeuri(char *buf, int len);
 int request_rewrite(struct request_ent *rent);
 
+int request_header_parse(const char *str, long *timeout, long *rate);
+int request_redir_parse(const char *str, struct request_redir *redir);
+int request_shard_parse(const char *str, struct request_cfg *rcfg);
+
+int request_init(const struct log_cfg *lcfg, struct request_cfg *rcfg);
+int request_kill(struct request_cfg *rcfg);
+int request_open(const struct request_ent *rent, int flags);
+int request_materialise(char op, const char *path, const char *url, void *arg);
+
+int request_render_refusal(struct request_refusal *r, int code);
+void request_put_refusal(
+	const struct log_cfg *lcfg,
+	const struct request_refusal *r,
+	int sock
+);
+
 int request_process(
 	const struct log_cfg *lcfg,
+	const struct request_cfg *rcfg,
 	int sockfd,
 	double delay,
 	const struct sockaddr *addr
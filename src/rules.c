@@ -0,0 +1,219 @@
+#include "rules.h"
+#include "request.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* Returns the index of the child of node n for byte c, adding one if
+ * need be, or 0 on allocation failure.
+ */
+size_t rules_child(
+	struct rules *r,
+	size_t *cap,
+	size_t n,
+	unsigned char c
+) {
+	size_t i, *link = &(r->nodes[n].child);
+	for (i = *link; i != 0; i = r->nodes[i].sibling) {
+		if (r->nodes[i].c == c) {
+			return i;
+		}
+		link = &(r->nodes[i].sibling);
+	}
+	if (r->nnodes == *cap) {
+		struct rules_node *nodes;
+		size_t off = (char *) link - (char *) r->nodes;
+		nodes = realloc(r->nodes, *cap * 2 * sizeof(*nodes));
+		if (nodes == NULL) {
+			return 0;
+		}
+		r->nodes = nodes;
+		*cap *= 2;
+		link = (size_t *) ((char *) r->nodes + off);
+	}
+	i = r->nnodes;
+	r->nnodes += 1;
+	memset(&(r->nodes[i]), 0, sizeof(r->nodes[i]));
+	r->nodes[i].c = c;
+	*link = i;
+	return i;
+}
+
+/* Reads `<prefix> <template> [<code>[:<max-age>]]' lines from the file
+ * at path, skipping blank ones and ones starting with `#'. Rules
+ * without a policy get code and maxage. Returns NULL on error with
+ * errno set, EINVAL for malformed lines, whose number is then printed
+ * to stderr.
+ */
+struct rules *rules_load(const char *path, int code, long maxage) {
+	struct rules *r;
+	size_t ncap = 64, rcap = 16, lineno = 0;
+	char line[4096];
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		return NULL;
+	}
+	r = calloc(1, sizeof(*r));
+	if (r == NULL) {
+		fclose(f);
+		return NULL;
+	}
+	r->nodes = calloc(ncap, sizeof(*(r->nodes)));
+	r->rules = calloc(rcap, sizeof(*(r->rules)));
+	if (r->nodes == NULL || r->rules == NULL) {
+		goto fail;
+	}
+	/* the root */
+	r->nnodes = 1;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		struct request_redir redir;
+		struct rules_rule *rule;
+		char *prefix, *tmpl, *policy, *save = NULL;
+		size_t n = 0, i;
+		lineno += 1;
+		prefix = strtok_r(line, " \t\r\n", &save);
+		if (prefix == NULL || prefix[0] == '#') {
+			continue;
+		}
+		tmpl = strtok_r(NULL, " \t\r\n", &save);
+		policy = strtok_r(NULL, " \t\r\n", &save);
+		redir.code = code;
+		redir.maxage = maxage;
+		if (
+			prefix[0] != '/' ||
+			tmpl == NULL ||
+			(
+				policy != NULL &&
+				request_redir_parse(policy, &redir) == 0
+			) ||
+			strtok_r(NULL, " \t\r\n", &save) != NULL
+		) {
+			fprintf(
+				stderr,
+				"%s:%lu: Malformed rule\n",
+				path,
+				(unsigned long) lineno
+			);
+			errno = EINVAL;
+			goto fail;
+		}
+		if (r->nrules == rcap) {
+			struct rules_rule *rules;
+			rules = realloc(r->rules, rcap * 2 * sizeof(*rules));
+			if (rules == NULL) {
+				goto fail;
+			}
+			r->rules = rules;
+			rcap *= 2;
+		}
+		rule = &(r->rules[r->nrules]);
+		rule->prefix = strdup(prefix);
+		rule->tmpl = strdup(tmpl);
+		rule->code = redir.code;
+		rule->maxage = redir.maxage;
+		r->nrules += 1;
+		if (rule->prefix == NULL || rule->tmpl == NULL) {
+			goto fail;
+		}
+		for (i = 0; prefix[i] != '\0'; i += 1) {
+			n = rules_child(r, &ncap, n, (unsigned char) prefix[i]);
+			if (n == 0) {
+				goto fail;
+			}
+		}
+		/* a later rule for the same prefix wins */
+		r->nodes[n].rule = r->nrules;
+	}
+	if (ferror(f)) {
+		goto fail;
+	}
+	fclose(f);
+	return r;
+fail:
+	{
+		int storerr = errno;
+		fclose(f);
+		rules_free(r);
+		errno = storerr;
+	}
+	return NULL;
+}
+
+void rules_free(struct rules *r) {
+	size_t i;
+	if (r == NULL) {
+		return;
+	}
+	for (i = 0; r->rules != NULL && i < r->nrules; i += 1) {
+		free(r->rules[i].prefix);
+		free(r->rules[i].tmpl);
+	}
+	free(r->rules);
+	free(r->nodes);
+	free(r);
+}
+
+/* Finds the rule with the longest prefix of path, and stores the
+ * prefix length in plen. Returns NULL if no rule matches.
+ */
+const struct rules_rule *rules_match(
+	const struct rules *r,
+	const char *path,
+	size_t *plen
+) {
+	size_t n = 0, i, best = 0;
+	for (i = 0; ; i += 1) {
+		if (r->nodes[n].rule != 0) {
+			best = r->nodes[n].rule;
+			*plen = i;
+		}
+		if (path[i] == '\0') {
+			break;
+		}
+		n = r->nodes[n].child;
+		while (n != 0 && r->nodes[n].c != (unsigned char) path[i]) {
+			n = r->nodes[n].sibling;
+		}
+		if (n == 0) {
+			break;
+		}
+	}
+	return (best != 0) ? &(r->rules[best - 1]) : NULL;
+}
+
+/* Substitutes rest into the template of rule. Returns the target URL,
+ * which needs to be freed, or NULL on allocation failure.
+ */
+char *rules_expand(const struct rules_rule *rule, const char *rest) {
+	size_t len = 0, rlen = strlen(rest), n = 0;
+	const char *t, *hole;
+	char *ret;
+	t = rule->tmpl;
+	while ((hole = strstr(t, "{}")) != NULL) {
+		n += 1;
+		t = &(hole[2]);
+	}
+	len = strlen(rule->tmpl) + ((n > 0) ? n * rlen - n * 2 : rlen);
+	ret = malloc(len + 1);
+	if (ret == NULL) {
+		return NULL;
+	}
+	ret[0] = '\0';
+	len = 0;
+	t = rule->tmpl;
+	while ((hole = strstr(t, "{}")) != NULL) {
+		memcpy(&(ret[len]), t, hole - t);
+		len += hole - t;
+		memcpy(&(ret[len]), rest, rlen);
+		len += rlen;
+		t = &(hole[2]);
+	}
+	strcpy(&(ret[len]), t);
+	if (n == 0) {
+		strcat(ret, rest);
+	}
+	return ret;
+}
+
+/* vi: set sts=8 ts=8 sw=8 noexpandtab: */
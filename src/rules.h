@@ -0,0 +1,49 @@
+#ifndef __mekdotlu_rules_h
+#define __mekdotlu_rules_h
+
+#include <stddef.h>
+
+/* a prefix redirect rule
+ *
+ * the part of the path after the prefix replaces every `{}' in the
+ * template, or is appended to it if there is none
+ */
+struct rules_rule {
+	char *prefix;
+	char *tmpl;
+	/* redirect policy */
+	int code;
+	long maxage;
+};
+
+/* a trie node, children are linked through their siblings */
+struct rules_node {
+	unsigned char c;
+	/* node indices, 0 if none since the root is never a child */
+	size_t child;
+	size_t sibling;
+	/* rule index + 1, 0 if no rule ends here */
+	size_t rule;
+};
+
+/* prefix rules compiled into a byte-wise trie */
+struct rules {
+	struct rules_node *nodes;
+	size_t nnodes;
+	struct rules_rule *rules;
+	size_t nrules;
+};
+
+struct rules *rules_load(const char *path, int code, long maxage);
+void rules_free(struct rules *r);
+
+const struct rules_rule *rules_match(
+	const struct rules *r,
+	const char *path,
+	size_t *plen
+);
+char *rules_expand(const struct rules_rule *rule, const char *rest);
+
+#endif /* __mekdotlu_rules_h */
+
+/* vi: set sts=8 ts=8 sw=8 noexpandtab: */
@@ -1,17 +1,34 @@
 #include "server.h"
 #include "worker.h"
 #include "net.h"
+#include "request.h"
+#include "bloom.h"
+#include "journal.h"
+#include "codegen.h"
+#include "hits.h"
+#include "cache.h"
+#include "rules.h"
+#include "urlstore.h"
+#include "limit.h"
 #include "log.h"
 #include <unistd.h>
 #include <signal.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <netinet/in.h>
 #include <arpa/inet.h>
 
+/* Required for OSX. */
+#ifndef MAP_ANONYMOUS
+#	define MAP_ANONYMOUS MAP_ANON
+#endif
+
 #if !defined(__linux) && defined(USE_CAPABILITIES)
 #	undef USE_CAPABILITIES
 #endif
@@ -173,7 +190,8 @@ int server_constrain(const struct server_cfg *cfg) {
 	(_socket) = net_listen( \
 		&(cfg->_lcfg), \
 		(_af), \
-		cfg->port \
+		cfg->port, \
+		&(cfg->sockopts[((_af) == AF_INET6) ? 1 : 0]) \
 	); \
 	if ((_socket) == -1) { \
 		log_err( \
@@ -189,20 +207,673 @@ int server_constrain(const struct server_cfg *cfg) {
 		); \
 	}
 
+/* the listening sockets passed on to an upgraded binary as
+ * `<ipv4 fd>,<ipv6 fd>', and the PID of the master it replaces
+ */
+#define SERVER_ENV_FDS "MEKDOTLU_LISTEN_FDS"
+#define SERVER_ENV_PID "MEKDOTLU_UPGRADE_PID"
+
+/* Checks that fd is a listening socket of family af on our port. */
+int server_inherit_fd(const struct server_cfg *cfg, int fd, int af) {
+	union {
+		struct sockaddr_in addr4;
+		struct sockaddr_in6 addr6;
+	} a;
+	socklen_t len = sizeof(a);
+	unsigned short port;
+	memset(&a, 0, sizeof(a));
+	if (fd < 0 || getsockname(fd, (struct sockaddr *) &a, &len) == -1) {
+		return 0;
+	}
+	if (a.addr4.sin_family != af) {
+		return 0;
+	}
+	port = ntohs(
+		(af == AF_INET) ? a.addr4.sin_port : a.addr6.sin6_port
+	);
+#ifdef IPV6_V6ONLY
+	/* whether it takes IPv4 is fixed once bound */
+	if (af == AF_INET6) {
+		int v6only = -1;
+		len = sizeof(v6only);
+		if (
+			getsockopt(
+				fd,
+				IPPROTO_IPV6,
+				IPV6_V6ONLY,
+				&v6only,
+				&len
+			) == -1 ||
+			v6only != cfg->sockopts[1].v6only
+		) {
+			return 0;
+		}
+	}
+#endif
+	return port == cfg->port;
+}
+
+/* Takes over the listening sockets of the master we are replacing, if
+ * any. Returns 1 if we were started as an upgrade, 0 otherwise.
+ */
+int server_inherit(struct server_cfg *cfg) {
+	const char *env = getenv(SERVER_ENV_FDS);
+	int fd4 = -1, fd6 = -1;
+	if (env == NULL) {
+		return 0;
+	}
+	if (sscanf(env, "%d,%d", &fd4, &fd6) != 2) {
+		log_wrn(&(cfg->_lcfg), "server: Malformed %s", SERVER_ENV_FDS);
+	}
+	unsetenv(SERVER_ENV_FDS);
+#define INHERIT(_name, _fd, _af, _socket) \
+	if (server_inherit_fd(cfg, (_fd), (_af))) { \
+		(_socket) = (_fd); \
+		log_ok( \
+			&(cfg->_lcfg), \
+			"server: " _name ": Inherited listening socket %d", \
+			(_fd) \
+		); \
+		/* our options may differ from the old binary's */ \
+		net_tune( \
+			&(cfg->_lcfg), \
+			(_fd), \
+			_name, \
+			&(cfg->sockopts[((_af) == AF_INET6) ? 1 : 0]) \
+		); \
+	} else if ((_fd) != -1) { \
+		log_wrn( \
+			&(cfg->_lcfg), \
+			"server: " _name ": Can't reuse socket %d, wrong " \
+			"family, port or dual-stack mode", \
+			(_fd) \
+		); \
+		close(_fd); \
+	}
+	INHERIT("ipv4", fd4, AF_INET, cfg->_sock);
+	INHERIT("ipv6", fd6, AF_INET6, cfg->_sock6);
+#undef INHERIT
+	return 1;
+}
+
+/* Runs in a process forked off before the master constrains itself,
+ * so that it can start a new binary with the same root, privileges
+ * and arguments the master was started with. Exits once the master
+ * closes its end of sock.
+ */
+void server_upgrader(const struct server_cfg *cfg, int sock) {
+	pid_t master = getppid();
+	char msg[4];
+	for (;;) {
+		pid_t child;
+		ssize_t r = read(sock, msg, sizeof(msg));
+		if (r <= 0) {
+			_exit(EXIT_SUCCESS);
+		}
+		if (r != sizeof(msg) || memcmp(msg, "upgr", 4) != 0) {
+			continue;
+		}
+		/* fork twice so the new master won't be our child */
+		child = fork();
+		if (child == 0) {
+			if (fork() == 0) {
+				char fds[32], pid[32];
+				long fd, maxfd = sysconf(_SC_OPEN_MAX);
+				snprintf(
+					fds,
+					sizeof(fds),
+					"%d,%d",
+					cfg->_sock,
+					cfg->_sock6
+				);
+				snprintf(pid, sizeof(pid), "%d", (int) master);
+				setenv(SERVER_ENV_FDS, fds, 1);
+				setenv(SERVER_ENV_PID, pid, 1);
+				/* leave nothing but stdio and the sockets */
+				for (fd = 3; fd < maxfd && fd < 65536; fd += 1) {
+					if (fd != cfg->_sock && fd != cfg->_sock6) {
+						close(fd);
+					}
+				}
+				execvp(cfg->_argv[0], cfg->_argv);
+				perror("server: upgrade: exec");
+				_exit(EXIT_FAILURE);
+			}
+			_exit(EXIT_SUCCESS);
+		} else if (child != -1) {
+			waitpid(child, NULL, 0);
+		}
+	}
+}
+
+/* forks the upgrade helper; returns 1 on success, 0 otherwise */
+int server_upgrader_start(struct server_cfg *cfg) {
+	int sv[2];
+	errno = 0;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		log_perror(&(cfg->_lcfg), errno, "server: socketpair");
+		return 0;
+	}
+	cfg->_upgrader = fork();
+	if (cfg->_upgrader == 0) {
+		close(sv[0]);
+		server_upgrader(cfg, sv[1]);
+	} else if (cfg->_upgrader == -1) {
+		log_perror(&(cfg->_lcfg), errno, "server: fork");
+		close(sv[0]);
+		close(sv[1]);
+		return 0;
+	}
+	close(sv[1]);
+	cfg->_upgsock = sv[0];
+	return 1;
+}
+
+/* starts a new binary on our listening sockets; it tells us to quit
+ * once it is up
+ */
+void server_upgrade(const struct server_cfg *cfg) {
+	if (cfg->_upgsock == -1) {
+		log_wrn(
+			&(cfg->_lcfg),
+			"server: Upgrades are disabled, see -U"
+		);
+		return;
+	}
+	log_reg(&(cfg->_lcfg), "server: Starting an upgraded binary...");
+	errno = 0;
+	if (write(cfg->_upgsock, "upgr", 4) == -1) {
+		log_perror(&(cfg->_lcfg), errno, "server: upgrade");
+	}
+}
+
+/* Pins a freshly forked worker to its CPUs, and logs where it runs. */
+void server_pin(const struct server_cfg *cfg, const char *name, int af) {
+	const struct cpuset *set = &(cfg->cpus[(af == AF_INET6) ? 1 : 0]);
+	struct cpuset cur;
+	char buf[256];
+	errno = 0;
+	if (!cpuset_apply(set)) {
+		log_perror(&(cfg->_lcfg), errno, "server: sched_setaffinity");
+	}
+	if (!cpuset_current(&cur)) {
+		return;
+	}
+	cpuset_format(&cur, buf, sizeof(buf));
+	log_reg(
+		&(cfg->_lcfg),
+		"server: %s worker %s CPUs %s%s",
+		name,
+		(set->count > 0) ? "pinned to" : "runs on",
+		buf,
+		cfg->_rcfg.follow_cpu ? ", children follow connections" : ""
+	);
+}
+
+/* rebuilds the lookup structures from the URL trees */
+void server_reload(const struct server_cfg *cfg) {
+	if (cfg->_rcfg._bloom != NULL) {
+		long n = bloom_rebuild(
+			cfg->_rcfg._bloom,
+			cfg->_rcfg._efd,
+			cfg->_rcfg._ifd,
+			cfg->_rcfg.shard_levels == 0
+		);
+		log_ok(
+			&(cfg->_lcfg),
+			"server: bloom: Indexed %ld short codes",
+			n
+		);
+	}
+	if (cfg->_rcfg._urlstore != NULL) {
+		const struct urlstore *s = cfg->_rcfg._urlstore;
+		const struct urlstore_arena *a;
+		long n = urlstore_rebuild(
+			cfg->_rcfg._urlstore,
+			cfg->_rcfg._efd,
+			cfg->_rcfg._ifd,
+			cfg->_rcfg.shard_levels == 0
+		);
+		if (n == -1) {
+			log_perror(&(cfg->_lcfg), errno, "server: urlstore");
+			return;
+		}
+		a = (const struct urlstore_arena *) s->_arena[s->active];
+		log_ok(
+			&(cfg->_lcfg),
+			"server: urlstore: Stored %ld URLs in %lu bytes "
+			"(%.1f bytes per entry, %.1f as is)",
+			n,
+			(unsigned long) a->used,
+			(n > 0) ? (double) a->used / (double) n : 0.0,
+			(n > 0) ? (double) a->raw / (double) n : 0.0
+		);
+	}
+}
+
+/* logs the counters of the lookup structures */
+void server_stats(const struct server_cfg *cfg) {
+	if (cfg->_wstats != NULL) {
+		size_t i;
+		for (i = 0; i < 2; i += 1) {
+			const unsigned long *b = cfg->_wstats[i].batches;
+			log_reg(
+				&(cfg->_lcfg),
+				"server: accept batches: %s: 0: %lu, 1: %lu, "
+				"2-3: %lu, 4-7: %lu, 8-15: %lu, 16-31: %lu, "
+				"32-63: %lu, 64+: %lu",
+				(i == 0) ? "ipv4" : "ipv6",
+				b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7]
+			);
+			if (cfg->_rcfg.coro_stack > 0) {
+				const struct worker_stats *w =
+					&(cfg->_wstats[i]);
+				log_reg(
+					&(cfg->_lcfg),
+					"server: coroutines: %s: %u running, "
+					"%lu spawned, %lu switches, "
+					"%lu timeouts",
+					(i == 0) ? "ipv4" : "ipv6",
+					__atomic_load_n(
+						&(w->coro.running),
+						__ATOMIC_RELAXED
+					),
+					__atomic_load_n(
+						&(w->coro.spawned),
+						__ATOMIC_RELAXED
+					),
+					__atomic_load_n(
+						&(w->coro.switches),
+						__ATOMIC_RELAXED
+					),
+					__atomic_load_n(
+						&(w->coro.timeouts),
+						__ATOMIC_RELAXED
+					)
+				);
+			}
+			if (cfg->_rcfg.threads == 0) {
+				continue;
+			}
+			log_reg(
+				&(cfg->_lcfg),
+				"server: pool: %s: %lu handled, %lu parks, "
+				"%lu steals, %lu overflows",
+				(i == 0) ? "ipv4" : "ipv6",
+				__atomic_load_n(
+					&(cfg->_wstats[i].pool.handled),
+					__ATOMIC_RELAXED
+				),
+				__atomic_load_n(
+					&(cfg->_wstats[i].pool.parks),
+					__ATOMIC_RELAXED
+				),
+				__atomic_load_n(
+					&(cfg->_wstats[i].pool.steals),
+					__ATOMIC_RELAXED
+				),
+				__atomic_load_n(
+					&(cfg->_wstats[i].pool.overflows),
+					__ATOMIC_RELAXED
+				)
+			);
+		}
+	}
+	if (cfg->_rcfg._timeouts != NULL) {
+		const struct request_timeouts *t = cfg->_rcfg._timeouts;
+		log_reg(
+			&(cfg->_lcfg),
+			"server: header timeouts: %lu past the deadline, "
+			"%lu below the minimum rate",
+			__atomic_load_n(&(t->deadline), __ATOMIC_RELAXED),
+			__atomic_load_n(&(t->rate), __ATOMIC_RELAXED)
+		);
+	}
+	if (cfg->_rcfg._limit != NULL) {
+		size_t i;
+		for (i = 0; i < 2; i += 1) {
+			const struct limit *l = &(cfg->_rcfg._limit[i]);
+			unsigned long inc, dec, rej;
+			inc = __atomic_load_n(
+				&(l->increases),
+				__ATOMIC_RELAXED
+			);
+			dec = __atomic_load_n(
+				&(l->decreases),
+				__ATOMIC_RELAXED
+			);
+			rej = __atomic_load_n(
+				&(l->rejected),
+				__ATOMIC_RELAXED
+			);
+			log_reg(
+				&(cfg->_lcfg),
+				"server: limit: %s: %u of %u..%u, "
+				"%u in flight, %.3fms latency, "
+				"%.3fms baseline, %lu increases, "
+				"%lu decreases, %lu rejections, %lu shed",
+				(i == 0) ? "ipv4" : "ipv6",
+				l->cur,
+				l->min,
+				l->max,
+				l->inflight,
+				l->latency * 1000.0,
+				l->baseline * 1000.0,
+				inc,
+				dec,
+				rej,
+				__atomic_load_n(&(l->shed), __ATOMIC_RELAXED)
+			);
+		}
+	}
+	if (cfg->_rcfg._throttle[0] != NULL) {
+		size_t i;
+		for (i = 0; i < 2; i += 1) {
+			const struct throttle *t = cfg->_rcfg._throttle[i];
+			unsigned long checks, limited, evictions;
+			checks = __atomic_load_n(
+				&(t->checks),
+				__ATOMIC_RELAXED
+			);
+			limited = __atomic_load_n(
+				&(t->limited),
+				__ATOMIC_RELAXED
+			);
+			evictions = __atomic_load_n(
+				&(t->evictions),
+				__ATOMIC_RELAXED
+			);
+			log_reg(
+				&(cfg->_lcfg),
+				"server: throttle: %s: %lu checks, "
+				"%lu limited, %lu evictions",
+				(i == 0) ? "ipv4" : "ipv6",
+				checks,
+				limited,
+				evictions
+			);
+		}
+	}
+	if (cfg->_rcfg._bloom != NULL) {
+		const struct bloom *b = cfg->_rcfg._bloom;
+		unsigned long checks, misses, falsepos;
+		checks = __atomic_load_n(&(b->checks), __ATOMIC_RELAXED);
+		misses = __atomic_load_n(&(b->misses), __ATOMIC_RELAXED);
+		falsepos = __atomic_load_n(&(b->falsepos), __ATOMIC_RELAXED);
+		log_reg(
+			&(cfg->_lcfg),
+			"server: bloom: %lu entries, %lu bits, %lu checks, "
+			"%lu definite misses, %lu false positives "
+			"(%.2f%% false positive rate)",
+			b->entries,
+			(unsigned long) b->nbits,
+			checks,
+			misses,
+			falsepos,
+			(misses + falsepos > 0) ?
+				(double) falsepos * 100.0 /
+				(double) (misses + falsepos) :
+				0.0
+		);
+	}
+	if (cfg->_rcfg._journal != NULL) {
+		const struct journal *j = cfg->_rcfg._journal;
+		unsigned long written, syncs;
+		written = __atomic_load_n(&(j->written), __ATOMIC_RELAXED);
+		syncs = __atomic_load_n(&(j->syncs), __ATOMIC_RELAXED);
+		log_reg(
+			&(cfg->_lcfg),
+			"server: journal: %lu inserts, %lu syncs "
+			"(%.2f inserts per sync)",
+			written,
+			syncs,
+			(syncs > 0) ? (double) written / (double) syncs : 0.0
+		);
+	}
+	if (cfg->_rcfg._urlstore != NULL) {
+		const struct urlstore *s = cfg->_rcfg._urlstore;
+		log_reg(
+			&(cfg->_lcfg),
+			"server: urlstore: %lu lookups, %lu answered",
+			__atomic_load_n(&(s->lookups), __ATOMIC_RELAXED),
+			__atomic_load_n(&(s->hits), __ATOMIC_RELAXED)
+		);
+	}
+	if (cfg->_rcfg._cache != NULL) {
+		const struct cache *c = cfg->_rcfg._cache;
+		unsigned long hits, misses;
+		hits = __atomic_load_n(&(c->hits), __ATOMIC_RELAXED);
+		misses = __atomic_load_n(&(c->misses), __ATOMIC_RELAXED);
+		log_reg(
+			&(cfg->_lcfg),
+			"server: cache: %lu slots, %lu hits, %lu misses "
+			"(%.2f%% hit rate)",
+			(unsigned long) c->nslots,
+			hits,
+			misses,
+			(hits + misses > 0) ?
+				(double) hits * 100.0 /
+				(double) (hits + misses) :
+				0.0
+		);
+	}
+	if (cfg->_rcfg._hits != NULL) {
+		struct hits_top top[HITS_SHOW];
+		size_t i, n;
+		n = hits_top(cfg->_rcfg._hits, top, HITS_SHOW);
+		log_reg(
+			&(cfg->_lcfg),
+			"server: hits: %lu redirects counted",
+			__atomic_load_n(
+				&(cfg->_rcfg._hits->total),
+				__ATOMIC_RELAXED
+			)
+		);
+		for (i = 0; i < n; i += 1) {
+			log_reg(
+				&(cfg->_lcfg),
+				"server: hits: #%u %s ~%lu",
+				(unsigned int) (i + 1),
+				top[i].key,
+				top[i].count
+			);
+		}
+	}
+}
+
+/* Compacts the journal after a successful replay, once the trees it
+ * was applied to are on disk. Skipped while upgrading, as the workers
+ * of the old master may still be appending to it.
+ */
+void server_compact(
+	const struct server_cfg *cfg,
+	const char *prev,
+	uint64_t seed
+) {
+	struct journal *j = cfg->_rcfg._journal;
+	if (prev != NULL) {
+		return;
+	}
+	if (j->failed > 0) {
+		log_wrn(
+			&(cfg->_lcfg),
+			"server: journal: %lu inserts failed, keeping them",
+			j->failed
+		);
+		return;
+	}
+	sync();
+	errno = 0;
+	if (journal_compact(j, seed) == 0) {
+		log_perror(&(cfg->_lcfg), errno, "server: journal: compact");
+		return;
+	}
+	log_ok(&(cfg->_lcfg), "server: journal: Compacted");
+}
+
 int server_init(struct server_cfg *cfg) {
+	const char *prev = getenv(SERVER_ENV_PID);
+	cfg->_upgrader = -1;
+	cfg->_upgsock = -1;
+	/* IPv4 comes in on the IPv6 socket in dual-stack mode */
+	cfg->sockopts[1].v6only = !cfg->dualstack;
+	if (server_inherit(cfg) == 0) {
+		prev = NULL;
+	}
+	if (cfg->dualstack && cfg->_sock != -1) {
+		log_wrn(
+			&(cfg->_lcfg),
+			"server: ipv4: Closing inherited socket %d, the "
+			"IPv6 one takes IPv4 in dual-stack mode",
+			cfg->_sock
+		);
+		close(cfg->_sock);
+		cfg->_sock = -1;
+	}
 	/* IPv4 */
-	BINDADDR("ipv4", "0.0.0.0", AF_INET, cfg->_sock);
+	if (cfg->_sock == -1 && !cfg->dualstack) {
+		BINDADDR("ipv4", "0.0.0.0", AF_INET, cfg->_sock);
+	}
 	/* IPv6 */
-	BINDADDR("ipv6", "[::]", AF_INET6, cfg->_sock6);
+	if (cfg->_sock6 == -1) {
+		BINDADDR("ipv6", "[::]", AF_INET6, cfg->_sock6);
+	}
+	/* without IPv6 there is nothing to share */
+	if (cfg->dualstack && cfg->_sock6 == -1) {
+		log_wrn(
+			&(cfg->_lcfg),
+			"server: No dual-stack socket, binding IPv4 alone"
+		);
+		BINDADDR("ipv4", "0.0.0.0", AF_INET, cfg->_sock);
+	}
 	/* nothing was bound, abort, abort */
 	if (cfg->_sock == -1 && cfg->_sock6 == -1) {
 		return 0;
 	}
+	/* request children look here for when to stop keeping alive */
+	cfg->_rcfg._drain = mmap(
+		NULL,
+		sizeof(*(cfg->_rcfg._drain)),
+		PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS,
+		-1,
+		0
+	);
+	if (cfg->_rcfg._drain == MAP_FAILED) {
+		cfg->_rcfg._drain = NULL;
+		log_perror(&(cfg->_lcfg), errno, "server: mmap");
+		return 0;
+	}
+	memset(cfg->_rcfg._drain, 0, sizeof(*(cfg->_rcfg._drain)));
+	/* request children count the clients they gave up on here */
+	cfg->_rcfg._timeouts = mmap(
+		NULL,
+		sizeof(*(cfg->_rcfg._timeouts)),
+		PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS,
+		-1,
+		0
+	);
+	if (cfg->_rcfg._timeouts == MAP_FAILED) {
+		cfg->_rcfg._timeouts = NULL;
+		log_perror(&(cfg->_lcfg), errno, "server: mmap");
+		return 0;
+	}
+	memset(cfg->_rcfg._timeouts, 0, sizeof(*(cfg->_rcfg._timeouts)));
+	/* workers adjust these as they go, children report to them */
+	cfg->_rcfg._limit = limit_create(
+		cfg->_rcfg.limit_min,
+		cfg->_rcfg.limit_max,
+		2
+	);
+	if (cfg->_rcfg._limit == NULL) {
+		log_perror(&(cfg->_lcfg), errno, "server: mmap");
+		return 0;
+	}
+	request_render_refusal(&(cfg->_rcfg._overload), 503);
+	request_render_refusal(&(cfg->_rcfg._throttled), 429);
+	/* workers count their accept batches here */
+	cfg->_wstats = mmap(
+		NULL,
+		2 * sizeof(*(cfg->_wstats)),
+		PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS,
+		-1,
+		0
+	);
+	if (cfg->_wstats == MAP_FAILED) {
+		cfg->_wstats = NULL;
+		log_perror(&(cfg->_lcfg), errno, "server: mmap");
+		return 0;
+	}
+	memset(cfg->_wstats, 0, 2 * sizeof(*(cfg->_wstats)));
+	/* the helper keeps our privileges and root */
+	if (cfg->upgrade && server_upgrader_start(cfg) == 0) {
+		return 0;
+	}
 	/* try to chroot & drop capabilities */
-	return server_constrain(cfg);
+	if (server_constrain(cfg) == 0) {
+		return 0;
+	}
+	/* hold on to the URL trees */
+	if (request_init(&(cfg->_lcfg), &(cfg->_rcfg)) == 0) {
+		log_wrn(
+			&(cfg->_lcfg),
+			"server: Missing /e/ or /i/ tree in document root"
+		);
+	}
+	/* finish inserts that made it to the journal only */
+	if (cfg->_rcfg._journal != NULL) {
+		struct journal *j = cfg->_rcfg._journal;
+		long n = journal_replay(j, request_materialise, &(cfg->_rcfg));
+		if (n == -1) {
+			log_perror(&(cfg->_lcfg), errno, "server: journal");
+		} else {
+			/* every generated code was journaled along with
+			 * the end of the batch it came from, so counting
+			 * on from the highest one won't repeat any; older
+			 * journals only have the record count to go by,
+			 * and a batch may have been reserved per record
+			 */
+			uint64_t seed = (j->reserved > 0) ?
+				j->reserved :
+				(uint64_t) n * CODEGEN_BATCH;
+			log_ok(
+				&(cfg->_lcfg),
+				"server: journal: Replayed %ld inserts",
+				n
+			);
+			if (cfg->_rcfg._codegen != NULL) {
+				codegen_seed(cfg->_rcfg._codegen, seed);
+			}
+			server_compact(cfg, prev, seed);
+		}
+	}
+	server_reload(cfg);
+	/* we're up, let the master we replace drain */
+	if (prev != NULL) {
+		pid_t pid = (pid_t) atoi(prev);
+		unsetenv(SERVER_ENV_PID);
+		errno = 0;
+		if (pid > 1 && kill(pid, SIGTERM) == 0) {
+			log_ok(
+				&(cfg->_lcfg),
+				"server: Told the previous master [%d] to quit",
+				(int) pid
+			);
+		} else {
+			log_perror(&(cfg->_lcfg), errno, "server: kill");
+		}
+	}
+	return 1;
 }
 
 int server_kill(struct server_cfg *cfg) {
+	if (cfg->_upgsock != -1) {
+		/* the helper exits on hangup */
+		close(cfg->_upgsock);
+		cfg->_upgsock = -1;
+	}
 	if (cfg->_sock != -1) {
 		close(cfg->_sock);
 		cfg->_sock = -1;
@@ -211,6 +882,60 @@ int server_kill(struct server_cfg *cfg) {
 		close(cfg->_sock6);
 		cfg->_sock6 = -1;
 	}
+	request_kill(&(cfg->_rcfg));
+	if (cfg->_rcfg._bloom != NULL) {
+		bloom_destroy(cfg->_rcfg._bloom);
+		cfg->_rcfg._bloom = NULL;
+	}
+	if (cfg->_rcfg._journal != NULL) {
+		journal_close(cfg->_rcfg._journal);
+		cfg->_rcfg._journal = NULL;
+	}
+	if (cfg->_rcfg._codegen != NULL) {
+		codegen_destroy(cfg->_rcfg._codegen);
+		cfg->_rcfg._codegen = NULL;
+	}
+	if (cfg->_rcfg._hits != NULL) {
+		hits_close(cfg->_rcfg._hits);
+		cfg->_rcfg._hits = NULL;
+	}
+	if (cfg->_rcfg._cache != NULL) {
+		cache_destroy(cfg->_rcfg._cache);
+		cfg->_rcfg._cache = NULL;
+	}
+	if (cfg->_rcfg._urlstore != NULL) {
+		urlstore_destroy(cfg->_rcfg._urlstore);
+		cfg->_rcfg._urlstore = NULL;
+	}
+	if (cfg->_rcfg._drain != NULL) {
+		log_reg(
+			&(cfg->_lcfg),
+			"server: Closed %lu keep-alive connections early "
+			"while draining",
+			cfg->_rcfg._drain->closed
+		);
+		munmap(cfg->_rcfg._drain, sizeof(*(cfg->_rcfg._drain)));
+		cfg->_rcfg._drain = NULL;
+	}
+	if (cfg->_rcfg._timeouts != NULL) {
+		munmap(
+			cfg->_rcfg._timeouts,
+			sizeof(*(cfg->_rcfg._timeouts))
+		);
+		cfg->_rcfg._timeouts = NULL;
+	}
+	throttle_destroy(cfg->_rcfg._throttle[0]);
+	throttle_destroy(cfg->_rcfg._throttle[1]);
+	cfg->_rcfg._throttle[0] = NULL;
+	cfg->_rcfg._throttle[1] = NULL;
+	if (cfg->_wstats != NULL) {
+		munmap(cfg->_wstats, 2 * sizeof(*(cfg->_wstats)));
+		cfg->_wstats = NULL;
+	}
+	limit_destroy(cfg->_rcfg._limit, 2);
+	cfg->_rcfg._limit = NULL;
+	rules_free(cfg->_rcfg._rules);
+	cfg->_rcfg._rules = NULL;
 	return 1;
 }
 
@@ -249,6 +974,10 @@ int server_kill(struct server_cfg *cfg) {
 			sa.sa_handler = SIG_IGN; \
 			sigemptyset(&(sa.sa_mask)); \
 			REGSIG(SIGINT, &sa); \
+			REGSIG(SIGHUP, &sa); \
+			REGSIG(SIGUSR1, &sa); \
+			REGSIG(SIGALRM, &sa); \
+			REGSIG(SIGUSR2, &sa); \
 			sa.sa_handler = SIG_DFL; \
 			REGSIG(SIGTERM, &sa); \
 			REGSIG(SIGQUIT, &sa); \
@@ -258,10 +987,19 @@ int server_kill(struct server_cfg *cfg) {
 			} \
 			/* close the parent's IPC socket */ \
 			close((_wrkstate).sock[0]); \
+			/* only the master talks to the upgrade helper */ \
+			if (cfg->_upgsock != -1) { \
+				close(cfg->_upgsock); \
+			} \
 			/* workers need not access stdin */ \
 			fclose(stdin); \
+			server_pin(cfg, (_name), (_af)); \
 			worker_loop( \
 				&(cfg->_lcfg), \
+				&(cfg->_rcfg), \
+				(cfg->_wstats != NULL) ? \
+					&(cfg->_wstats[(_af) == AF_INET6]) : \
+					NULL, \
 				(_wrkstate).sock[1], \
 				(_af), \
 				(_socket) \
@@ -310,6 +1048,25 @@ void server_quit_handler(int sig) {
 	errno = old_errno;
 }
 
+/* set by SIGHUP, SIGUSR1, SIGALRM and SIGUSR2 respectively */
+volatile sig_atomic_t server_reload_pending;
+volatile sig_atomic_t server_stats_pending;
+volatile sig_atomic_t server_flush_pending;
+volatile sig_atomic_t server_upgrade_pending;
+
+/* a signal handler for SIG{HUP,USR1,ALRM,USR2} */
+void server_flag_handler(int sig) {
+	if (sig == SIGHUP) {
+		server_reload_pending = 1;
+	} else if (sig == SIGUSR1) {
+		server_stats_pending = 1;
+	} else if (sig == SIGALRM) {
+		server_flush_pending = 1;
+	} else if (sig == SIGUSR2) {
+		server_upgrade_pending = 1;
+	}
+}
+
 #define REGSIG(_sig, _cfg) \
 	if (sigaction(_sig, _cfg, NULL) == -1) { \
 		log_perror( \
@@ -344,6 +1101,14 @@ void server_loop(const struct server_cfg *cfg) {
 	REGSIG(SIGINT, &sa);
 	REGSIG(SIGTERM, &sa);
 	REGSIG(SIGQUIT, &sa);
+	sa.sa_handler = server_flag_handler;
+	REGSIG(SIGHUP, &sa);
+	REGSIG(SIGUSR1, &sa);
+	REGSIG(SIGALRM, &sa);
+	REGSIG(SIGUSR2, &sa);
+	if (cfg->_rcfg._hits != NULL) {
+		alarm(HITS_FLUSH_INTERVAL);
+	}
 	/* set some initial values for worker state */
 	ipv4.pid = ipv4.sock[0] = ipv4.sock[1] = -1;
 	ipv6.pid = ipv6.sock[0] = ipv6.sock[1] = -1;
@@ -352,6 +1117,27 @@ void server_loop(const struct server_cfg *cfg) {
 		int rawstatus, status;
 		const char *worker = "UNK";
 		pid_t child;
+		if (server_reload_pending == 1) {
+			server_reload_pending = 0;
+			server_reload(cfg);
+		}
+		if (server_stats_pending == 1) {
+			server_stats_pending = 0;
+			server_stats(cfg);
+		}
+		if (server_upgrade_pending == 1) {
+			server_upgrade_pending = 0;
+			if (server_run == 1) {
+				server_upgrade(cfg);
+			}
+		}
+		if (server_flush_pending == 1) {
+			server_flush_pending = 0;
+			if (hits_flush(cfg->_rcfg._hits) == 0) {
+				log_perror(&(cfg->_lcfg), errno, "server: msync");
+			}
+			alarm(HITS_FLUSH_INTERVAL);
+		}
 		if (server_run == 1) {
 			FORKWORKER(
 				"IPv4", cfg->_sock, cfg->_sock6, ipv4, AF_INET
@@ -360,6 +1146,14 @@ void server_loop(const struct server_cfg *cfg) {
 				"IPv6", cfg->_sock6, cfg->_sock, ipv6, AF_INET6
 			);
 		} else if (quitsent == 0) {
+			/* have keep-alive connections close */
+			if (cfg->_rcfg._drain != NULL) {
+				__atomic_store_n(
+					&(cfg->_rcfg._drain->active),
+					1,
+					__ATOMIC_RELAXED
+				);
+			}
 			IPCSEND(ipv4, "quit");
 			IPCSEND(ipv6, "quit");
 			quitsent = 1;
@@ -437,6 +1231,12 @@ void server_loop(const struct server_cfg *cfg) {
 				);
 				break;
 			}
+		} else if (child == cfg->_upgrader) {
+			log_wrn(
+				&(cfg->_lcfg),
+				"server: The upgrade helper [%d] died",
+				child
+			);
 		} else {
 			log_wrn(
 				&(cfg->_lcfg),
@@ -2,6 +2,10 @@
 #define __mekdotlu_server_h
 
 #include "log.h"
+#include "request.h"
+#include "net.h"
+#include "worker.h"
+#include "cpuset.h"
 #include <unistd.h>
 
 struct server_cfg {
@@ -10,10 +14,28 @@ struct server_cfg {
 	uid_t uid;
 	gid_t gid;
 	unsigned short port;
+	/* listening socket options for IPv4 and IPv6 */
+	struct net_opts sockopts[2];
+	/* CPUs of the IPv4 and IPv6 workers, empty if unpinned */
+	struct cpuset cpus[2];
 	/* we'll try to bind to both AF's on INADDR_ANY */
 	int _sock;
 	int _sock6;
+	/* whether to take IPv4 on the IPv6 socket as v4-mapped addresses
+	 * instead, leaving a single worker to serve both
+	 */
+	char dualstack;
+	/* whether SIGUSR2 starts a new binary on the same sockets */
+	char upgrade;
+	/* the arguments to start it with */
+	char **_argv;
+	/* the process that starts it, and our socket to it */
+	pid_t _upgrader;
+	int _upgsock;
+	/* counters of the IPv4 and IPv6 workers */
+	struct worker_stats *_wstats;
 	struct log_cfg _lcfg;
+	struct request_cfg _rcfg;
 };
 
 int server_init(struct server_cfg *cfg);
@@ -23,6 +45,11 @@ void server_loop(const struct server_cfg *cfg);
 
 int server_constrain(const struct server_cfg *cfg);
 
+void server_pin(const struct server_cfg *cfg, const char *name, int af);
+void server_reload(const struct server_cfg *cfg);
+void server_stats(const struct server_cfg *cfg);
+void server_upgrade(const struct server_cfg *cfg);
+
 #endif /* __mekdotlu_server_h */
 
 /* vi: set sts=8 ts=8 sw=8 noexpandtab: */
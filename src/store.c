@@ -0,0 +1,127 @@
+/* writer side of the URL trees
+ *
+ * Redirect files are never written in place. They are written under a
+ * temporary name in the same directory and then renamed into place,
+ * so that readers only ever see complete files and need no locks.
+ */
+#include "store.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* disambiguates temporary files created by the same process */
+static unsigned long store_seq = 0;
+
+/* Creates the missing parent directories of path under rootfd.
+ * Returns 0 on success, -1 on error with errno set.
+ */
+int store_mkdirs(int rootfd, const char *path) {
+	char buf[PATH_MAX];
+	size_t i, len = strlen(path);
+	if (len >= sizeof(buf)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memcpy(buf, path, len + 1);
+	for (i = 1; i < len; i += 1) {
+		if (buf[i] != '/') {
+			continue;
+		}
+		buf[i] = '\0';
+		if (mkdirat(rootfd, buf, 0755) == -1 && errno != EEXIST) {
+			return -1;
+		}
+		buf[i] = '/';
+	}
+	return 0;
+}
+
+/* Publishes len bytes of data as the redirect file at path, relative
+ * to rootfd. The data goes to a dot-prefixed temporary file first,
+ * which is then renamed over path with STORE_REPLACE, or hard linked
+ * to it otherwise so that an existing file fails with EEXIST. The
+ * parent directories must exist. Returns 0 on success, -1 on error
+ * with errno set.
+ */
+int store_publish(
+	int rootfd,
+	const char *path,
+	const char *data,
+	size_t len,
+	int flags
+) {
+	char tmp[PATH_MAX];
+	const char *base = strrchr(path, '/');
+	int fd, ret, storerr;
+	size_t off = 0;
+	/* <dir>/.<name>.<pid>.<seq> */
+	base = (base != NULL) ? &(base[1]) : path;
+	ret = snprintf(
+		tmp,
+		sizeof(tmp),
+		"%.*s.%s.%ld.%lu",
+		(int) (base - path),
+		path,
+		base,
+		(long) getpid(),
+		__atomic_fetch_add(&store_seq, 1, __ATOMIC_RELAXED)
+	);
+	if (ret < 0 || (size_t) ret >= sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	fd = openat(
+		rootfd,
+		tmp,
+		O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+		0644
+	);
+	if (fd == -1) {
+		return -1;
+	}
+	while (off < len) {
+		ssize_t w = write(fd, &(data[off]), len - off);
+		if (w == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			goto fail;
+		}
+		off += w;
+	}
+	if ((flags & STORE_SYNC) && fsync(fd) == -1) {
+		goto fail;
+	}
+	if (close(fd) == -1) {
+		fd = -1;
+		goto fail;
+	}
+	fd = -1;
+	if (flags & STORE_REPLACE) {
+		if (renameat(rootfd, tmp, rootfd, path) == -1) {
+			goto fail;
+		}
+		return 0;
+	}
+	/* link(2) refuses to replace existing files */
+	if (linkat(rootfd, tmp, rootfd, path, 0) == -1) {
+		goto fail;
+	}
+	unlinkat(rootfd, tmp, 0);
+	return 0;
+fail:
+	storerr = errno;
+	if (fd != -1) {
+		close(fd);
+	}
+	unlinkat(rootfd, tmp, 0);
+	errno = storerr;
+	return -1;
+}
+
+/* vi: set sts=8 ts=8 sw=8 noexpandtab: */
@@ -0,0 +1,22 @@
+#ifndef __mekdotlu_store_h
+#define __mekdotlu_store_h
+
+#include <stddef.h>
+
+/* replace an existing redirect file instead of failing with EEXIST */
+#define STORE_REPLACE 0x1
+/* fsync the file before publishing it */
+#define STORE_SYNC 0x2
+
+int store_mkdirs(int rootfd, const char *path);
+int store_publish(
+	int rootfd,
+	const char *path,
+	const char *data,
+	size_t len,
+	int flags
+);
+
+#endif /* __mekdotlu_store_h */
+
+/* vi: set sts=8 ts=8 sw=8 noexpandtab: */
@@ -1,12 +1,141 @@
 #include "request.h"
+#include "urlstore.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
-int main(void) {
+/* redirect files written for the URL store round trip */
+#define TEST_URLS 500
+
+/* the URL test_urlstore() writes for code i */
+void test_url(char *buf, size_t len, int i) {
+	if (i % 3 == 0) {
+		snprintf(buf, len, "http://other.example/%d?q=%x", i, i * 7919);
+	} else {
+		snprintf(buf, len, "https://example.com/page/%d", i);
+	}
+}
+
+/* Writes redirect files into a sharded /e/ tree, stores them in a URL
+ * store and reads every one back, across both arenas. Returns 0 if
+ * all of them round-trip.
+ */
+int test_urlstore(void) {
+	char dir[] = "/tmp/mekdotlu-test.XXXXXX";
+	char name[64], url[URLSTORE_URL_MAX], got[URLSTORE_URL_MAX];
+	struct urlstore *s;
+	int efd, fails = 0, round, i, r;
+	time_t mtime;
+	long n;
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	efd = open(dir, O_RDONLY | O_DIRECTORY);
+	s = urlstore_create(1 << 20);
+	if (efd == -1 || s == NULL) {
+		perror("test_urlstore");
+		return 1;
+	}
+	for (i = 0; i < TEST_URLS; i += 1) {
+		int fd;
+		snprintf(name, sizeof(name), "c%02d", i % 16);
+		mkdirat(efd, name, 0700);
+		snprintf(name, sizeof(name), "c%02d/c%04d", i % 16, i);
+		fd = openat(efd, name, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		test_url(url, sizeof(url), i);
+		/* every tenth carries a policy marker, left to the tree */
+		if (
+			fd == -1 ||
+			write(fd, url, strlen(url)) == -1 ||
+			(i % 10 == 0 && write(fd, "\nmeta\n", 6) == -1)
+		) {
+			perror(name);
+			fails += 1;
+		}
+		if (fd != -1) {
+			close(fd);
+		}
+	}
+	for (round = 0; round < 2; round += 1) {
+		n = urlstore_rebuild(s, efd, -1, 0);
+		printf(
+			"\033[36murls(%d|%ld):\033[0m arena %d\n",
+			round, n, s->active
+		);
+		if (n != TEST_URLS - TEST_URLS / 10) {
+			fails += 1;
+		}
+		for (i = 0; i < TEST_URLS; i += 1) {
+			snprintf(name, sizeof(name), "e/c%04d", i);
+			test_url(url, sizeof(url), i);
+			r = urlstore_get(s, name, got, sizeof(got), &mtime);
+			if (i % 10 == 0) {
+				if (r != -1) {
+					printf("%s: has a marker\n", name);
+					fails += 1;
+				}
+			} else if (
+				r != (int) strlen(url) ||
+				memcmp(got, url, r) != 0
+			) {
+				printf("%s: got %d, want %s\n", name, r, url);
+				fails += 1;
+			}
+		}
+		for (i = 0; i < 3; i += 1) {
+			const char *missing[] = { "e/c", "e/zzz", "i/c0001" };
+			r = urlstore_get(
+				s,
+				missing[i],
+				got,
+				sizeof(got),
+				&mtime
+			);
+			if (r != -1) {
+				printf("%s: stored but missing\n", missing[i]);
+				fails += 1;
+			}
+		}
+	}
+	for (i = 0; i < TEST_URLS; i += 1) {
+		snprintf(name, sizeof(name), "c%02d/c%04d", i % 16, i);
+		unlinkat(efd, name, 0);
+	}
+	for (i = 0; i < 16; i += 1) {
+		snprintf(name, sizeof(name), "c%02d", i);
+		unlinkat(efd, name, AT_REMOVEDIR);
+	}
+	close(efd);
+	rmdir(dir);
+	urlstore_destroy(s);
+	printf(
+		"\033[36murls:\033[0m %s\n",
+		(fails == 0) ? "round trip OK" : "round trip FAILED"
+	);
+	return fails != 0;
+}
+
+int main(int argc, char **argv) {
+	struct request_cfg rcfg;
 	char buf[4096];
 	int r;
+	/* `./test urlstore' round-trips the URL store instead */
+	if (argc > 1 && strcmp(argv[1], "urlstore") == 0) {
+		return test_urlstore();
+	}
+	/* optionally exercise a shard scheme, e.g. `./test h256x2' */
+	memset(&rcfg, 0, sizeof(rcfg));
+	rcfg.shard_len = 3;
+	rcfg.shard_levels = 1;
+	if (argc > 1 && request_shard_parse(argv[1], &rcfg) == 0) {
+		fprintf(stderr, "Could not parse shard scheme: %s\n", argv[1]);
+		return 1;
+	}
 	errno = 0;
 	while ((r = request_getline(buf, sizeof(buf), STDIN_FILENO)) > 0) {
 		struct request_ent rent;
@@ -24,6 +153,7 @@ int main(void) {
 		);
 		errno = 0;
 		memset(&rent, 0, sizeof(rent));
+		rent.cfg = &rcfg;
 		rent.path = strndup(buf, strlen(buf) - 1);
 		r = request_rewrite(&rent);
 		printf(
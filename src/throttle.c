@@ -0,0 +1,168 @@
+#include "throttle.h"
+#include "clock.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* Required for OSX. */
+#ifndef MAP_ANONYMOUS
+#	define MAP_ANONYMOUS MAP_ANON
+#endif
+
+size_t throttle_len(size_t nbuckets) {
+	return sizeof(struct throttle) +
+		nbuckets * THROTTLE_WAYS * sizeof(struct throttle_slot) +
+		nbuckets;
+}
+
+/* Maps a table of THROTTLE_SLOTS clients in shared memory. Returns
+ * NULL on error.
+ */
+struct throttle *throttle_create(double rate, double burst) {
+	struct throttle *t;
+	size_t nbuckets = THROTTLE_SLOTS / THROTTLE_WAYS;
+	t = mmap(
+		NULL,
+		throttle_len(nbuckets),
+		PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS,
+		-1,
+		0
+	);
+	if (t == MAP_FAILED) {
+		return NULL;
+	}
+	memset(t, 0, sizeof(*t));
+	t->rate = rate;
+	t->burst = burst;
+	t->nbuckets = nbuckets;
+	t->_slots = (struct throttle_slot *) &(t[1]);
+	t->_hands = (unsigned char *) &(t->_slots[nbuckets * THROTTLE_WAYS]);
+	return t;
+}
+
+int throttle_destroy(struct throttle *t) {
+	if (t == NULL) {
+		return 1;
+	}
+	return munmap(t, throttle_len(t->nbuckets)) == 0;
+}
+
+/* Parses a rate in the `<rate>[:<burst>]' format, connections per
+ * second and how many may come at once. The burst defaults to twice
+ * the rate. Returns 1 on success, 0 otherwise.
+ */
+int throttle_parse(const char *str, double *rate, double *burst) {
+	double r = 0.0, b = 0.0;
+	int n = 0, m = 0;
+	if (str == NULL || sscanf(str, "%lf%n", &r, &n) != 1 || r <= 0.0) {
+		return 0;
+	}
+	if (str[n] == ':') {
+		if (
+			sscanf(&(str[n + 1]), "%lf%n", &b, &m) != 1 ||
+			b < 1.0
+		) {
+			return 0;
+		}
+		n += 1 + m;
+	} else {
+		b = (r * 2.0 < 1.0) ? 1.0 : r * 2.0;
+	}
+	if (str[n] != '\0') {
+		return 0;
+	}
+	*rate = r;
+	*burst = b;
+	return 1;
+}
+
+/* The key of the client an address belongs to: IPv4 addresses, mapped
+ * ones included, stand on their own, IPv6 ones go by their /64.
+ */
+uint64_t throttle_key(const struct sockaddr *addr) {
+	const unsigned char *b;
+	uint64_t key = 0;
+	size_t i;
+	if (addr->sa_family == AF_INET) {
+		const struct sockaddr_in *a4 =
+			(const struct sockaddr_in *) addr;
+		return 0xffffffff00000000ULL | ntohl(a4->sin_addr.s_addr);
+	}
+	b = ((const struct sockaddr_in6 *) addr)->sin6_addr.s6_addr;
+	if (IN6_IS_ADDR_V4MAPPED(
+		&(((const struct sockaddr_in6 *) addr)->sin6_addr)
+	)) {
+		return 0xffffffff00000000ULL |
+			((uint64_t) b[12] << 24) |
+			((uint64_t) b[13] << 16) |
+			((uint64_t) b[14] << 8) |
+			(uint64_t) b[15];
+	}
+	for (i = 0; i < 8; i += 1) {
+		key = (key << 8) | b[i];
+	}
+	return key;
+}
+
+/* Takes a token from the bucket of the client addr belongs to, making
+ * room for it if need be by evicting the first client the clock hand
+ * of its bucket finds unused since its last pass. Returns 1 if the
+ * connection may go ahead, 0 if the client is over its rate. Only the
+ * worker owning the table may call this.
+ */
+int throttle_check(struct throttle *t, const struct sockaddr *addr) {
+	struct throttle_slot *bucket, *s = NULL;
+	struct timespec tp;
+	uint64_t key = throttle_key(addr);
+	size_t b, i;
+	double now;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	now = (double) tp.tv_sec + (double) tp.tv_nsec / 1000000000.0;
+	__atomic_fetch_add(&(t->checks), 1, __ATOMIC_RELAXED);
+	b = (size_t) ((key * 0x9e3779b97f4a7c15ULL) >> 32) % t->nbuckets;
+	bucket = &(t->_slots[b * THROTTLE_WAYS]);
+	for (i = 0; i < THROTTLE_WAYS; i += 1) {
+		if (bucket[i].used && bucket[i].key == key) {
+			s = &(bucket[i]);
+			break;
+		}
+		if (!bucket[i].used && s == NULL) {
+			s = &(bucket[i]);
+		}
+	}
+	if (s == NULL) {
+		for (;;) {
+			s = &(bucket[t->_hands[b]]);
+			t->_hands[b] = (t->_hands[b] + 1) % THROTTLE_WAYS;
+			if (s->ref == 0) {
+				break;
+			}
+			s->ref = 0;
+		}
+		__atomic_fetch_add(&(t->evictions), 1, __ATOMIC_RELAXED);
+		s->used = 0;
+	}
+	if (!s->used || s->key != key) {
+		s->key = key;
+		s->tokens = t->burst;
+		s->last = now;
+		s->used = 1;
+	}
+	s->ref = 1;
+	s->tokens += (now - s->last) * t->rate;
+	if (s->tokens > t->burst) {
+		s->tokens = t->burst;
+	}
+	s->last = now;
+	if (s->tokens < 1.0) {
+		__atomic_fetch_add(&(t->limited), 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	s->tokens -= 1.0;
+	return 1;
+}
+
+/* vi: set sts=8 ts=8 sw=8 noexpandtab: */
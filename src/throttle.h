@@ -0,0 +1,53 @@
+#ifndef __mekdotlu_throttle_h
+#define __mekdotlu_throttle_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* clients tracked per worker, in buckets of THROTTLE_WAYS */
+#define THROTTLE_SLOTS 65536
+#define THROTTLE_WAYS 4
+
+/* a token bucket of one client address or IPv6 /64 */
+struct throttle_slot {
+	/* the address, IPv4 ones tagged with all ones in the high bits,
+	 * which no IPv6 /64 a connection comes from has
+	 */
+	uint64_t key;
+	double tokens;
+	/* when the bucket was last refilled, in seconds */
+	double last;
+	unsigned char used;
+	/* whether the bucket was used since the clock hand last passed */
+	unsigned char ref;
+};
+
+/* per-client connection rate limits of a worker in shared memory
+ *
+ * each worker has a table of its own, so that there is only ever one
+ * writer; the master merely reads the counters
+ */
+struct throttle {
+	/* tokens added per second, and most a bucket holds */
+	double rate;
+	double burst;
+	size_t nbuckets;
+	/* connections checked, turned away, and clients evicted */
+	unsigned long checks;
+	unsigned long limited;
+	unsigned long evictions;
+	/* clock hand of every bucket */
+	unsigned char *_hands;
+	struct throttle_slot *_slots;
+};
+
+struct throttle *throttle_create(double rate, double burst);
+int throttle_destroy(struct throttle *t);
+int throttle_parse(const char *str, double *rate, double *burst);
+
+int throttle_check(struct throttle *t, const struct sockaddr *addr);
+
+#endif /* __mekdotlu_throttle_h */
+
+/* vi: set sts=8 ts=8 sw=8 noexpandtab: */
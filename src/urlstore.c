@@ -0,0 +1,664 @@
+#include "urlstore.h"
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/* Required for OSX. */
+#ifndef MAP_ANONYMOUS
+#	define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* how deep the trees are walked */
+#define URLSTORE_MAX_DEPTH 8
+/* URLs sampled for the prefix dictionary, and how far into them */
+#define URLSTORE_SAMPLE 65536
+#define URLSTORE_PREFIX_MAX 64
+
+/* a redirect file read on rebuild */
+struct urlstore_ent {
+	char *key;
+	char *url;
+	size_t ulen;
+	uint32_t mtime;
+};
+
+struct urlstore_ents {
+	struct urlstore_ent *ents;
+	size_t n;
+	size_t cap;
+	uint64_t raw;
+};
+
+/* a candidate or chosen dictionary prefix */
+struct urlstore_prefix {
+	const char *p;
+	size_t len;
+	uint64_t score;
+};
+
+/* Maps two arenas of size bytes each in shared memory. Returns NULL on
+ * error.
+ */
+struct urlstore *urlstore_create(size_t size) {
+	struct urlstore *s;
+	if (size < sizeof(struct urlstore_arena)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	s = mmap(
+		NULL,
+		sizeof(*s) + 2 * size,
+		PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS,
+		-1,
+		0
+	);
+	if (s == MAP_FAILED) {
+		return NULL;
+	}
+	memset(s, 0, sizeof(*s));
+	s->size = size;
+	s->_arena[0] = (unsigned char *) &(s[1]);
+	s->_arena[1] = &(s->_arena[0][size]);
+	memset(s->_arena[0], 0, sizeof(struct urlstore_arena));
+	memset(s->_arena[1], 0, sizeof(struct urlstore_arena));
+	return s;
+}
+
+int urlstore_destroy(struct urlstore *s) {
+	if (s == NULL) {
+		return 1;
+	}
+	return munmap(s, sizeof(*s) + 2 * s->size) == 0;
+}
+
+/* Reads the redirect file name under dfd into an entry. Files with a
+ * policy marker are left to the filesystem. Returns 1 if it was added.
+ */
+int urlstore_read(
+	struct urlstore_ents *e,
+	int dfd,
+	const char *name,
+	char tree
+) {
+	char buf[URLSTORE_URL_MAX + 2];
+	struct urlstore_ent *ent;
+	struct stat st;
+	size_t len = 0, nlen = strlen(name);
+	char *nl;
+	ssize_t r = 0;
+	int fd = openat(dfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return 0;
+	}
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return 0;
+	}
+	while (
+		len < sizeof(buf) - 1 &&
+		(r = read(fd, &(buf[len]), sizeof(buf) - 1 - len)) > 0
+	) {
+		len += r;
+	}
+	close(fd);
+	if (r == -1) {
+		return 0;
+	}
+	buf[len] = '\0';
+	nl = memchr(buf, '\n', len);
+	if (nl != NULL) {
+		/* a marker line */
+		if (nl[1] != '\0' && nl[1] != '\r' && nl[1] != '\n') {
+			return 0;
+		}
+		len = nl - buf;
+		if (len > 0 && buf[len - 1] == '\r') {
+			len -= 1;
+		}
+	} else if (len > URLSTORE_URL_MAX) {
+		return 0;
+	}
+	if (e->n == e->cap) {
+		struct urlstore_ent *ents;
+		size_t cap = (e->cap == 0) ? 1024 : e->cap * 2;
+		ents = realloc(e->ents, cap * sizeof(*ents));
+		if (ents == NULL) {
+			return 0;
+		}
+		e->ents = ents;
+		e->cap = cap;
+	}
+	ent = &(e->ents[e->n]);
+	ent->key = malloc(nlen + 3);
+	ent->url = malloc(len + 1);
+	if (ent->key == NULL || ent->url == NULL) {
+		free(ent->key);
+		free(ent->url);
+		return 0;
+	}
+	ent->key[0] = tree;
+	ent->key[1] = '/';
+	memcpy(&(ent->key[2]), name, nlen + 1);
+	memcpy(ent->url, buf, len);
+	ent->url[len] = '\0';
+	ent->ulen = len;
+	ent->mtime = (uint32_t) st.st_mtime;
+	e->raw += nlen + 2 + len;
+	e->n += 1;
+	return 1;
+}
+
+/* collects every redirect file under the directory fd */
+void urlstore_walk(
+	struct urlstore_ents *e,
+	int fd,
+	char tree,
+	int depth,
+	int flat
+) {
+	struct dirent *de;
+	DIR *d;
+	int dfd = openat(fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dfd == -1) {
+		return;
+	}
+	d = fdopendir(dfd);
+	if (d == NULL) {
+		close(dfd);
+		return;
+	}
+	while ((de = readdir(d)) != NULL) {
+		int isdir = 0;
+		if (de->d_name[0] == '.') {
+			continue;
+		}
+#ifdef DT_DIR
+		if (de->d_type == DT_DIR) {
+			isdir = 1;
+		} else if (de->d_type == DT_UNKNOWN)
+#endif
+		{
+			struct stat s;
+			if (fstatat(dfd, de->d_name, &s, 0) == 0) {
+				isdir = S_ISDIR(s.st_mode);
+			}
+		}
+		if (isdir && depth < URLSTORE_MAX_DEPTH) {
+			int sfd = openat(
+				dfd,
+				de->d_name,
+				O_RDONLY | O_DIRECTORY | O_CLOEXEC
+			);
+			if (sfd != -1) {
+				urlstore_walk(e, sfd, tree, depth + 1, flat);
+				close(sfd);
+			}
+		} else if (!isdir && (depth > 0 || flat)) {
+			/* files right under the tree are only reachable
+			 * in flat trees
+			 */
+			urlstore_read(e, dfd, de->d_name, tree);
+		}
+	}
+	closedir(d);
+}
+
+int urlstore_entcmp(const void *a, const void *b) {
+	const struct urlstore_ent *ea = a, *eb = b;
+	return strcmp(ea->key, eb->key);
+}
+
+/* orders prefixes bytewise, shorter ones first */
+int urlstore_prefixcmp(const void *a, const void *b) {
+	const struct urlstore_prefix *pa = a, *pb = b;
+	size_t len = (pa->len < pb->len) ? pa->len : pb->len;
+	int r = memcmp(pa->p, pb->p, len);
+	if (r != 0) {
+		return r;
+	}
+	return (pa->len > pb->len) - (pa->len < pb->len);
+}
+
+int urlstore_scorecmp(const void *a, const void *b) {
+	const struct urlstore_prefix *pa = a, *pb = b;
+	return (pa->score < pb->score) - (pa->score > pb->score);
+}
+
+/* Picks the URL prefixes up to a slash or a dot that save the most
+ * bytes in a sample of the entries, sorted bytewise into dict. Returns
+ * the number picked.
+ */
+size_t urlstore_pick(
+	const struct urlstore_ents *e,
+	struct urlstore_prefix *dict
+) {
+	struct urlstore_prefix *cands;
+	size_t step = e->n / URLSTORE_SAMPLE + 1, ncands = 0, n = 0, i, j;
+	cands = malloc(
+		(e->n / step + 1) * URLSTORE_PREFIX_MAX * sizeof(*cands)
+	);
+	if (cands == NULL) {
+		return 0;
+	}
+	for (i = 0; i < e->n; i += step) {
+		const struct urlstore_ent *ent = &(e->ents[i]);
+		for (j = 2; j < ent->ulen && j < URLSTORE_PREFIX_MAX; j += 1) {
+			if (ent->url[j] == '/' || ent->url[j] == '.') {
+				cands[ncands].p = ent->url;
+				cands[ncands].len = j + 1;
+				ncands += 1;
+			}
+		}
+	}
+	qsort(cands, ncands, sizeof(*cands), urlstore_prefixcmp);
+	/* fold the runs into one scored candidate each */
+	for (i = 0; i < ncands; i = j) {
+		j = i + 1;
+		while (
+			j < ncands &&
+			urlstore_prefixcmp(&(cands[i]), &(cands[j])) == 0
+		) {
+			j += 1;
+		}
+		cands[n] = cands[i];
+		/* every use saves all but the id byte */
+		cands[n].score = (uint64_t) (j - i) * (cands[i].len - 1);
+		n += 1;
+	}
+	qsort(cands, n, sizeof(*cands), urlstore_scorecmp);
+	/* prefixes seen once aren't worth it */
+	for (i = 0; i < n && i < URLSTORE_DICT; i += 1) {
+		if (cands[i].score < (uint64_t) 2 * (cands[i].len - 1)) {
+			break;
+		}
+		dict[i] = cands[i];
+	}
+	free(cands);
+	qsort(dict, i, sizeof(*dict), urlstore_prefixcmp);
+	return i;
+}
+
+/* Returns the index + 1 of the longest prefix of url in dict, 0 if
+ * there is none.
+ */
+size_t urlstore_lookup_prefix(
+	const struct urlstore_prefix *dict,
+	size_t ndict,
+	const char *url,
+	size_t ulen
+) {
+	size_t j = (ulen < URLSTORE_PREFIX_MAX) ? ulen : URLSTORE_PREFIX_MAX;
+	while (j > 2) {
+		j -= 1;
+		if (url[j] == '/' || url[j] == '.') {
+			struct urlstore_prefix k;
+			size_t lo = 0, hi = ndict;
+			k.p = url;
+			k.len = j + 1;
+			while (lo < hi) {
+				size_t mid = lo + (hi - lo) / 2;
+				int r = urlstore_prefixcmp(&k, &(dict[mid]));
+				if (r == 0) {
+					return mid + 1;
+				} else if (r < 0) {
+					hi = mid;
+				} else {
+					lo = mid + 1;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+/* appends v as a LEB128 varint; returns 0 if it doesn't fit */
+int urlstore_putvar(
+	unsigned char *a,
+	size_t size,
+	uint64_t *off,
+	size_t v
+) {
+	do {
+		if (*off >= size) {
+			return 0;
+		}
+		a[*off] = (v & 0x7F) | ((v > 0x7F) ? 0x80 : 0);
+		*off += 1;
+		v >>= 7;
+	} while (v > 0);
+	return 1;
+}
+
+int urlstore_put(
+	unsigned char *a,
+	size_t size,
+	uint64_t *off,
+	const void *p,
+	size_t len
+) {
+	if (size - *off < len) {
+		return 0;
+	}
+	memcpy(&(a[*off]), p, len);
+	*off += len;
+	return 1;
+}
+
+/* Reads a varint at *p, which must end before end. Returns SIZE_MAX if
+ * it doesn't.
+ */
+size_t urlstore_getvar(const unsigned char **p, const unsigned char *end) {
+	size_t v = 0;
+	unsigned int shift = 0;
+	while (*p < end && shift < 64) {
+		unsigned char c = **p;
+		*p += 1;
+		v |= (size_t) (c & 0x7F) << shift;
+		if ((c & 0x80) == 0) {
+			return v;
+		}
+		shift += 7;
+	}
+	return SIZE_MAX;
+}
+
+/* Encodes the sorted entries into the arena a of size bytes. Returns 1
+ * on success, 0 if they don't fit.
+ */
+int urlstore_encode(
+	unsigned char *a,
+	size_t size,
+	const struct urlstore_ents *e,
+	const struct urlstore_prefix *dict,
+	size_t ndict
+) {
+	struct urlstore_arena *hdr = (struct urlstore_arena *) a;
+	uint64_t off = sizeof(*hdr), *index;
+	const char *prev = "";
+	size_t i, n = 0;
+	memset(hdr, 0, sizeof(*hdr));
+	for (i = 0; i < ndict; i += 1) {
+		hdr->dict[i + 1] = (uint32_t) off;
+		hdr->dictlen[i + 1] = (uint16_t) dict[i].len;
+		if (urlstore_put(a, size, &off, dict[i].p, dict[i].len) == 0) {
+			return 0;
+		}
+	}
+	/* the index goes after the blocks once their offsets are known */
+	index = malloc((e->n / URLSTORE_BLOCK + 1) * sizeof(*index));
+	if (index == NULL) {
+		return 0;
+	}
+	for (i = 0; i < e->n; i += 1) {
+		const struct urlstore_ent *ent = &(e->ents[i]);
+		size_t shared = 0, klen = strlen(ent->key), id;
+		unsigned char mt[4];
+		if (i > 0 && strcmp(ent->key, prev) == 0) {
+			/* the same code in two shard directories */
+			continue;
+		}
+		if (n % URLSTORE_BLOCK == 0) {
+			index[n / URLSTORE_BLOCK] = off;
+		} else {
+			while (
+				ent->key[shared] != '\0' &&
+				ent->key[shared] == prev[shared]
+			) {
+				shared += 1;
+			}
+		}
+		id = urlstore_lookup_prefix(dict, ndict, ent->url, ent->ulen);
+		mt[0] = ent->mtime & 0xFF;
+		mt[1] = (ent->mtime >> 8) & 0xFF;
+		mt[2] = (ent->mtime >> 16) & 0xFF;
+		mt[3] = (ent->mtime >> 24) & 0xFF;
+		if (
+			urlstore_putvar(a, size, &off, shared) == 0 ||
+			urlstore_putvar(a, size, &off, klen - shared) == 0 ||
+			urlstore_put(
+				a,
+				size,
+				&off,
+				&(ent->key[shared]),
+				klen - shared
+			) == 0 ||
+			urlstore_putvar(a, size, &off, id) == 0 ||
+			urlstore_putvar(
+				a,
+				size,
+				&off,
+				ent->ulen - hdr->dictlen[id]
+			) == 0 ||
+			urlstore_put(
+				a,
+				size,
+				&off,
+				&(ent->url[hdr->dictlen[id]]),
+				ent->ulen - hdr->dictlen[id]
+			) == 0 ||
+			urlstore_put(a, size, &off, mt, sizeof(mt)) == 0
+		) {
+			free(index);
+			return 0;
+		}
+		prev = ent->key;
+		n += 1;
+	}
+	hdr->entries = n;
+	hdr->blocks = (n + URLSTORE_BLOCK - 1) / URLSTORE_BLOCK;
+	/* align the index */
+	off = (off + sizeof(*index) - 1) & ~(uint64_t) (sizeof(*index) - 1);
+	if (off > size || hdr->blocks * sizeof(*index) > size - off) {
+		free(index);
+		return 0;
+	}
+	hdr->index = off;
+	memcpy(&(a[off]), index, hdr->blocks * sizeof(*index));
+	hdr->used = off + hdr->blocks * sizeof(*index);
+	hdr->raw = e->raw;
+	free(index);
+	return 1;
+}
+
+/* Rebuilds the inactive arena from the /e/ and /i/ tree directories,
+ * flat ones if the shard scheme has no levels, and makes it the active
+ * one. Only one process may rebuild at a time.
+ * Returns the number of entries stored, or -1 with errno set to
+ * ENOSPC if they don't fit, in which case the active arena is kept.
+ */
+long urlstore_rebuild(struct urlstore *s, int efd, int ifd, int flat) {
+	struct urlstore_prefix dict[URLSTORE_DICT];
+	struct urlstore_ents e;
+	int next = !s->active, ok;
+	size_t ndict, i;
+	memset(&e, 0, sizeof(e));
+	if (efd != -1) {
+		urlstore_walk(&e, efd, 'e', 0, flat);
+	}
+	if (ifd != -1) {
+		urlstore_walk(&e, ifd, 'i', 0, flat);
+	}
+	qsort(e.ents, e.n, sizeof(*(e.ents)), urlstore_entcmp);
+	ndict = urlstore_pick(&e, dict);
+	/* readers still in this arena from before the last swap retry */
+	__atomic_fetch_add(&(s->gen), 1, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	ok = urlstore_encode(s->_arena[next], s->size, &e, dict, ndict);
+	for (i = 0; i < e.n; i += 1) {
+		free(e.ents[i].key);
+		free(e.ents[i].url);
+	}
+	free(e.ents);
+	if (!ok) {
+		errno = ENOSPC;
+		return -1;
+	}
+	__atomic_store_n(&(s->active), next, __ATOMIC_RELEASE);
+	return (long) ((struct urlstore_arena *) s->_arena[next])->entries;
+}
+
+/* compares key to the klen bytes at k the way strcmp() would */
+int urlstore_keycmp(
+	const char *key,
+	const unsigned char *k,
+	size_t klen
+) {
+	size_t len = strlen(key);
+	int r = memcmp(key, k, (len < klen) ? len : klen);
+	if (r != 0) {
+		return r;
+	}
+	return (len > klen) - (len < klen);
+}
+
+/* Decodes the URL for key from the arena a of size bytes into buf,
+ * which holds len bytes, and its file's modification time into mtime.
+ * A rebuild may be rewriting the arena, so every offset is checked.
+ * Returns the URL length, or -1 if the key is not found or the URL
+ * doesn't fit.
+ */
+int urlstore_find(
+	const unsigned char *a,
+	size_t size,
+	const char *key,
+	char *buf,
+	size_t len,
+	time_t *mtime
+) {
+	const struct urlstore_arena *hdr = (const struct urlstore_arena *) a;
+	const unsigned char *p, *end;
+	unsigned char kbuf[PATH_MAX];
+	uint64_t used = hdr->used, index = hdr->index, off;
+	uint64_t entries = hdr->entries, blocks = hdr->blocks;
+	size_t lo = 0, hi, i, klen = 0;
+	if (
+		blocks == 0 ||
+		used > size ||
+		index > used ||
+		blocks > (used - index) / sizeof(off)
+	) {
+		return -1;
+	}
+	end = &(a[used]);
+	/* the last block starting at or before key */
+	hi = blocks;
+	while (lo + 1 < hi) {
+		size_t mid = lo + (hi - lo) / 2, n;
+		memcpy(&off, &(a[index + mid * sizeof(off)]), sizeof(off));
+		if (off >= used) {
+			return -1;
+		}
+		p = &(a[off]);
+		urlstore_getvar(&p, end);
+		n = urlstore_getvar(&p, end);
+		if (n > (size_t) (end - p)) {
+			return -1;
+		}
+		if (urlstore_keycmp(key, p, n) < 0) {
+			hi = mid;
+		} else {
+			lo = mid;
+		}
+	}
+	memcpy(&off, &(a[index + lo * sizeof(off)]), sizeof(off));
+	if (off >= used) {
+		return -1;
+	}
+	p = &(a[off]);
+	for (
+		i = lo * URLSTORE_BLOCK;
+		i < entries && i < (lo + 1) * URLSTORE_BLOCK;
+		i += 1
+	) {
+		size_t shared, n, id, ulen, dlen;
+		uint32_t doff;
+		int r;
+		shared = urlstore_getvar(&p, end);
+		n = urlstore_getvar(&p, end);
+		if (
+			shared > klen ||
+			n > (size_t) (end - p) ||
+			n > sizeof(kbuf) - shared
+		) {
+			return -1;
+		}
+		memcpy(&(kbuf[shared]), p, n);
+		klen = shared + n;
+		p += n;
+		id = urlstore_getvar(&p, end);
+		ulen = urlstore_getvar(&p, end);
+		if (
+			id > URLSTORE_DICT ||
+			ulen > (size_t) (end - p) ||
+			(size_t) (end - p) - ulen < 4
+		) {
+			return -1;
+		}
+		r = urlstore_keycmp(key, kbuf, klen);
+		if (r < 0) {
+			return -1;
+		} else if (r > 0) {
+			p += ulen + 4;
+			continue;
+		}
+		doff = hdr->dict[id];
+		dlen = hdr->dictlen[id];
+		if (doff > used || dlen > used - doff || dlen + ulen > len) {
+			return -1;
+		}
+		memcpy(buf, &(a[doff]), dlen);
+		memcpy(&(buf[dlen]), p, ulen);
+		p += ulen;
+		*mtime = (time_t) (
+			(uint32_t) p[0] |
+			((uint32_t) p[1] << 8) |
+			((uint32_t) p[2] << 16) |
+			((uint32_t) p[3] << 24)
+		);
+		return (int) (dlen + ulen);
+	}
+	return -1;
+}
+
+/* Decodes the URL for key into buf, which holds len bytes, and its
+ * file's modification time into mtime. Returns the URL length, or -1
+ * if the key is not stored, the URL doesn't fit or rebuilds kept
+ * getting in the way.
+ */
+int urlstore_get(
+	struct urlstore *s,
+	const char *key,
+	char *buf,
+	size_t len,
+	time_t *mtime
+) {
+	const unsigned char *a;
+	unsigned int gen, tries;
+	int r = -1;
+	__atomic_fetch_add(&(s->lookups), 1, __ATOMIC_RELAXED);
+	for (tries = 0; tries < URLSTORE_TRIES; tries += 1) {
+		gen = __atomic_load_n(&(s->gen), __ATOMIC_ACQUIRE);
+		a = s->_arena[__atomic_load_n(&(s->active), __ATOMIC_ACQUIRE)];
+		r = urlstore_find(a, s->size, key, buf, len, mtime);
+		/* a rebuild got in the way */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&(s->gen), __ATOMIC_RELAXED) == gen) {
+			break;
+		}
+		r = -1;
+	}
+	if (r >= 0) {
+		__atomic_fetch_add(&(s->hits), 1, __ATOMIC_RELAXED);
+	}
+	return r;
+}
+
+/* vi: set sts=8 ts=8 sw=8 noexpandtab: */
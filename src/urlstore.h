@@ -0,0 +1,72 @@
+#ifndef __mekdotlu_urlstore_h
+#define __mekdotlu_urlstore_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* entries per front-coded block */
+#define URLSTORE_BLOCK 16
+/* shared URL prefixes kept, ids 1 through URLSTORE_DICT */
+#define URLSTORE_DICT 255
+/* longest URL stored */
+#define URLSTORE_URL_MAX 2048
+/* lookups raced by a rebuild before giving up */
+#define URLSTORE_TRIES 3
+
+/* the header of an arena, followed by the prefix dictionary, the
+ * blocks and an index of block offsets
+ *
+ * within a block, each entry is
+ *     <shared key bytes> <key suffix length> <key suffix>
+ *     <dictionary id> <URL suffix length> <URL suffix> <mtime>
+ * with lengths as LEB128 varints and the mtime as 4 bytes; the first
+ * entry of a block shares nothing with the one before it
+ */
+struct urlstore_arena {
+	uint64_t entries;
+	uint64_t blocks;
+	/* bytes in use, and bytes the keys and URLs take up as is */
+	uint64_t used;
+	uint64_t raw;
+	/* offset of the block index */
+	uint64_t index;
+	/* dictionary prefix offsets and lengths, [0] is the empty one */
+	uint32_t dict[URLSTORE_DICT + 1];
+	uint16_t dictlen[URLSTORE_DICT + 1];
+};
+
+/* a compact resident copy of the URL trees in shared memory, keyed by
+ * `<tree>/<code>' as in the Bloom filter
+ *
+ * like the Bloom filter, it has two arenas, one of which is rebuilt
+ * and swapped in at a time; a reader still in the old arena when the
+ * next rebuild starts sees gen change and retries
+ */
+struct urlstore {
+	/* bytes per arena */
+	size_t size;
+	int active;
+	/* bumped before each rebuild writes the inactive arena */
+	unsigned int gen;
+	/* lookups, and lookups answered */
+	unsigned long lookups;
+	unsigned long hits;
+	unsigned char *_arena[2];
+};
+
+struct urlstore *urlstore_create(size_t size);
+int urlstore_destroy(struct urlstore *s);
+
+long urlstore_rebuild(struct urlstore *s, int efd, int ifd, int flat);
+int urlstore_get(
+	struct urlstore *s,
+	const char *key,
+	char *buf,
+	size_t len,
+	time_t *mtime
+);
+
+#endif /* __mekdotlu_urlstore_h */
+
+/* vi: set sts=8 ts=8 sw=8 noexpandtab: */
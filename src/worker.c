@@ -3,23 +3,229 @@
 #include "net.h"
 #include "request.h"
 #include "clock.h"
+#include "cpuset.h"
+#include "coro.h"
 #include <unistd.h>
 #include <stdlib.h>
 #include <poll.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 
-/* maximum number of request forks per worker */
-#define MAX_REQ_CHILDREN 8
+/* how long to wait before checking on children again while the limit
+ * holds connections back, in milliseconds
+ */
+#define WORKER_HELD_POLL 5
+/* most connections shed per wakeup */
+#define WORKER_SHED_BATCH 64
+/* most connections accepted per wakeup */
+#define WORKER_ACCEPT_BUDGET 64
 
-void worker_loop(const struct log_cfg *lcfg, int ipcsock, int af, int sockfd) {
-	/* only touch forks_avail from this worker, not its child */
-	int pollret = -1, forks_avail = MAX_REQ_CHILDREN, ret = EXIT_SUCCESS;
-	const char *worker_name = (af == AF_INET) ? "ipv4" : "ipv6";
-	struct pollfd pfd[2];
+/* records a request child in the first free slot */
+void worker_track(pid_t *children, size_t n, pid_t pid) {
+	size_t i;
+	for (i = 0; i < n; i += 1) {
+		if (children[i] == 0) {
+			children[i] = pid;
+			return;
+		}
+	}
+}
+
+/* forgets a reaped request child */
+void worker_untrack(pid_t *children, size_t n, pid_t pid) {
+	size_t i;
+	for (i = 0; i < n; i += 1) {
+		if (children[i] == pid) {
+			children[i] = 0;
+			return;
+		}
+	}
+}
+
+/* Waits for the request children to finish their connections, which
+ * they close at the next response boundary or while idle. Whatever is
+ * left at the drain deadline gets killed.
+ */
+void worker_drain(
+	const struct log_cfg *lcfg,
+	const struct request_cfg *rcfg,
+	const char *worker_name,
+	pid_t *children,
+	size_t n
+) {
+	struct timespec tp_b, tp_n;
+	unsigned long drained = 0, killed = 0;
+	long timeout = (rcfg != NULL) ? rcfg->drain_timeout : 0;
+	size_t i;
+	clock_gettime(CLOCK_MONOTONIC, &tp_b);
+	for (;;) {
+		pid_t done = waitpid(-1, NULL, WNOHANG);
+		if (done > 0) {
+			worker_untrack(children, n, done);
+			drained += 1;
+			continue;
+		} else if (done == -1) {
+			/* no children left */
+			break;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &tp_n);
+		if (
+			(double) tp_n.tv_sec - (double) tp_b.tv_sec +
+			(
+				(double) tp_n.tv_nsec -
+				(double) tp_b.tv_nsec
+			) / (double) 1000000000.0 >= (double) timeout
+		) {
+			for (i = 0; i < n; i += 1) {
+				if (
+					children[i] != 0 &&
+					kill(children[i], SIGKILL) == 0
+				) {
+					killed += 1;
+				}
+			}
+			for (;wait(NULL) > 0;);
+			break;
+		}
+		poll(NULL, 0, 50);
+	}
+	log_reg(
+		lcfg,
+		"%s: Drained %lu connections, killed %lu at the %lds deadline",
+		worker_name,
+		drained,
+		killed,
+		timeout
+	);
+}
+
+/* Runs the coroutines until they have finished their connections or
+ * the drain deadline passes, abandoning whatever is left.
+ */
+void worker_coro_drain(
+	const struct log_cfg *lcfg,
+	const struct request_cfg *rcfg,
+	const char *worker_name,
+	struct coro_sched *s
+) {
+	struct timespec tp_b, tp_n;
+	struct pollfd pfd;
+	unsigned int start = s->count;
+	long timeout = rcfg->drain_timeout;
+	clock_gettime(CLOCK_MONOTONIC, &tp_b);
+	pfd.fd = s->epfd;
+	pfd.events = POLLIN;
+	while (s->count > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &tp_n);
+		if (
+			(double) tp_n.tv_sec - (double) tp_b.tv_sec +
+			(
+				(double) tp_n.tv_nsec -
+				(double) tp_b.tv_nsec
+			) / (double) 1000000000.0 >= (double) timeout
+		) {
+			break;
+		}
+		pfd.revents = 0;
+		poll(&pfd, 1, coro_timeout(s, 50));
+		coro_run(s);
+	}
+	log_reg(
+		lcfg,
+		"%s: Drained %u connections, abandoned %u at the %lds deadline",
+		worker_name,
+		start - s->count,
+		s->count,
+		timeout
+	);
+}
+
+/* accepts a connection only to answer it with the overload response */
+void worker_shed(
+	const struct log_cfg *lcfg,
+	const struct request_cfg *rcfg,
+	int sockfd,
+	int af,
+	const char *worker_name
+) {
+	union {
+		struct sockaddr_in addr4;
+		struct sockaddr_in6 addr6;
+	} a;
+	int sock;
+	errno = 0;
+	sock = net_accept(
+		lcfg,
+		sockfd,
+		af,
+		(af == AF_INET) ?
+			(struct sockaddr *) &(a.addr4) :
+			(struct sockaddr *) &(a.addr6)
+	);
+	if (sock == -1) {
+		return;
+	}
+	request_put_refusal(lcfg, &(rcfg->_overload), sock);
+	errno = 0;
+	if (close(sock) == -1) {
+		log_perror(lcfg, errno, "%s: close", worker_name);
+	}
+}
+
+/* a connection served by a coroutine of the worker */
+struct worker_coro {
+	const struct log_cfg *lcfg;
+	const struct request_cfg *rcfg;
+	struct limit *lim;
+	struct pool_conn conn;
+};
+
+/* serves a connection in a coroutine, giving its slot back after */
+void worker_serve(void *arg) {
+	struct worker_coro *wc = arg;
+	struct timespec tp;
+	double dt;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	dt = (double) tp.tv_sec - (double) wc->conn.accepted.tv_sec + (
+		(double) tp.tv_nsec -
+		(double) wc->conn.accepted.tv_nsec
+	) / (double) 1000000000.0;
+	request_process(
+		wc->lcfg,
+		wc->rcfg,
+		wc->conn.sock,
+		dt,
+		(struct sockaddr *) &(wc->conn.addr)
+	);
+	limit_release(wc->lim);
+	free(wc);
+}
+
+/* Accepts a connection and forks a child to handle it, with a slot of
+ * the limit already taken for it, or queues it for the thread pool or
+ * starts a coroutine for it if the worker has either. Returns 1 if a
+ * connection was handed off, 2 if it failed or was turned away but the
+ * next may work, 0 once the queue is empty and -1 on fatal errors; the
+ * slot is released unless a child or coroutine got it.
+ */
+int worker_accept(
+	const struct log_cfg *lcfg,
+	const struct request_cfg *rcfg,
+	int sockfd,
+	int af,
+	const char *worker_name,
+	struct limit *lim,
+	struct pool *pool,
+	struct coro_sched *sched,
+	pid_t *children,
+	size_t nchildren
+) {
+	int sockpass;
+	pid_t child;
 	/* how long the worker took to send the request down the chain */
 	struct timespec tp_b, tp_e;
 	double dt;
@@ -27,6 +233,199 @@ void worker_loop(const struct log_cfg *lcfg, int ipcsock, int af, int sockfd) {
 		struct sockaddr_in addr4;
 		struct sockaddr_in6 addr6;
 	} a;
+	clock_gettime(CLOCK_MONOTONIC, &tp_b);
+	errno = 0;
+	sockpass = net_accept(
+		lcfg,
+		sockfd,
+		af,
+		(af == AF_INET) ?
+			(struct sockaddr *) &(a.addr4) :
+			(struct sockaddr *) &(a.addr6)
+	);
+	if (sockpass == -1) {
+		int die;
+		limit_release(lim);
+		switch (errno) {
+		case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+		case EWOULDBLOCK:
+#endif
+			return 0;
+		case EPROTO:
+		case ENOPROTOOPT:
+		case EHOSTDOWN:
+#ifdef ENONET
+		case ENONET:
+#endif
+		case EHOSTUNREACH:
+		case EOPNOTSUPP:
+		case ENETUNREACH:
+		case ECONNABORTED:
+			die = 0;
+			break;
+		default:
+			die = 1;
+		}
+		return die ? -1 : 2;
+	}
+	/* turn clients over their rate away before they cost a fork */
+	if (
+		rcfg->_throttle[(af == AF_INET6) ? 1 : 0] != NULL &&
+		throttle_check(
+			rcfg->_throttle[(af == AF_INET6) ? 1 : 0],
+			(af == AF_INET) ?
+				(struct sockaddr *) &(a.addr4) :
+				(struct sockaddr *) &(a.addr6)
+		) == 0
+	) {
+		request_put_refusal(lcfg, &(rcfg->_throttled), sockpass);
+		close(sockpass);
+		limit_release(lim);
+		return 2;
+	}
+	if (pool != NULL) {
+		struct pool_conn c;
+		c.sock = sockpass;
+		c.accepted = tp_b;
+		memcpy(&(c.addr), &a, sizeof(a));
+		if (pool_push(pool, &c) == 0) {
+			__atomic_fetch_add(
+				&(pool->stats->overflows),
+				1,
+				__ATOMIC_RELAXED
+			);
+			request_put_refusal(lcfg, &(rcfg->_overload), sockpass);
+			close(sockpass);
+			return 2;
+		}
+		return 1;
+	}
+	if (sched != NULL) {
+		struct worker_coro *wc = malloc(sizeof(*wc));
+		errno = 0;
+		if (wc != NULL) {
+			wc->lcfg = lcfg;
+			wc->rcfg = rcfg;
+			wc->lim = lim;
+			wc->conn.sock = sockpass;
+			wc->conn.accepted = tp_b;
+			memcpy(&(wc->conn.addr), &a, sizeof(a));
+		}
+		/* it runs until it first has to wait on the client */
+		if (wc == NULL || coro_spawn(sched, worker_serve, wc) == 0) {
+			log_perror(lcfg, errno, "%s: coro_spawn", worker_name);
+			free(wc);
+			close(sockpass);
+			limit_release(lim);
+			return 2;
+		}
+		return 1;
+	}
+	errno = 0;
+	child = fork();
+	if (child == 0) {
+		int childret;
+		/* Calculate wait time */
+		clock_gettime(CLOCK_MONOTONIC, &tp_e);
+		dt = (double) (
+			(double) tp_e.tv_sec - (double) tp_b.tv_sec +
+			(
+				(double) tp_e.tv_nsec -
+				(double) tp_b.tv_nsec
+			) / (double) 1000000000.0
+		);
+		/* We won't be needing this anymore, close it
+		 * so we won't run out of file descriptors
+		 */
+		close(sockfd);
+		if (rcfg->follow_cpu) {
+			cpuset_follow(sockpass);
+		}
+		/* Handle the request */
+		childret = request_process(
+			lcfg,
+			rcfg,
+			sockpass,
+			dt,
+			(af == AF_INET) ?
+				(struct sockaddr *) &(a.addr4) :
+				(struct sockaddr *) &(a.addr6)
+		);
+		/* Exit with child's status */
+		exit(childret);
+	} else if (child == -1) {
+		log_perror(
+			lcfg,
+			errno,
+			"%s: fork",
+			worker_name
+		);
+		limit_release(lim);
+	} else {
+		worker_track(children, nchildren, child);
+	}
+	/* Close the worker-side part of the socket */
+	close(sockpass);
+	return 1;
+}
+
+/* counts a wakeup that accepted n connections in the histogram */
+void worker_batch(struct worker_stats *stats, unsigned int n) {
+	size_t bucket = 0;
+	if (stats == NULL) {
+		return;
+	}
+	for (; n > 0 && bucket < WORKER_BATCH_BUCKETS - 1; n >>= 1) {
+		bucket += 1;
+	}
+	__atomic_fetch_add(&(stats->batches[bucket]), 1, __ATOMIC_RELAXED);
+}
+
+/* copies the counters of the coroutines where the master can see them */
+void worker_coro_stats(
+	struct worker_stats *stats,
+	const struct coro_sched *s
+) {
+	if (stats == NULL) {
+		return;
+	}
+	__atomic_store_n(&(stats->coro.running), s->count, __ATOMIC_RELAXED);
+	__atomic_store_n(&(stats->coro.spawned), s->spawned, __ATOMIC_RELAXED);
+	__atomic_store_n(
+		&(stats->coro.switches),
+		s->switches,
+		__ATOMIC_RELAXED
+	);
+	__atomic_store_n(
+		&(stats->coro.timeouts),
+		s->timeouts,
+		__ATOMIC_RELAXED
+	);
+}
+
+void worker_loop(
+	const struct log_cfg *lcfg,
+	const struct request_cfg *rcfg,
+	struct worker_stats *stats,
+	int ipcsock,
+	int af,
+	int sockfd
+) {
+	int pollret = -1, held = 0, acc = 0, ret = EXIT_SUCCESS;
+	unsigned int tries, accepted;
+	/* only touch the limit from this worker, its children merely
+	 * report their latency
+	 */
+	struct limit *lim;
+	/* threads to hand connections to instead of forking */
+	struct pool *pool = NULL;
+	/* or coroutines to serve them on this thread */
+	struct coro_sched *sched = NULL;
+	pid_t *children;
+	size_t nchildren;
+	const char *worker_name = (af == AF_INET) ? "ipv4" : "ipv6";
+	struct pollfd pfd[3];
 	if (af != AF_INET && af != AF_INET6) {
 		log_err(
 			lcfg,
@@ -35,6 +434,49 @@ void worker_loop(const struct log_cfg *lcfg, int ipcsock, int af, int sockfd) {
 		);
 		return;
 	}
+	lim = &(rcfg->_limit[(af == AF_INET6) ? 1 : 0]);
+	/* a respawned worker starts afresh */
+	lim->inflight = 0;
+	nchildren = lim->max;
+	children = calloc(nchildren, sizeof(*children));
+	if (children == NULL) {
+		log_perror(lcfg, errno, "%s: calloc", worker_name);
+		return;
+	}
+	if (rcfg->threads > 0) {
+		errno = 0;
+		pool = pool_create(
+			lcfg,
+			rcfg,
+			(stats != NULL) ? &(stats->pool) : NULL,
+			rcfg->threads,
+			rcfg->queue
+		);
+		if (pool == NULL) {
+			log_perror(lcfg, errno, "%s: pool_create", worker_name);
+			free(children);
+			return;
+		}
+	}
+	if (rcfg->coro_stack > 0) {
+		struct sigaction sa;
+		errno = 0;
+		sched = coro_sched_create((size_t) rcfg->coro_stack * 1024);
+		if (sched == NULL) {
+			log_perror(
+				lcfg,
+				errno,
+				"%s: coro_sched_create",
+				worker_name
+			);
+			free(children);
+			return;
+		}
+		/* a closed connection mustn't take the whole worker down */
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = SIG_IGN;
+		sigaction(SIGPIPE, &sa, NULL);
+	}
 	errno = 0;
 	/* the socket to listen to incoming connections */
 	pfd[0].fd = sockfd;
@@ -42,36 +484,76 @@ void worker_loop(const struct log_cfg *lcfg, int ipcsock, int af, int sockfd) {
 	/* ipc */
 	pfd[1].fd = ipcsock;
 	pfd[1].events = POLLIN;
+	/* connections of the coroutines */
+	pfd[2].fd = (sched != NULL) ? sched->epfd : -1;
+	pfd[2].events = POLLIN;
 	log_ok(
 		lcfg,
-		"%s worker ready, PID %d",
+		"%s worker ready, PID %d, %u threads",
 		(af == AF_INET) ? "IPv4" : "IPv6",
-		(int) getpid()
+		(int) getpid(),
+		(pool != NULL) ? pool->nthreads : 0
 	);
 	for (;;) {
-		int sockpass;
-		pid_t child = -1;
+		pid_t done;
+		/* leave waiting connections in the backlog while the limit
+		 * holds them back, but keep reading IPC
+		 */
+		pfd[0].events = held ? 0 : POLLIN;
 		pfd[0].revents = 0;
 		pfd[1].revents = 0;
+		pfd[2].revents = 0;
 		errno = 0;
+		pollret = poll(
+			pfd,
+			(sched != NULL) ? 3 : 2,
+			coro_timeout(sched, held ? WORKER_HELD_POLL : 250)
+		);
+		if (sched != NULL) {
+			coro_run(sched);
+			worker_coro_stats(stats, sched);
+		}
+		/* clean up children without blocking */
 		while (
-			(pollret = poll(pfd, 2, 250)) == 0 ||
-			forks_avail == 0
+			sched == NULL &&
+			lim->inflight > 0 &&
+			(done = waitpid(-1, NULL, WNOHANG)) > 0
 		) {
-			/* clean up children; block if forks_avail == 0
-			 * no need to wait if forks_avail == MAX_REQ_CHILDREN
-			 */
-			while (
-				forks_avail < MAX_REQ_CHILDREN &&
-				waitpid(
-					-1,
-					NULL,
-					(forks_avail == 0) ? 0 : WNOHANG
-				) > 0
-			) {
-				forks_avail += 1;
+			worker_untrack(children, nchildren, done);
+			limit_release(lim);
+		}
+		limit_update(lim);
+		/* turn connections away while the limit holds them back
+		 * too long, a batch at a time to keep reading IPC
+		 */
+		if (held) {
+			struct pollfd lpfd;
+			int shed, pending;
+			lpfd.fd = sockfd;
+			lpfd.events = POLLIN;
+			for (shed = 0; shed < WORKER_SHED_BATCH; shed += 1) {
+				lpfd.revents = 0;
+				pending = poll(&lpfd, 1, 0) > 0;
+				if (limit_shed(lim, pending) == 0) {
+					break;
+				}
+				worker_shed(
+					lcfg,
+					rcfg,
+					sockfd,
+					af,
+					worker_name
+				);
 			}
-			errno = 0;
+		} else if (pfd[0].events != 0 && pfd[0].revents == 0) {
+			/* the backlog is empty */
+			limit_shed(lim, 0);
+		}
+		if (held && lim->inflight < lim->cur) {
+			held = 0;
+		}
+		if (pollret == 0) {
+			continue;
 		}
 		/* handle polling error */
 		if (pollret == -1) {
@@ -157,80 +639,41 @@ void worker_loop(const struct log_cfg *lcfg, int ipcsock, int af, int sockfd) {
 		if (pfd[0].revents == 0) {
 			continue;
 		}
-		forks_avail -= 1;
-		clock_gettime(CLOCK_MONOTONIC, &tp_b);
-		errno = 0;
-		sockpass = net_accept(
-			lcfg,
-			sockfd,
-			af,
-			(af == AF_INET) ?
-				(struct sockaddr *) &(a.addr4) :
-				(struct sockaddr *) &(a.addr6)
-		);
-		if (sockpass == -1) {
-			int die;
-			switch (errno) {
-			case EAGAIN:
-			case EPROTO:
-			case ENOPROTOOPT:
-			case EHOSTDOWN:
-#ifdef ENONET
-			case ENONET:
-#endif
-			case EHOSTUNREACH:
-			case EOPNOTSUPP:
-			case ENETUNREACH:
-				die = 0;
+		/* drain the accept queue, up to a budget so that IPC and
+		 * children get looked at in between
+		 */
+		for (tries = 0, accepted = 0; tries < WORKER_ACCEPT_BUDGET; ) {
+			/* the pool bounds its own concurrency */
+			if (pool == NULL && limit_acquire(lim) == 0) {
+				held = 1;
 				break;
-			default:
-				die = 1;
 			}
-			if (die) {
-				ret = EXIT_FAILURE;
+			acc = worker_accept(
+				lcfg,
+				rcfg,
+				sockfd,
+				af,
+				worker_name,
+				lim,
+				pool,
+				sched,
+				children,
+				nchildren
+			);
+			if (acc <= 0) {
 				break;
 			}
-			continue;
+			tries += 1;
+			accepted += (acc == 1);
 		}
-		/* wait for a fork slot */
-		errno = 0;
-		child = fork();
-		if (child == 0) {
-			int childret;
-			/* Calculate wait time */
-			clock_gettime(CLOCK_MONOTONIC, &tp_e);
-			dt = (double) (
-				(double) tp_e.tv_sec - (double) tp_b.tv_sec +
-				(
-					(double) tp_e.tv_nsec -
-					(double) tp_b.tv_nsec
-				) / (double) 1000000000.0
-			);
-			/* We won't be needing this anymore, close it
-			 * so we won't run out of file descriptors
-			 */
-			close(sockfd);
-			/* Handle the request */
-			childret = request_process(
-				lcfg,
-				sockpass,
-				dt,
-				(af == AF_INET) ?
-					(struct sockaddr *) &(a.addr4) :
-					(struct sockaddr *) &(a.addr6)
-			);
-			/* Exit with child's status */
-			exit(childret);
-		} else if (child == -1) {
-			log_perror(
-				lcfg,
-				errno,
-				"%s: fork",
-				worker_name
-			);
+		if (accepted > 0) {
+			limit_accepted(lim);
+		}
+		worker_batch(stats, accepted);
+		if (acc == -1) {
+			ret = EXIT_FAILURE;
+			break;
 		}
-		/* Close the worker-side part of the socket */
-		close(sockpass);
 		errno = 0;
 	}
 	log_reg(
@@ -239,7 +682,14 @@ void worker_loop(const struct log_cfg *lcfg, int ipcsock, int af, int sockfd) {
 		worker_name,
 		"Waiting for children to terminate"
 	);
-	for (;wait(NULL) > 0;);
+	if (pool != NULL) {
+		pool_drain(pool, worker_name, rcfg->drain_timeout);
+	} else if (sched != NULL) {
+		worker_coro_drain(lcfg, rcfg, worker_name, sched);
+	} else {
+		worker_drain(lcfg, rcfg, worker_name, children, nchildren);
+	}
+	free(children);
 	log_reg(
 		lcfg,
 		"%s: %s",
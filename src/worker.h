@@ -2,8 +2,37 @@
 #define __mekdotlu_worker_h
 
 #include "log.h"
+#include "request.h"
+#include "pool.h"
 
-void worker_loop(const struct log_cfg *lcfg, int ipcsock, int af, int sockfd);
+/* buckets of the accept batch histogram: nothing, 1, 2-3, 4-7, and so
+ * on, the last one holding everything larger
+ */
+#define WORKER_BATCH_BUCKETS 8
+
+/* worker counters in shared memory */
+struct worker_stats {
+	/* connections accepted per wakeup */
+	unsigned long batches[WORKER_BATCH_BUCKETS];
+	/* the thread pool, if there is one */
+	struct pool_stats pool;
+	/* the coroutines, if the worker runs any */
+	struct {
+		unsigned int running;
+		unsigned long spawned;
+		unsigned long switches;
+		unsigned long timeouts;
+	} coro;
+};
+
+void worker_loop(
+	const struct log_cfg *lcfg,
+	const struct request_cfg *rcfg,
+	struct worker_stats *stats,
+	int ipcsock,
+	int af,
+	int sockfd
+);
 
 #endif /* __mekdotlu_worker_h */
 